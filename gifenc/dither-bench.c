@@ -0,0 +1,135 @@
+/* simple gif encoder
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Measures how long dithering takes with every set of CPU extensions and
+ * checks that they all produce the same result. Build it with
+ * "make dither-bench" and run it as "./dither-bench [WIDTH HEIGHT]". */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "gifenc.h"
+
+#define N_RUNS 10
+
+/* a gradient with some noise, so the image has many colors */
+static guint32 *
+create_image (guint width, guint height)
+{
+  guint32 *image, noise = 1;
+  guint x, y;
+
+  image = g_new (guint32, width * height);
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++) {
+      noise = noise * 1103515245 + 12345;
+      image[y * width + x] = ((x * 255 / width) << 16) |
+	((y * 255 / height) << 8) |
+	(((x + y) / 8 + (noise >> 29)) & 0xFF);
+    }
+  }
+  return image;
+}
+
+/* returns the fastest of N_RUNS in milliseconds */
+static double
+bench_dither (const GifencPalette *palette, const guint32 *image,
+    guint width, guint height, guint8 *target, guint8 *full)
+{
+  GTimer *timer;
+  double best = G_MAXDOUBLE;
+  guint i;
+
+  timer = g_timer_new ();
+  for (i = 0; i < N_RUNS; i++) {
+    memset (full, 0, width * height);
+    g_timer_start (timer);
+    gifenc_dither_rgb_with_full_image (target, width, full, width, palette,
+	(const guint8 *) image, width, height, width * 4, NULL);
+    g_timer_stop (timer);
+    best = MIN (best, g_timer_elapsed (timer, NULL));
+  }
+  g_timer_destroy (timer);
+
+  return best * 1000;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const struct {
+    const char *	name;
+    GifencCpuFlags	flags;
+  } extensions[] = {
+    { "C", 0 },
+    { "SSE2", GIFENC_CPU_SSE2 }
+  };
+  GifencCpuFlags supported;
+  GifencPalette *palette;
+  guint8 *target, *full, *reference;
+  guint32 *image;
+  guint width = 1920, height = 1080, i, fast;
+  gboolean same = TRUE;
+
+  if (argc == 3) {
+    width = strtoul (argv[1], NULL, 0);
+    height = strtoul (argv[2], NULL, 0);
+  }
+  if (width == 0 || height == 0) {
+    g_printerr ("usage: %s [WIDTH HEIGHT]\n", argv[0]);
+    return 2;
+  }
+
+  image = create_image (width, height);
+  palette = gifenc_quantize_image ((const guint8 *) image, width, height,
+      width * 4, TRUE, 256);
+  target = g_malloc (width * height);
+  full = g_malloc (width * height);
+  reference = g_malloc (width * height);
+  supported = gifenc_get_cpu_flags ();
+
+  for (fast = 0; fast < 2; fast++) {
+    gifenc_palette_set_fast_lookup (palette, fast);
+    for (i = 0; i < G_N_ELEMENTS (extensions); i++) {
+      gboolean differs = FALSE;
+      double ms;
+
+      if ((extensions[i].flags & supported) != extensions[i].flags)
+	continue;
+      gifenc_set_cpu_flags (extensions[i].flags);
+      ms = bench_dither (palette, image, width, height, target, full);
+      if (i == 0)
+	memcpy (reference, full, width * height);
+      else
+	differs = memcmp (reference, full, width * height) != 0;
+      g_print ("%ux%u %s lookup, %-4s: %7.2f ms%s\n", width, height,
+	  fast ? "fast" : "nearest", extensions[i].name, ms,
+	  differs ? " DIFFERENT RESULT" : "");
+      same &= !differs;
+    }
+  }
+  gifenc_palette_free (palette);
+  g_free (reference);
+  g_free (full);
+  g_free (target);
+  g_free (image);
+
+  return same ? 0 : 1;
+}
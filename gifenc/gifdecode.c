@@ -0,0 +1,230 @@
+/* simple gif encoder
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "gifdecode.h"
+
+static void
+decoded_image_free (gpointer data)
+{
+  DecodedImage *image = data;
+
+  g_free ((gpointer) image->colors);
+  g_free (image->data);
+  g_free (image);
+}
+
+void
+decoded_gif_free (DecodedGif *gif)
+{
+  g_ptr_array_unref (gif->images);
+  g_free (gif);
+}
+
+static guint
+read_code (const guint8 *data, gsize len, gsize *bit, guint n_bits)
+{
+  guint i, code = 0;
+
+  g_assert (*bit + n_bits <= len * 8);
+  for (i = 0; i < n_bits; i++, (*bit)++) {
+    code |= ((data[*bit >> 3] >> (*bit & 7)) & 1) << i;
+  }
+  return code;
+}
+
+/* decodes LZW data into the n_pixels of target */
+static void
+decode_lzw (DecodedGif *gif, const guint8 *data, gsize len, guint codesize,
+    guint8 *target, gsize n_pixels)
+{
+  guint16 prefix[4096];
+  guint8 suffix[4096], first[4096];
+  guint length[4096];
+  guint clear = 1 << codesize, eof = clear + 1;
+  guint code, prev = G_MAXUINT, size = 0, wordsize = codesize + 1;
+  gsize bit = 0, n = 0;
+  guint i, c;
+
+  for (;;) {
+    code = read_code (data, len, &bit, wordsize);
+    if (code == clear) {
+      if (size != 0)
+        gif->n_clears++;
+      for (i = 0; i < clear; i++) {
+        suffix[i] = first[i] = i;
+        length[i] = 1;
+      }
+      size = clear + 2;
+      wordsize = codesize + 1;
+      prev = G_MAXUINT;
+      continue;
+    }
+    if (code == eof)
+      break;
+    g_assert (size > 0);
+    if (prev == G_MAXUINT) {
+      g_assert (code < clear);
+      g_assert (n < n_pixels);
+      target[n++] = code;
+      prev = code;
+      continue;
+    }
+    g_assert (code <= size);
+    if (size < 4096) {
+      prefix[size] = prev;
+      suffix[size] = code < size ? first[code] : first[prev];
+      first[size] = first[prev];
+      length[size] = length[prev] + 1;
+      size++;
+      if (size == (1u << wordsize) && wordsize < 12)
+        wordsize++;
+    } else {
+      gif->n_full_codes++;
+    }
+    g_assert (n + length[code] <= n_pixels);
+    for (i = length[code], c = code; i > 0; i--) {
+      target[n + i - 1] = suffix[c];
+      c = prefix[c];
+    }
+    n += length[code];
+    prev = code;
+  }
+  g_assert_cmpuint (n, ==, n_pixels);
+}
+
+static void
+read_color_table (guint32 *colors, const guint8 *data, guint n_colors)
+{
+  guint i;
+
+  for (i = 0; i < n_colors; i++) {
+    colors[i] = (data[3 * i] << 16) | (data[3 * i + 1] << 8) | data[3 * i + 2];
+  }
+}
+
+DecodedGif *
+decode_gif (const guint8 *data, gsize len)
+{
+  DecodedGif *gif;
+  DecodedImage *image;
+  GByteArray *lzw;
+  gsize p;
+  int transparent = -1;
+  guint delay = 0, flags, codesize;
+
+  g_assert (len >= 13 && memcmp (data, "GIF89a", 6) == 0);
+  gif = g_new0 (DecodedGif, 1);
+  gif->images = g_ptr_array_new_with_free_func (decoded_image_free);
+  gif->width = data[6] | data[7] << 8;
+  gif->height = data[8] | data[9] << 8;
+  p = 13;
+  if (data[10] & 0x80) {
+    read_color_table (gif->global, data + p, 2 << (data[10] & 7));
+    p += 3 * (2 << (data[10] & 7));
+  }
+
+  for (;;) {
+    g_assert (p < len);
+    switch (data[p++]) {
+      case 0x3B:
+        g_assert_cmpuint (p, ==, len);
+        return gif;
+      case 0x21:
+        /* graphic control extension */
+        if (data[p] == 0xF9) {
+          transparent = (data[p + 2] & 1) ? data[p + 5] : -1;
+          delay = data[p + 3] | data[p + 4] << 8;
+        }
+        p++;
+        while (data[p])
+          p += 1 + data[p];
+        p++;
+        break;
+      case 0x2C:
+        image = g_new0 (DecodedImage, 1);
+        image->x = data[p] | data[p + 1] << 8;
+        image->y = data[p + 2] | data[p + 3] << 8;
+        image->width = data[p + 4] | data[p + 5] << 8;
+        image->height = data[p + 6] | data[p + 7] << 8;
+        image->delay = delay;
+        image->transparent = transparent;
+        g_assert (image->x + image->width <= gif->width);
+        g_assert (image->y + image->height <= gif->height);
+        flags = data[p + 8];
+        p += 9;
+        image->colors = g_memdup (gif->global, sizeof (gif->global));
+        if (flags & 0x80) {
+          read_color_table ((guint32 *) image->colors, data + p, 2 << (flags & 7));
+          p += 3 * (2 << (flags & 7));
+        }
+        codesize = data[p++];
+        lzw = g_byte_array_new ();
+        while (data[p]) {
+          g_byte_array_append (lzw, data + p + 1, data[p]);
+          p += 1 + data[p];
+        }
+        p++;
+        image->data = g_malloc ((gsize) image->width * image->height);
+        decode_lzw (gif, lzw->data, lzw->len, codesize, image->data,
+            (gsize) image->width * image->height);
+        g_byte_array_unref (lzw);
+        g_ptr_array_add (gif->images, image);
+        break;
+      default:
+        g_assert_not_reached ();
+    }
+  }
+}
+
+/* Draws the images onto a canvas that starts out black and returns a copy
+ * of the canvas for every image that is shown for some time. If delays
+ * isn't NULL, the delays of those frames are appended to it. */
+GPtrArray *
+decoded_gif_get_frames (const DecodedGif *gif, GArray *delays)
+{
+  GPtrArray *frames;
+  DecodedImage *image;
+  guint32 *canvas;
+  guint i, x, y;
+  guint8 index;
+
+  frames = g_ptr_array_new_with_free_func (g_free);
+  canvas = g_new0 (guint32, (gsize) gif->width * gif->height);
+  for (i = 0; i < gif->images->len; i++) {
+    image = g_ptr_array_index (gif->images, i);
+    for (y = 0; y < image->height; y++) {
+      for (x = 0; x < image->width; x++) {
+        index = image->data[y * image->width + x];
+        if (index != image->transparent)
+          canvas[(image->y + y) * gif->width + image->x + x] = image->colors[index];
+      }
+    }
+    if (image->delay == 0)
+      continue;
+    g_ptr_array_add (frames, g_memdup (canvas, (gsize) gif->width * gif->height * sizeof (guint32)));
+    if (delays)
+      g_array_append_val (delays, image->delay);
+  }
+  g_free (canvas);
+
+  return frames;
+}
@@ -0,0 +1,52 @@
+/* simple gif encoder
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A minimal GIF decoder for the tests. It asserts on everything it
+ * doesn't understand, so it's only useful for checking our own output. */
+
+#include <glib.h>
+
+#ifndef __HAVE_GIFDECODE_H__
+#define __HAVE_GIFDECODE_H__
+
+typedef struct {
+  guint			x;		/* position of the image */
+  guint			y;
+  guint			width;		/* size of the image */
+  guint			height;
+  guint			delay;		/* delay after the image in 1/100th seconds */
+  const guint32 *	colors;		/* palette of the image */
+  int			transparent;	/* transparent index or -1 */
+  guint8 *		data;		/* width * height palette indexes */
+} DecodedImage;
+
+typedef struct {
+  guint			width;		/* size of the GIF */
+  guint			height;
+  guint32		global[256];	/* global color table */
+  GPtrArray *		images;		/* the DecodedImages in the GIF */
+  guint			n_clears;	/* clear codes that didn't start an image */
+  guint			n_full_codes;	/* codes read while the dictionary was full */
+} DecodedGif;
+
+DecodedGif *	decode_gif		(const guint8 *		data,
+					 gsize			len);
+void		decoded_gif_free	(DecodedGif *		gif);
+GPtrArray *	decoded_gif_get_frames	(const DecodedGif *	gif,
+					 GArray *		delays);
+
+#endif /* __HAVE_GIFDECODE_H__ */
@@ -0,0 +1,824 @@
+/* simple gif encoder
+ * Copyright (C) 2005 Benjamin Otte <otte@gnome.org
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Encodes images with gifenc, decodes the result with a minimal GIF
+ * decoder and compares it with what was encoded. Run it with
+ * "make check". */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gifdecode.h"
+#include "gifenc.h"
+
+#define WIDTH 512
+#define HEIGHT 384
+
+/*** HELPERS ***/
+
+static gboolean
+write_to_array (gpointer closure, const guchar *data, gsize len, GError **error)
+{
+  g_byte_array_append (closure, data, len);
+  return TRUE;
+}
+
+static Gifenc *
+encoder_new (GByteArray *array, GifencPalette *palette)
+{
+  GError *error = NULL;
+  Gifenc *enc;
+
+  enc = gifenc_new (WIDTH, HEIGHT, write_to_array, array, NULL);
+  gifenc_initialize (enc, palette, TRUE, &error);
+  g_assert_no_error (error);
+  return enc;
+}
+
+static DecodedGif *
+encoder_finish (Gifenc *enc, GByteArray *array)
+{
+  GError *error = NULL;
+  DecodedGif *gif;
+
+  gifenc_close (enc, &error);
+  g_assert_no_error (error);
+  gif = decode_gif (array->data, array->len);
+  g_assert_cmpuint (gif->width, ==, WIDTH);
+  g_assert_cmpuint (gif->height, ==, HEIGHT);
+  return gif;
+}
+
+static void
+add_image (Gifenc *enc, guint8 *data)
+{
+  GError *error = NULL;
+
+  gifenc_add_image (enc, 0, 0, WIDTH, HEIGHT, 100, data, WIDTH, &error);
+  g_assert_no_error (error);
+}
+
+static guint32
+random_next (guint32 *seed)
+{
+  *seed = *seed * 1103515245 + 12345;
+  return *seed >> 16;
+}
+
+/* Palette indexes that are noise of 4 colors in the top half and of all
+ * colors in the bottom half. The dictionary fills up in the top half and
+ * has to be cleared when the bottom half compresses worse. The left border
+ * is transparent. */
+static guint8 *
+create_indexes (const GifencPalette *palette)
+{
+  guint alpha = gifenc_palette_get_alpha_index (palette);
+  guint n_colors = gifenc_palette_get_num_colors (palette);
+  guint32 seed = 1;
+  guint8 *data;
+  guint x, y;
+
+  data = g_malloc (WIDTH * HEIGHT);
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      if (x < 40 + y % 7)
+        data[y * WIDTH + x] = alpha;
+      else if (y < HEIGHT / 2)
+        data[y * WIDTH + x] = random_next (&seed) % 4;
+      else
+        data[y * WIDTH + x] = random_next (&seed) % n_colors;
+    }
+  }
+  return data;
+}
+
+/* a smooth gradient with some noise, so it has many colors */
+static guint32 *
+create_gradient (void)
+{
+  guint32 *image, seed = 1;
+  guint x, y, r, g, b;
+
+  image = g_new (guint32, WIDTH * HEIGHT);
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      r = x * 255 / WIDTH;
+      g = y * 255 / HEIGHT;
+      b = MIN (255, (x + y) * 255 / (WIDTH + HEIGHT) + random_next (&seed) % 8);
+      image[y * WIDTH + x] = (r << 16) | (g << 8) | b;
+    }
+  }
+  return image;
+}
+
+/* an image with fewer than 255 colors, so they can all be in the palette */
+static guint32 *
+create_few_colors (void)
+{
+  guint32 *image;
+  guint x, y, i;
+
+  image = g_new (guint32, WIDTH * HEIGHT);
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      i = (x / 16 + (y / 16) * 32) % 200;
+      image[y * WIDTH + x] = (i * 0x010305) & 0xFFFFFF;
+    }
+  }
+  return image;
+}
+
+/* checks the single image of gif is the full frame made of the indexes */
+static void
+check_indexes (DecodedGif *gif, const guint8 *data)
+{
+  DecodedImage *image;
+
+  g_assert_cmpuint (gif->images->len, ==, 1);
+  image = g_ptr_array_index (gif->images, 0);
+  g_assert_cmpuint (image->x, ==, 0);
+  g_assert_cmpuint (image->y, ==, 0);
+  g_assert_cmpuint (image->width, ==, WIDTH);
+  g_assert_cmpuint (image->height, ==, HEIGHT);
+  g_assert (memcmp (image->data, data, WIDTH * HEIGHT) == 0);
+}
+
+/* encodes image with palette and checks the result shows the dithered colors.
+ * This frees palette. */
+static void
+check_dithered (const guint32 *image, GifencPalette *palette, gboolean exact)
+{
+  GByteArray *array = g_byte_array_new ();
+  DecodedImage *decoded;
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint8 *data;
+  guint i;
+
+  data = g_malloc (WIDTH * HEIGHT);
+  gifenc_dither_rgb (data, WIDTH, palette, (const guint8 *) image,
+      WIDTH, HEIGHT, WIDTH * 4);
+  enc = encoder_new (array, palette);
+  add_image (enc, data);
+  gif = encoder_finish (enc, array);
+  check_indexes (gif, data);
+
+  decoded = g_ptr_array_index (gif->images, 0);
+  for (i = 0; i < WIDTH * HEIGHT; i++) {
+    g_assert_cmpint (decoded->data[i], !=, decoded->transparent);
+    g_assert_cmpuint (decoded->colors[decoded->data[i]], ==,
+        gifenc_palette_get_color (palette, data[i]));
+    if (exact)
+      g_assert_cmpuint (decoded->colors[decoded->data[i]], ==, image[i] & 0xFFFFFF);
+  }
+
+  decoded_gif_free (gif);
+  gifenc_free (enc);
+  g_byte_array_unref (array);
+  g_free (data);
+}
+
+/* root mean square distance of the pixels of image to the closest palette color */
+static double
+palette_error (const guint32 *image, const GifencPalette *palette)
+{
+  guint i, j;
+  guint32 color;
+  guint64 sum = 0;
+  guint best, dist;
+  int dr, dg, db;
+
+  for (i = 0; i < WIDTH * HEIGHT; i += 7) {
+    best = G_MAXUINT;
+    for (j = 0; j < palette->num_colors; j++) {
+      color = gifenc_palette_get_color (palette, j);
+      dr = (int) ((image[i] >> 16) & 0xFF) - (int) ((color >> 16) & 0xFF);
+      dg = (int) ((image[i] >> 8) & 0xFF) - (int) ((color >> 8) & 0xFF);
+      db = (int) (image[i] & 0xFF) - (int) (color & 0xFF);
+      dist = dr * dr + dg * dg + db * db;
+      best = MIN (best, dist);
+    }
+    sum += best;
+  }
+  return sqrt ((double) sum / ((WIDTH * HEIGHT + 6) / 7));
+}
+
+/*** TESTS ***/
+
+static void
+test_lzw (void)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  GByteArray *array = g_byte_array_new ();
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint8 *data;
+
+  data = create_indexes (palette);
+  enc = encoder_new (array, palette);
+  add_image (enc, data);
+  gif = encoder_finish (enc, array);
+  check_indexes (gif, data);
+  /* the dictionary was full for a while and cleared when the noise started */
+  g_assert_cmpuint (gif->n_full_codes, >, 0);
+  g_assert_cmpuint (gif->n_clears, >, 0);
+
+  decoded_gif_free (gif);
+  gifenc_free (enc);
+  g_byte_array_unref (array);
+  g_free (data);
+}
+
+/* The dictionary is kept as long as it compresses as well as before, so
+ * noise that looks the same everywhere never clears it. */
+static void
+test_lzw_keep (void)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  GByteArray *array = g_byte_array_new ();
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint32 seed = 1;
+  guint8 *data;
+  guint i;
+
+  data = g_malloc (WIDTH * HEIGHT);
+  for (i = 0; i < WIDTH * HEIGHT; i++)
+    data[i] = random_next (&seed) % 16;
+  enc = encoder_new (array, palette);
+  add_image (enc, data);
+  gif = encoder_finish (enc, array);
+  check_indexes (gif, data);
+  g_assert_cmpuint (gif->n_full_codes, >, 0);
+  g_assert_cmpuint (gif->n_clears, ==, 0);
+
+  decoded_gif_free (gif);
+  gifenc_free (enc);
+  g_byte_array_unref (array);
+  g_free (data);
+}
+
+/* Transparent runs of all lengths, some longer than the dictionary can
+ * hold, separated by a few other pixels. The image ends with a run. */
+static void
+test_transparent_runs (void)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  GByteArray *array = g_byte_array_new ();
+  guint alpha = gifenc_palette_get_alpha_index (palette);
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint32 seed = 1;
+  guint8 *data;
+  guint i, n, run = 1;
+
+  data = g_malloc (WIDTH * HEIGHT);
+  for (i = 0; i < WIDTH * HEIGHT; ) {
+    for (n = MIN (run, WIDTH * HEIGHT - i); n > 0; n--)
+      data[i++] = alpha;
+    for (n = random_next (&seed) % 3; n > 0 && i < WIDTH * HEIGHT; n--)
+      data[i++] = random_next (&seed) % 4;
+    run = run < 64 ? run + 1 : random_next (&seed) % 6000 + 1;
+  }
+  enc = encoder_new (array, palette);
+  add_image (enc, data);
+  gif = encoder_finish (enc, array);
+  check_indexes (gif, data);
+
+  decoded_gif_free (gif);
+  gifenc_free (enc);
+  g_byte_array_unref (array);
+  g_free (data);
+}
+
+static void
+test_stripes (void)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  GByteArray *array = g_byte_array_new ();
+  GError *error = NULL;
+  GifencImage *image;
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint8 *data;
+  guint i, y, height;
+
+  data = create_indexes (palette);
+  enc = encoder_new (array, palette);
+  gifenc_set_n_stripes (enc, 4);
+  image = gifenc_image_new (enc, 0, 0, WIDTH, HEIGHT);
+  g_assert_cmpuint (gifenc_image_get_n_stripes (image), >, 1);
+  /* fill the stripes back to front, they must not depend on each other */
+  for (i = gifenc_image_get_n_stripes (image); i > 0; i--) {
+    gifenc_image_get_stripe (image, i - 1, &y, &height);
+    for (; height > 0; height--, y++) {
+      gifenc_image_add_row (image, i - 1, data + y * WIDTH);
+    }
+  }
+  gifenc_image_write (image, 100, &error);
+  g_assert_no_error (error);
+  gifenc_image_free (image);
+  gif = encoder_finish (enc, array);
+  check_indexes (gif, data);
+
+  decoded_gif_free (gif);
+  gifenc_free (enc);
+  g_byte_array_unref (array);
+  g_free (data);
+}
+
+/* encodes data row by row, with full as the displayed image if given, and
+ * returns the number of bytes of image data */
+static DecodedGif *
+encode_with_full_image (const guint8 *data, const guint8 *full, guint64 *bytes)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  GByteArray *array = g_byte_array_new ();
+  GError *error = NULL;
+  GifencImage *image;
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint y;
+
+  enc = encoder_new (array, palette);
+  image = gifenc_image_new (enc, 0, 0, WIDTH, HEIGHT);
+  for (y = 0; y < HEIGHT; y++) {
+    gifenc_image_add_row_with_full_image (image, 0, data + y * WIDTH,
+        full ? full + y * WIDTH : NULL);
+  }
+  gifenc_image_write (image, 100, &error);
+  g_assert_no_error (error);
+  gifenc_image_free (image);
+  *bytes = gifenc_get_stats (enc)->image_bytes;
+  gif = encoder_finish (enc, array);
+
+  gifenc_free (enc);
+  g_byte_array_unref (array);
+  return gif;
+}
+
+/* Half of the pixels of a striped image were repainted with the same
+ * color and are transparent. They may be encoded with the displayed color
+ * instead, which must make the image smaller. */
+static void
+test_full_image (void)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  guint alpha = gifenc_palette_get_alpha_index (palette);
+  DecodedImage *image;
+  DecodedGif *gif;
+  guint8 *data, *full;
+  guint32 seed = 1;
+  guint64 bytes, full_bytes;
+  guint i, x, y, n_replaced = 0;
+
+  data = g_malloc (WIDTH * HEIGHT);
+  full = g_malloc (WIDTH * HEIGHT);
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      i = y * WIDTH + x;
+      full[i] = (x / 8 + y) % 4;
+      if (x >= 100 && x < 200 && y >= 100 && y < 200)
+        data[i] = 4 + (x + y) % 3;
+      else
+        data[i] = random_next (&seed) % 2 ? alpha : full[i];
+    }
+  }
+  gifenc_palette_free (palette);
+
+  gif = encode_with_full_image (data, NULL, &bytes);
+  check_indexes (gif, data);
+  decoded_gif_free (gif);
+
+  gif = encode_with_full_image (data, full, &full_bytes);
+  g_assert_cmpuint (full_bytes, <, bytes);
+  g_assert_cmpuint (gif->images->len, ==, 1);
+  image = g_ptr_array_index (gif->images, 0);
+  for (i = 0; i < WIDTH * HEIGHT; i++) {
+    if (image->data[i] == data[i])
+      continue;
+    g_assert_cmpuint (data[i], ==, alpha);
+    g_assert_cmpuint (image->data[i], ==, full[i]);
+    n_replaced++;
+  }
+  g_assert_cmpuint (n_replaced, >, 0);
+  decoded_gif_free (gif);
+
+  g_free (data);
+  g_free (full);
+}
+
+static void
+test_lossy (void)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  GByteArray *array = g_byte_array_new ();
+  const GifencStats *stats;
+  DecodedImage *image;
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint8 *data;
+  guint i, tolerance = 70, alpha;
+  guint32 a, b;
+  int dr, dg, db;
+
+  alpha = gifenc_palette_get_alpha_index (palette);
+  data = create_indexes (palette);
+  enc = encoder_new (array, palette);
+  gifenc_set_n_stripes (enc, 4);
+  gifenc_set_lossy (enc, tolerance, TRUE);
+  add_image (enc, data);
+  stats = gifenc_get_stats (enc);
+  g_assert_cmpuint (stats->image_bytes, <, stats->exact_image_bytes);
+  gif = encoder_finish (enc, array);
+
+  g_assert_cmpuint (gif->images->len, ==, 1);
+  image = g_ptr_array_index (gif->images, 0);
+  g_assert (memcmp (image->data, data, WIDTH * HEIGHT) != 0);
+  for (i = 0; i < WIDTH * HEIGHT; i++) {
+    /* transparent pixels are never changed or used as replacements */
+    if (data[i] == alpha || image->data[i] == alpha) {
+      g_assert_cmpuint (image->data[i], ==, data[i]);
+      continue;
+    }
+    a = gifenc_palette_get_color (palette, data[i]);
+    b = image->colors[image->data[i]];
+    dr = (int) ((a >> 16) & 0xFF) - (int) ((b >> 16) & 0xFF);
+    dg = (int) ((a >> 8) & 0xFF) - (int) ((b >> 8) & 0xFF);
+    db = (int) (a & 0xFF) - (int) (b & 0xFF);
+    g_assert_cmpuint (dr * dr + dg * dg + db * db, <=, tolerance * tolerance);
+  }
+
+  decoded_gif_free (gif);
+  gifenc_free (enc);
+  g_byte_array_unref (array);
+  g_free (data);
+}
+
+/* An image with a local palette between two that use the global one. The
+ * local palette is smaller and has its own transparent index, and lossy
+ * compression must not touch the image. */
+static void
+test_local_palette (void)
+{
+  GifencPalette *palette = gifenc_palette_get_simple (TRUE);
+  GByteArray *array = g_byte_array_new ();
+  GifencPalette *local;
+  GError *error = NULL;
+  GifencImage *image;
+  DecodedImage *decoded;
+  DecodedGif *gif;
+  Gifenc *enc;
+  guint32 *colors;
+  guint8 *indexes, *data;
+  guint i, y;
+
+  colors = create_few_colors ();
+  local = gifenc_quantize_image ((const guint8 *) colors, WIDTH, HEIGHT,
+      WIDTH * 4, TRUE, 15);
+  g_assert_cmpuint (gifenc_palette_get_num_colors (local), <=, 16);
+  data = g_malloc (WIDTH * HEIGHT);
+  gifenc_dither_rgb (data, WIDTH, local, (const guint8 *) colors,
+      WIDTH, HEIGHT, WIDTH * 4);
+
+  indexes = create_indexes (palette);
+  enc = encoder_new (array, palette);
+  gifenc_set_lossy (enc, 70, FALSE);
+  add_image (enc, indexes);
+  image = gifenc_image_new (enc, 0, 0, WIDTH, HEIGHT);
+  gifenc_image_set_palette (image, local);
+  for (y = 0; y < HEIGHT; y++)
+    gifenc_image_add_row (image, 0, data + y * WIDTH);
+  gifenc_image_write (image, 100, &error);
+  g_assert_no_error (error);
+  gifenc_image_free (image);
+  add_image (enc, indexes);
+  g_assert_cmpuint (gifenc_get_stats (enc)->n_local_palettes, ==, 1);
+  gif = encoder_finish (enc, array);
+
+  g_assert_cmpuint (gif->images->len, ==, 3);
+  decoded = g_ptr_array_index (gif->images, 1);
+  g_assert (memcmp (decoded->data, data, WIDTH * HEIGHT) == 0);
+  g_assert_cmpint (decoded->transparent, ==, gifenc_palette_get_alpha_index (local));
+  for (i = 0; i < WIDTH * HEIGHT; i++) {
+    g_assert_cmpuint (decoded->colors[decoded->data[i]], ==,
+        gifenc_palette_get_color (local, data[i]));
+  }
+  /* the image after it uses the global palette again */
+  decoded = g_ptr_array_index (gif->images, 2);
+  for (i = 0; i < gifenc_palette_get_alpha_index (palette); i++) {
+    g_assert_cmpuint (decoded->colors[i], ==, gifenc_palette_get_color (palette, i));
+  }
+
+  decoded_gif_free (gif);
+  gifenc_free (enc);
+  gifenc_palette_free (local);
+  g_byte_array_unref (array);
+  g_free (colors);
+  g_free (indexes);
+  g_free (data);
+}
+
+static void
+test_exact_palette (void)
+{
+  GifencQuantizer quantizers[] = { GIFENC_QUANTIZER_OCTREE,
+    GIFENC_QUANTIZER_MEDIAN_CUT, GIFENC_QUANTIZER_WU };
+  GifencHistogram *hist;
+  GifencPalette *palette;
+  guint32 *image;
+  guint i;
+
+  image = create_few_colors ();
+  hist = gifenc_histogram_new ();
+  gifenc_histogram_add_image (hist, (const guint8 *) image, WIDTH, HEIGHT,
+      WIDTH * 4, WIDTH * HEIGHT);
+  g_assert_cmpuint (gifenc_histogram_get_n_colors (hist), ==, 200);
+  for (i = 0; i < G_N_ELEMENTS (quantizers); i++) {
+    palette = gifenc_quantize_histogram (hist, quantizers[i], TRUE, 255);
+    /* the image colors are in the palette, so dithering changes nothing */
+    g_assert (palette->exact != NULL);
+    check_dithered (image, palette, TRUE);
+  }
+
+  gifenc_histogram_free (hist);
+  g_free (image);
+}
+
+/* dithers image with and without palette->exact into data, which holds
+ * 6 images: the indexes, the indexes with a full image and the full image
+ * of each */
+static void
+dither_exact_and_not (const guint32 *image, GifencPalette *palette, guint8 *data)
+{
+  guint32 *exact = palette->exact;
+  cairo_rectangle_int_t rect, inexact_rect;
+  guint i;
+
+  for (i = 0; i < 2; i++) {
+    gifenc_dither_rgb (data, WIDTH, palette, (const guint8 *) image,
+        WIDTH, HEIGHT, WIDTH * 4);
+    memset (data + 2 * WIDTH * HEIGHT, 0, WIDTH * HEIGHT);
+    g_assert (gifenc_dither_rgb_with_full_image (data + WIDTH * HEIGHT, WIDTH,
+          data + 2 * WIDTH * HEIGHT, WIDTH, palette, (const guint8 *) image,
+          WIDTH, HEIGHT, WIDTH * 4, i ? &inexact_rect : &rect));
+    data += 3 * WIDTH * HEIGHT;
+    palette->exact = NULL;
+  }
+  palette->exact = exact;
+
+  g_assert_cmpint (rect.x, ==, inexact_rect.x);
+  g_assert_cmpint (rect.y, ==, inexact_rect.y);
+  g_assert_cmpint (rect.width, ==, inexact_rect.width);
+  g_assert_cmpint (rect.height, ==, inexact_rect.height);
+}
+
+/* Rows that only have palette colors must still be dithered when error is
+ * carried into them from the rows above. */
+static void
+test_exact_palette_error (void)
+{
+  GifencHistogram *hist;
+  GifencPalette *palette;
+  guint32 *image, *gradient;
+  guint8 *data, row[WIDTH];
+  guint rows = 8;
+
+  image = create_few_colors ();
+  hist = gifenc_histogram_new ();
+  gifenc_histogram_add_image (hist, (const guint8 *) image, WIDTH, HEIGHT,
+      WIDTH * 4, WIDTH * HEIGHT);
+  palette = gifenc_quantize_histogram (hist, GIFENC_QUANTIZER_OCTREE, TRUE, 255);
+  g_assert (palette->exact != NULL);
+  /* the top rows are a gradient that isn't in the palette */
+  gradient = create_gradient ();
+  memcpy (image, gradient, rows * WIDTH * 4);
+
+  data = g_malloc (6 * WIDTH * HEIGHT);
+  dither_exact_and_not (image, palette, data);
+  g_assert (memcmp (data, data + 3 * WIDTH * HEIGHT, 3 * WIDTH * HEIGHT) == 0);
+  /* the first row of palette colors is different from its exact colors */
+  gifenc_dither_rgb (row, WIDTH, palette, (const guint8 *) (image + rows * WIDTH),
+      WIDTH, 1, WIDTH * 4);
+  g_assert (memcmp (row, data + rows * WIDTH, WIDTH) != 0);
+
+  g_free (data);
+  g_free (gradient);
+  gifenc_palette_free (palette);
+  gifenc_histogram_free (hist);
+  g_free (image);
+}
+
+static void
+check_quantizer (GifencQuantizer quantizer)
+{
+  GifencHistogram *hist;
+  GifencPalette *palette;
+  guint32 *image;
+
+  image = create_gradient ();
+  hist = gifenc_histogram_new ();
+  gifenc_histogram_add_image (hist, (const guint8 *) image, WIDTH, HEIGHT,
+      WIDTH * 4, WIDTH * HEIGHT);
+  g_assert_cmpuint (gifenc_histogram_get_n_colors (hist), >, 255);
+  palette = gifenc_quantize_histogram (hist, quantizer, TRUE, 255);
+  g_assert_cmpuint (gifenc_palette_get_num_colors (palette), <=, 255);
+  g_assert_cmpuint (gifenc_palette_get_num_colors (palette), >, 200);
+  g_assert_cmpfloat (palette_error (image, palette), <, 12.0);
+  check_dithered (image, palette, FALSE);
+
+  gifenc_histogram_free (hist);
+  g_free (image);
+}
+
+static void
+test_median_cut (void)
+{
+  check_quantizer (GIFENC_QUANTIZER_MEDIAN_CUT);
+}
+
+static void
+test_wu (void)
+{
+  check_quantizer (GIFENC_QUANTIZER_WU);
+}
+
+/* dithers image with palette, the second time with a full image that
+ * starts out as previous */
+static void
+dither_twice (const guint32 *image, const GifencPalette *palette,
+    const guint32 *previous, guint8 *data, guint8 *full,
+    cairo_rectangle_int_t *rect)
+{
+  gifenc_dither_rgb (data, WIDTH, palette, (const guint8 *) previous,
+      WIDTH, HEIGHT, WIDTH * 4);
+  memcpy (full, data, WIDTH * HEIGHT);
+  gifenc_dither_rgb (data, WIDTH, palette, (const guint8 *) image,
+      WIDTH, HEIGHT, WIDTH * 4);
+  g_assert (gifenc_dither_rgb_with_full_image (data + WIDTH * HEIGHT, WIDTH,
+        full, WIDTH, palette, (const guint8 *) image, WIDTH, HEIGHT,
+        WIDTH * 4, rect));
+}
+
+/* With ordered dithering, the index of a pixel only depends on its color
+ * and position. So dithering part of the image gives the same indexes as
+ * dithering all of it, and pixels that didn't change keep their index. */
+static void
+test_ordered (void)
+{
+  cairo_rectangle_int_t box = { 150, 120, 100, 100 };
+  cairo_rectangle_int_t area = { 101, 80, 299, 200 };
+  GifencPalette *palette;
+  GifencDither *dither;
+  guint32 *image, *changed;
+  guint8 *data, *full, *expected, target[WIDTH];
+  guint alpha, x, y, first, last;
+
+  image = create_gradient ();
+  palette = gifenc_quantize_image ((const guint8 *) image, WIDTH, HEIGHT,
+      WIDTH * 4, TRUE, 255);
+  alpha = gifenc_palette_get_alpha_index (palette);
+  data = g_malloc (WIDTH * HEIGHT);
+  gifenc_dither_rgb_ordered (data, WIDTH, palette, (const guint8 *) image,
+      0, 0, WIDTH, HEIGHT, WIDTH * 4);
+
+  full = g_malloc (WIDTH * HEIGHT);
+  gifenc_dither_rgb_ordered (full, WIDTH, palette,
+      (const guint8 *) (image + 53 * WIDTH + 37), 37, 53, 200, 100, WIDTH * 4);
+  for (y = 0; y < 100; y++) {
+    g_assert (memcmp (full + y * WIDTH, data + (53 + y) * WIDTH + 37, 200) == 0);
+  }
+
+  /* invert a box and dither an area around it row by row, the area
+   * starts at an odd column so the pattern doesn't line up by chance */
+  changed = g_memdup (image, WIDTH * HEIGHT * 4);
+  for (y = box.y; y < box.y + box.height; y++) {
+    for (x = box.x; x < box.x + box.width; x++)
+      changed[y * WIDTH + x] ^= 0xFFFFFF;
+  }
+  expected = g_malloc (WIDTH * HEIGHT);
+  gifenc_dither_rgb_ordered (expected, WIDTH, palette, (const guint8 *) changed,
+      0, 0, WIDTH, HEIGHT, WIDTH * 4);
+  memcpy (full, data, WIDTH * HEIGHT);
+  dither = gifenc_dither_new_ordered (palette, area.x, area.y, area.width);
+  for (y = area.y; y < area.y + area.height; y++) {
+    if (gifenc_dither_row_with_full_image (dither, target, full + y * WIDTH + area.x,
+          (const guint8 *) (changed + y * WIDTH + area.x), &first, &last)) {
+      g_assert_cmpuint (area.x + first, >=, box.x);
+      g_assert_cmpuint (area.x + last, <, box.x + box.width);
+    }
+    for (x = 0; x < area.width; x++) {
+      if (y < box.y || y >= box.y + box.height ||
+          area.x + x < box.x || area.x + x >= box.x + box.width)
+        g_assert_cmpuint (target[x], ==, alpha);
+    }
+  }
+  gifenc_dither_free (dither);
+  g_assert (memcmp (full, expected, WIDTH * HEIGHT) == 0);
+
+  gifenc_palette_free (palette);
+  g_free (image);
+  g_free (changed);
+  g_free (data);
+  g_free (full);
+  g_free (expected);
+}
+
+static void
+check_sse2 (const guint32 *image, const guint32 *previous, GifencPalette *palette)
+{
+  guint8 *data, *full, *c_data, *c_full;
+  cairo_rectangle_int_t rect, c_rect;
+
+  data = g_malloc (2 * WIDTH * HEIGHT);
+  full = g_malloc (WIDTH * HEIGHT);
+  c_data = g_malloc (2 * WIDTH * HEIGHT);
+  c_full = g_malloc (WIDTH * HEIGHT);
+
+  /* the error carried into the second half changes its result */
+  gifenc_dither_rgb (c_data, WIDTH, palette, (const guint8 *) (image + WIDTH * HEIGHT / 2),
+      WIDTH, HEIGHT / 2, WIDTH * 4);
+  dither_twice (image, palette, previous, data, full, &rect);
+  g_assert (memcmp (c_data, data + WIDTH * HEIGHT / 2, WIDTH * HEIGHT / 2) != 0);
+
+  gifenc_set_cpu_flags (0);
+  dither_twice (image, palette, previous, c_data, c_full, &c_rect);
+  gifenc_set_cpu_flags (~0);
+
+  g_assert (memcmp (data, c_data, 2 * WIDTH * HEIGHT) == 0);
+  g_assert (memcmp (full, c_full, WIDTH * HEIGHT) == 0);
+  g_assert_cmpint (rect.x, ==, c_rect.x);
+  g_assert_cmpint (rect.y, ==, c_rect.y);
+  g_assert_cmpint (rect.width, ==, c_rect.width);
+  g_assert_cmpint (rect.height, ==, c_rect.height);
+
+  g_free (data);
+  g_free (full);
+  g_free (c_data);
+  g_free (c_full);
+}
+
+/* the SSE2 kernel must dither exactly like the C one */
+static void
+test_sse2 (void)
+{
+  GifencPalette *palette;
+  guint32 *image, *previous;
+
+  if (!(gifenc_get_cpu_flags () & GIFENC_CPU_SSE2)) {
+    g_test_message ("SSE2 is not supported, skipping");
+    return;
+  }
+
+  image = create_gradient ();
+  previous = create_few_colors ();
+  palette = gifenc_quantize_image ((const guint8 *) image, WIDTH, HEIGHT,
+      WIDTH * 4, TRUE, 255);
+  check_sse2 (image, previous, palette);
+  gifenc_palette_set_fast_lookup (palette, TRUE);
+  check_sse2 (image, previous, palette);
+
+  gifenc_palette_free (palette);
+  g_free (image);
+  g_free (previous);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/gifenc/lzw", test_lzw);
+  g_test_add_func ("/gifenc/lzw-keep", test_lzw_keep);
+  g_test_add_func ("/gifenc/transparent-runs", test_transparent_runs);
+  g_test_add_func ("/gifenc/stripes", test_stripes);
+  g_test_add_func ("/gifenc/full-image", test_full_image);
+  g_test_add_func ("/gifenc/lossy", test_lossy);
+  g_test_add_func ("/gifenc/local-palette", test_local_palette);
+  g_test_add_func ("/gifenc/exact-palette", test_exact_palette);
+  g_test_add_func ("/gifenc/exact-palette-error", test_exact_palette_error);
+  g_test_add_func ("/gifenc/median-cut", test_median_cut);
+  g_test_add_func ("/gifenc/wu", test_wu);
+  g_test_add_func ("/gifenc/ordered", test_ordered);
+  g_test_add_func ("/gifenc/sse2", test_sse2);
+
+  return g_test_run ();
+}
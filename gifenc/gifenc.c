@@ -19,6 +19,7 @@
 #  include "config.h"
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -47,6 +48,111 @@ log2n (guint number)
 
 #define COLOR(r, g, b) (((r) << 16) | ((g) << 8) | (b))
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+/* compile code for x86 extensions and pick it at runtime */
+#define GIFENC_X86 1
+#endif
+
+/* Runs func for every id from 0 to n_jobs - 1 using a thread pool shared by
+ * all encoders. The calling thread takes part in the work, so it is safe to
+ * call this function from inside a job. */
+typedef struct {
+  GifencParallelFunc	func;
+  gpointer		data;
+  guint			n_jobs;
+  gint			next_job;	/* next id to run, atomic */
+  gint			ref_count;	/* atomic */
+  GMutex		mutex;
+  GCond			cond;
+  guint			n_done;		/* jobs finished, protected by mutex */
+} GifencParallel;
+
+static void
+gifenc_parallel_unref (GifencParallel *parallel)
+{
+  if (!g_atomic_int_dec_and_test (&parallel->ref_count))
+    return;
+
+  g_mutex_clear (&parallel->mutex);
+  g_cond_clear (&parallel->cond);
+  g_slice_free (GifencParallel, parallel);
+}
+
+static void
+gifenc_parallel_run_jobs (GifencParallel *parallel)
+{
+  guint n_done = 0;
+  gint id;
+
+  while ((id = g_atomic_int_add (&parallel->next_job, 1)) < (gint) parallel->n_jobs) {
+    parallel->func (parallel->data, id);
+    n_done++;
+  }
+  if (n_done == 0)
+    return;
+
+  g_mutex_lock (&parallel->mutex);
+  parallel->n_done += n_done;
+  if (parallel->n_done == parallel->n_jobs)
+    g_cond_signal (&parallel->cond);
+  g_mutex_unlock (&parallel->mutex);
+}
+
+static void
+gifenc_parallel_thread (gpointer data, gpointer unused)
+{
+  GifencParallel *parallel = data;
+
+  gifenc_parallel_run_jobs (parallel);
+  gifenc_parallel_unref (parallel);
+}
+
+void
+gifenc_parallel (GifencParallelFunc func, gpointer data, guint n_jobs)
+{
+  static gsize pool_init = 0;
+  static GThreadPool *pool = NULL;
+  static guint n_threads = 1;
+  GifencParallel *parallel;
+  guint i;
+
+  g_return_if_fail (func != NULL);
+
+  if (g_once_init_enter (&pool_init)) {
+    n_threads = g_get_num_processors ();
+    if (n_threads > 1)
+      pool = g_thread_pool_new (gifenc_parallel_thread, NULL, n_threads - 1, FALSE, NULL);
+    g_once_init_leave (&pool_init, 1);
+  }
+
+  if (n_jobs <= 1 || pool == NULL) {
+    for (i = 0; i < n_jobs; i++) {
+      func (data, i);
+    }
+    return;
+  }
+
+  parallel = g_slice_new0 (GifencParallel);
+  parallel->func = func;
+  parallel->data = data;
+  parallel->n_jobs = n_jobs;
+  parallel->ref_count = 1;
+  g_mutex_init (&parallel->mutex);
+  g_cond_init (&parallel->cond);
+
+  for (i = 1; i < MIN (n_jobs, n_threads); i++) {
+    g_atomic_int_inc (&parallel->ref_count);
+    g_thread_pool_push (pool, parallel, NULL);
+  }
+  gifenc_parallel_run_jobs (parallel);
+
+  g_mutex_lock (&parallel->mutex);
+  while (parallel->n_done < n_jobs)
+    g_cond_wait (&parallel->cond, &parallel->mutex);
+  g_mutex_unlock (&parallel->mutex);
+  gifenc_parallel_unref (parallel);
+}
+
 /*** WRITE ROUTINES ***/
 
 static gboolean
@@ -146,15 +252,16 @@ gifenc_write_color_table (Gifenc *enc, GifencPalette *palette)
   }
 }
 
-typedef struct {
-  guint x;
-  guint y;
-  guint width;
-  guint height;
-  GifencPalette *palette;
-  guint8 *data;
-  guint rowstride;
-} GifencImage;
+struct _GifencImage {
+  Gifenc *		enc;		/* encoder this image belongs to */
+  guint			x;		/* position of the image */
+  guint			y;
+  guint			width;		/* size of the image */
+  guint			height;
+  GifencPalette *	palette;	/* local palette or NULL to use the global one */
+  guint			n_stripes;	/* number of stripes */
+  GifencStripe *	stripes;	/* stripes the image is compressed in */
+};
 
 static void
 gifenc_write_image_description (Gifenc *enc, const GifencImage *image)
@@ -173,151 +280,647 @@ gifenc_write_image_description (Gifenc *enc, const GifencImage *image)
   gifenc_write_color_table (enc, image->palette);
 }
 
+/* Codes are packed into a 64bit accumulator and flushed to memory one 32bit
+ * word at a time. The data is written without sub-block headers into a buffer
+ * that is sized for the worst case up front, the headers are inserted when
+ * copying the result to the output buffer. */
 typedef struct {
-  guint8 data[255];
-  guint bytes;
-  guint current_data;
-  guint bits;
-} EncodeBuffer;
+  guint64 bits;		/* pending bits, the lowest bit is written first */
+  guint n_bits;		/* number of valid bits in bits */
+  guint8 *data;		/* data written so far */
+  gsize len;		/* number of bytes in data */
+} GifencBits;
+
+static inline void
+gifenc_bits_write (GifencBits *bits, guint code, guint n_bits)
+{
+  bits->bits |= (guint64) code << bits->n_bits;
+  bits->n_bits += n_bits;
+  if (bits->n_bits >= 32) {
+    guint32 word = GUINT32_TO_LE ((guint32) bits->bits);
+    memcpy (bits->data + bits->len, &word, 4);
+    bits->len += 4;
+    bits->bits >>= 32;
+    bits->n_bits -= 32;
+  }
+}
 
 static void
-gifenc_buffer_write (Gifenc *enc, EncodeBuffer *buffer)
+gifenc_bits_flush (GifencBits *bits)
 {
-  if (buffer->bytes == 0)
-    return;
-  gifenc_write_byte (enc, buffer->bytes);
-  g_byte_array_append (enc->buffer, buffer->data, buffer->bytes);
-  buffer->bytes = 0;
+  while (bits->n_bits > 0) {
+    bits->data[bits->len++] = bits->bits;
+    bits->bits >>= 8;
+    bits->n_bits = bits->n_bits > 8 ? bits->n_bits - 8 : 0;
+  }
+}
+
+/* maximum size in bytes of the LZW data for an image of n_pixels pixels */
+static gsize
+gifenc_bits_get_max_size (gsize n_pixels)
+{
+  gsize n_codes;
+
+  /* one code per pixel worst case, plus a clear code every 4096 - 258 codes,
+   * plus initial clear code, last pixel, final clear code and eof */
+  n_codes = n_pixels + n_pixels / (4096 - 258) + 4;
+  /* 12 bits per code and room for the last 32bit word */
+  return n_codes * 12 / 8 + 8;
 }
 
-static void G_GNUC_UNUSED
-print_bits (const char *text, guint data, int bits)
+static void
+gifenc_bits_init (GifencBits *bits, guint8 **data, gsize *size, gsize n_pixels)
 {
-  int i;
-  g_print ("%s %u (", text, data);
-  for (i = bits - 1; i >= 0; i--) {
-    g_print ("%c", data & (1 << i) ? '1' : '0');
+  gsize needed = gifenc_bits_get_max_size (n_pixels);
+
+  if (*size < needed) {
+    g_free (*data);
+    *data = g_malloc (needed);
+    *size = needed;
   }
-  g_print (")\n");
+  bits->bits = 0;
+  bits->n_bits = 0;
+  bits->data = *data;
+  bits->len = 0;
 }
-#define print_bits(text, data, bits)
 
+/* appends all bits written to src to the end of bits. src must not have
+ * been flushed yet. */
 static void
-gifenc_buffer_append (Gifenc *enc, EncodeBuffer *buffer, guint data, guint bits)
+gifenc_bits_append (GifencBits *bits, const GifencBits *src)
 {
-  g_assert (buffer->bits + bits < 24);
+  const guint8 *data = src->data;
+  gsize i;
+  guint32 word;
 
-  //g_print ("got code %u (%u)\n", data, bits);
-  print_bits ("appending", data, bits);
-  buffer->current_data |= (data << buffer->bits);
-  buffer->bits += bits;
-  while (buffer->bits >= 8) {
-    if (buffer->bytes == 255)
-      gifenc_buffer_write (enc, buffer);
-    buffer->data[buffer->bytes] = buffer->current_data;
-    print_bits ("got", buffer->data[buffer->bytes], 8);
-    buffer->bits -= 8;
-    buffer->current_data >>= 8;
-    buffer->bytes++;
+  for (i = 0; i + 4 <= src->len; i += 4) {
+    memcpy (&word, data + i, 4);
+    gifenc_bits_write (bits, GUINT32_FROM_LE (word), 32);
   }
+  for (; i < src->len; i++) {
+    gifenc_bits_write (bits, data[i], 8);
+  }
+  if (src->n_bits)
+    gifenc_bits_write (bits, src->bits, src->n_bits);
 }
 
+/* Image data is written in chunks of this many bytes, so the output buffer
+ * does not need to hold a whole image. */
+#define GIFENC_CHUNK_SIZE (256 * 255)
+/* maximum number of vectors passed to the writev function at once */
+#define GIFENC_N_VECTORS (512)
+
+/* copies data into the output buffer as a sequence of sub-blocks */
 static void
-gifenc_buffer_flush (Gifenc *enc, EncodeBuffer *buffer)
+gifenc_append_sub_blocks (Gifenc *enc, const guint8 *data, gsize len)
 {
-  if (buffer->bits)
-    gifenc_buffer_append (enc, buffer, 0, 8 - buffer->bits);
-  gifenc_buffer_write (enc, buffer);
+  guint8 *out;
+  gsize offset;
+
+  offset = enc->buffer->len;
+  g_byte_array_set_size (enc->buffer, offset + len + (len + 254) / 255);
+  out = enc->buffer->data + offset;
+  while (len > 0) {
+    guint8 block = MIN (len, 255);
+    *out++ = block;
+    memcpy (out, data, block);
+    out += block;
+    data += block;
+    len -= block;
+  }
+}
+
+/* passes the output buffer and data as a sequence of sub-blocks to the
+ * writev function without copying data */
+static gboolean
+gifenc_writev_sub_blocks (Gifenc *enc, const guint8 *data, gsize len, GError **error)
+{
+  GOutputVector vectors[GIFENC_N_VECTORS];
+  guint8 sizes[3] = { 255, len % 255, 0 };
+  gboolean result;
+  guint n = 0;
+
+  if (enc->buffer->len > 0) {
+    vectors[n].buffer = enc->buffer->data;
+    vectors[n].size = enc->buffer->len;
+    n++;
+  }
+  while (len > 0) {
+    guint8 block = MIN (len, 255);
+    vectors[n].buffer = block == 255 ? &sizes[0] : &sizes[1];
+    vectors[n].size = 1;
+    vectors[n + 1].buffer = data;
+    vectors[n + 1].size = block;
+    n += 2;
+    data += block;
+    len -= block;
+    /* keep room for another block and the terminator */
+    if (n + 3 > GIFENC_N_VECTORS) {
+      result = enc->writev_func (enc->write_data, vectors, n, error);
+      g_byte_array_set_size (enc->buffer, 0);
+      if (!result)
+	return FALSE;
+      n = 0;
+    }
+  }
+  vectors[n].buffer = &sizes[2];
+  vectors[n].size = 1;
+  n++;
+
+  result = enc->writev_func (enc->write_data, vectors, n, error);
+  g_byte_array_set_size (enc->buffer, 0);
+  return result;
+}
+
+/* writes data as a sequence of sub-blocks followed by a block terminator */
+static gboolean
+gifenc_write_sub_blocks (Gifenc *enc, const guint8 *data, gsize len, GError **error)
+{
+  gsize chunk;
+
+  g_return_val_if_fail (enc->n_bits == 0, FALSE);
+
+  if (enc->writev_func)
+    return gifenc_writev_sub_blocks (enc, data, len, error);
+
+  while (len > GIFENC_CHUNK_SIZE) {
+    chunk = GIFENC_CHUNK_SIZE;
+    gifenc_append_sub_blocks (enc, data, chunk);
+    if (!gifenc_flush (enc, error))
+      return FALSE;
+    data += chunk;
+    len -= chunk;
+  }
+  gifenc_append_sub_blocks (enc, data, len);
   gifenc_write_byte (enc, 0);
+  return TRUE;
+}
+
+/* The LZW dictionary is a table with one slot for every (prefix code, pixel)
+ * pair, so lookups never need to probe. Every slot stores the code together
+ * with the generation it was added in, so clearing the dictionary only
+ * needs to bump the generation. */
+#define DICT_GENERATION_BITS (20)
+#define DICT_MAX_GENERATION ((1 << DICT_GENERATION_BITS) - 1)
+
+struct _GifencDict {
+  guint32 *		codes;		/* (generation << 12) | code, indexed by (pixel << 12) | prefix */
+  guint			codesize;	/* number of bits per pixel */
+  guint32		generation;	/* current generation, never 0 */
+};
+
+static GifencDict *
+gifenc_dict_new (guint codesize)
+{
+  GifencDict *dict = g_slice_new (GifencDict);
+
+  dict->codes = g_new0 (guint32, 4096 << codesize);
+  dict->codesize = codesize;
+  dict->generation = 1;
+
+  return dict;
 }
 
 static void
-gifenc_write_image_data (Gifenc *enc, const GifencImage *image)
-{
-  guint codesize, wordsize, x, y;
-  guint next = 0, count = 0, clear, eof, hashcode, hashvalue, cur, codeword;
-  guint8 *data;
-#define HASH_SIZE (5003)
-  struct {
-    guint value;
-    guint code;
-  } hash[HASH_SIZE];
-  EncodeBuffer buffer = { { 0, }, 0, 0, 0 };
-  
-  codesize = log2n (gifenc_palette_get_num_colors (image->palette ? 
-	image->palette : enc->palette) - 1);
-  codesize = MAX (codesize, 2);
-  gifenc_write_byte (enc, codesize);
-  //g_print ("codesize with %u palette is %u\n", enc->n_palette, codesize);
-  clear = 1 << codesize;
-  eof = clear + 1;
-  codeword = cur = *image->data;
-  //g_print ("read byte %u\n", cur);
-  wordsize = codesize + 1;
-  gifenc_buffer_append (enc, &buffer, clear, wordsize);
-  if (1 == image->width) {
-    y = 1;
-    x = 0;
-    data = image->data + image->rowstride;
-  } else {
-    y = 0;
-    x = 1;
-    data = image->data;
-  }
-
-  while (y < image->height) {
-    count = eof + 1;
-    next = (1 << wordsize);
-    /* clear hash */
-    memset (hash, 0xFF, sizeof (hash));
-    while (y < image->height) {
-      cur = data[x];
-      //g_print ("read byte %u\n", cur);
-      x++;
-      if (x >= image->width) {
-	y++;
-	x = 0;
-	data += image->rowstride;
+gifenc_dict_free (GifencDict *dict)
+{
+  g_free (dict->codes);
+  g_slice_free (GifencDict, dict);
+}
+
+static void
+gifenc_dict_clear (GifencDict *dict)
+{
+  if (dict->generation == DICT_MAX_GENERATION) {
+    memset (dict->codes, 0, sizeof (guint32) * (4096 << dict->codesize));
+    dict->generation = 0;
+  }
+  dict->generation++;
+}
+
+/* state of the LZW compressor */
+typedef struct {
+  GifencDict *		dict;		/* dictionary in use */
+  GifencBits		bits;		/* output */
+  guint			codesize;	/* minimum code size */
+  guint			clear;		/* clear code */
+  guint			eof;		/* end of information code */
+  guint			wordsize;	/* current code size */
+  guint			count;		/* next code to be added to the dictionary */
+  guint			next;		/* code size needs to grow when count exceeds this */
+  guint			codeword;	/* code for the pixels read so far or G_MAXUINT */
+  const guint8 *	near;		/* colors to try instead of a pixel or NULL */
+  const guint16 *	near_start;	/* index into near for every color or NULL */
+  guint64		n_pixels;	/* pixels passed to gifenc_lzw_encode() */
+  guint64		window_start;	/* first pixel of the current window */
+  guint			window_codes;	/* codes written in the current window */
+  guint			best_window;	/* most pixels in a window since the dictionary filled up */
+  guint			transparent;	/* transparent pixel value or G_MAXUINT */
+  guint			run_length;	/* length of codeword if it is a run of transparent pixels or 0 */
+  guint			max_run;	/* longest run of transparent pixels in the dictionary */
+  guint16		run_codes[4097];/* code for every run of transparent pixels up to max_run */
+} GifencLzw;
+
+static void
+gifenc_lzw_reset (GifencLzw *lzw)
+{
+  lzw->wordsize = lzw->codesize + 1;
+  lzw->count = lzw->eof + 1;
+  lzw->next = 1 << lzw->wordsize;
+  lzw->max_run = 1;
+  lzw->run_codes[1] = lzw->transparent;
+  gifenc_dict_clear (lzw->dict);
+}
+
+/* If write_clear is FALSE, the previous stream must have been ended with a
+ * clear code already. */
+static void
+gifenc_lzw_init (GifencLzw *lzw, GifencDict *dict, guint codesize, 
+    guint transparent, gboolean write_clear)
+{
+  lzw->dict = dict;
+  lzw->transparent = transparent;
+  lzw->run_length = 0;
+  lzw->codesize = codesize;
+  lzw->clear = 1 << codesize;
+  lzw->eof = lzw->clear + 1;
+  lzw->codeword = G_MAXUINT;
+  lzw->near = NULL;
+  lzw->near_start = NULL;
+  lzw->n_pixels = 0;
+  gifenc_lzw_reset (lzw);
+  if (write_clear)
+    gifenc_bits_write (&lzw->bits, lzw->clear, lzw->wordsize);
+}
+
+/* Once the dictionary is full, it is kept as long as it compresses well.
+ * Compression is measured in windows of a fixed number of codes, and the
+ * dictionary is cleared when a window covers far fewer pixels than the 
+ * best window did, because the image content changed. */
+#define LZW_WINDOW_CODES (512)
+#define LZW_WINDOW_MIN(best) ((best) - (best) / 8)
+
+/* returns the number of pixels at the start of data that have the given value */
+static inline guint
+gifenc_count_run (const guint8 *data, guint len, guint8 value)
+{
+  guint64 pattern, word;
+  guint i;
+
+  pattern = value * G_GUINT64_CONSTANT (0x0101010101010101);
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy (&word, data + i, 8);
+    if (word != pattern)
+      break;
+  }
+  while (i < len && data[i] == value)
+    i++;
+
+  return i;
+}
+
+/* Runs of transparent pixels are so common that they get a fast path: The
+ * codes for the runs of transparent pixels form a chain in the dictionary,
+ * so they are remembered in run_codes and a run is skipped in one step. 
+ * This produces the same codes as looking up every pixel.
+ *
+ * In lossy mode, a pixel that ends the current string is replaced with
+ * one of its near colors when that continues the string. Replacement
+ * colors are never transparent and only differ from the pixel by a bounded
+ * amount, so the error does not add up.
+ *
+ * If full is given, it contains the pixels that are currently displayed. A
+ * transparent pixel that ends the current string is replaced with the 
+ * displayed pixel when that continues the string, so partial updates of
+ * an area don't break up its strings. */
+static void
+gifenc_lzw_encode (GifencLzw *lzw, const guint8 *data, const guint8 *full, guint len)
+{
+  guint i, j, n, cur, codeword, count, next, wordsize, transparent, run_length, max_run;
+  guint32 generation, entry, *codes, *slot;
+  const guint16 *near_start;
+
+  if (len == 0)
+    return;
+  i = 0;
+  codeword = lzw->codeword;
+  transparent = lzw->transparent;
+  run_length = lzw->run_length;
+  if (codeword == G_MAXUINT) {
+    codeword = data[i++];
+    run_length = codeword == transparent ? 1 : 0;
+  }
+  max_run = lzw->max_run;
+  count = lzw->count;
+  next = lzw->next;
+  wordsize = lzw->wordsize;
+  codes = lzw->dict->codes;
+  generation = lzw->dict->generation << 12;
+  near_start = lzw->near_start;
+
+  for (; i < len; i++) {
+    cur = data[i];
+    if (cur == transparent && run_length > 0) {
+      n = gifenc_count_run (data + i, MIN (len - i, max_run - run_length + 1), cur);
+      if (run_length + n <= max_run) {
+	run_length += n;
+	codeword = lzw->run_codes[run_length];
+	i += n - 1;
+	continue;
+      }
+      /* use the longest run, the next pixel is not in the dictionary */
+      i += max_run - run_length;
+      run_length = max_run;
+      codeword = lzw->run_codes[max_run];
+    }
+    slot = &codes[(cur << 12) | codeword];
+    entry = *slot;
+    if ((entry & ~0xFFF) == generation) {
+      codeword = entry & 0xFFF;
+      run_length = 0;
+      continue;
+    }
+    if (near_start) {
+      for (j = near_start[cur]; j < near_start[cur + 1]; j++) {
+	entry = codes[(lzw->near[j] << 12) | codeword];
+	if ((entry & ~0xFFF) == generation)
+	  break;
       }
-      hashcode = codeword ^ (cur << 4);
-      hashvalue = (codeword << 8) | cur;
-loop:
-      if (hash[hashcode].value == hashvalue) {
-	codeword = hash[hashcode].code;
+      if (j < near_start[cur + 1]) {
+	codeword = entry & 0xFFF;
+	run_length = 0;
 	continue;
       }
-      if (hash[hashcode].value != (guint) -1) { /* not empty */
-	hashcode = (hashcode + 0xF) % HASH_SIZE;
-	goto loop;
+    }
+    if (full && cur == transparent) {
+      entry = codes[(full[i] << 12) | codeword];
+      if ((entry & ~0xFFF) == generation) {
+	codeword = entry & 0xFFF;
+	run_length = 0;
+	continue;
+      }
+    }
+    /* not in dictionary yet */
+    gifenc_bits_write (&lzw->bits, codeword, wordsize);
+    if (count <= 0xFFF) {
+      if (run_length > 0 && cur == transparent) {
+	max_run = run_length + 1;
+	lzw->run_codes[max_run] = count;
       }
-      /* found empty slot, put code there */
-      hash[hashcode].value = hashvalue;
-      hash[hashcode].code = count;
-      //g_print ("saving as %u (%X):", count, count);
-      gifenc_buffer_append (enc, &buffer, codeword, wordsize);
+      *slot = generation | count;
       count++;
-      codeword = cur;
       if (count > next) {
 	if (wordsize == 12) {
-	  gifenc_buffer_append (enc, &buffer, clear, wordsize);
-	  wordsize = codesize + 1;
-	  break;
+	  /* dictionary is full, start measuring */
+	  lzw->window_start = lzw->n_pixels + i;
+	  lzw->window_codes = 0;
+	  lzw->best_window = 0;
+	} else {
+	  next = MIN (next << 1, 0xFFF);
+	  wordsize++;
 	}
-	next = MIN (next << 1, 0xFFF);
-	wordsize++;
+      }
+    } else if (++lzw->window_codes == LZW_WINDOW_CODES) {
+      guint window = lzw->n_pixels + i - lzw->window_start;
+
+      if (window < LZW_WINDOW_MIN (lzw->best_window)) {
+	gifenc_bits_write (&lzw->bits, lzw->clear, wordsize);
+	gifenc_lzw_reset (lzw);
+	count = lzw->count;
+	next = lzw->next;
+	wordsize = lzw->wordsize;
+	generation = lzw->dict->generation << 12;
+	max_run = lzw->max_run;
+      } else {
+	lzw->best_window = MAX (lzw->best_window, window);
+	lzw->window_start += window;
+	lzw->window_codes = 0;
       }
     }
+    codeword = cur;
+    run_length = cur == transparent ? 1 : 0;
   }
-  gifenc_buffer_append (enc, &buffer, codeword, wordsize);
-  if (count == next) {
-    wordsize++;
-    if (wordsize > 12) {
-      wordsize = codesize + 1;
-      gifenc_buffer_append (enc, &buffer, clear, wordsize);
+
+  lzw->n_pixels += len;
+  lzw->codeword = codeword;
+  lzw->run_length = run_length;
+  lzw->max_run = max_run;
+  lzw->count = count;
+  lzw->next = next;
+  lzw->wordsize = wordsize;
+}
+
+/* writes the pending pixels and terminates the stream with the given code */
+static void
+gifenc_lzw_finish (GifencLzw *lzw, guint code)
+{
+  g_assert (lzw->codeword != G_MAXUINT);
+
+  gifenc_bits_write (&lzw->bits, lzw->codeword, lzw->wordsize);
+  /* the decoder adds a dictionary entry for the last code, too */
+  if (lzw->count == lzw->next && lzw->wordsize < 12)
+    lzw->wordsize++;
+  gifenc_bits_write (&lzw->bits, code, lzw->wordsize);
+}
+
+static GifencDict *
+gifenc_acquire_dict (Gifenc *enc, guint codesize)
+{
+  GifencDict *dict = NULL;
+
+  g_mutex_lock (&enc->dicts_lock);
+  if (enc->dicts) {
+    dict = enc->dicts->data;
+    enc->dicts = g_slist_delete_link (enc->dicts, enc->dicts);
+  }
+  g_mutex_unlock (&enc->dicts_lock);
+
+  if (dict && dict->codesize != codesize) {
+    gifenc_dict_free (dict);
+    dict = NULL;
+  }
+  if (dict == NULL)
+    dict = gifenc_dict_new (codesize);
+
+  return dict;
+}
+
+static void
+gifenc_release_dict (Gifenc *enc, GifencDict *dict)
+{
+  g_mutex_lock (&enc->dicts_lock);
+  enc->dicts = g_slist_prepend (enc->dicts, dict);
+  g_mutex_unlock (&enc->dicts_lock);
+}
+
+/* output buffers are kept around, too, so that large images don't need to
+ * allocate and fault in fresh memory for every frame */
+struct _GifencBuffer {
+  guint8 *		data;		/* the memory */
+  gsize			size;		/* allocated size of data */
+};
+
+static void
+gifenc_buffer_free (GifencBuffer *buffer)
+{
+  g_free (buffer->data);
+  g_slice_free (GifencBuffer, buffer);
+}
+
+/* returns the smallest buffer that fits n_pixels or the largest one, so 
+ * stripes of different sizes keep reusing the same memory */
+static GifencBuffer *
+gifenc_acquire_buffer (Gifenc *enc, gsize n_pixels)
+{
+  gsize needed = gifenc_bits_get_max_size (n_pixels);
+  GifencBuffer *buffer = NULL, *check;
+  GSList *walk, *best = NULL;
+
+  g_mutex_lock (&enc->dicts_lock);
+  for (walk = enc->buffers; walk; walk = walk->next) {
+    check = walk->data;
+    if (best == NULL) {
+      best = walk;
+      continue;
     }
+    buffer = best->data;
+    if (buffer->size < needed ? check->size > buffer->size :
+        check->size >= needed && check->size < buffer->size)
+      best = walk;
+  }
+  buffer = NULL;
+  if (best) {
+    buffer = best->data;
+    enc->buffers = g_slist_delete_link (enc->buffers, best);
   }
-  gifenc_buffer_append (enc, &buffer, eof, wordsize);
-  gifenc_buffer_flush (enc, &buffer);
+  g_mutex_unlock (&enc->dicts_lock);
+
+  if (buffer == NULL)
+    buffer = g_slice_new0 (GifencBuffer);
+
+  return buffer;
+}
+
+static void
+gifenc_release_buffer (Gifenc *enc, GifencBuffer *buffer)
+{
+  g_mutex_lock (&enc->dicts_lock);
+  enc->buffers = g_slist_prepend (enc->buffers, buffer);
+  g_mutex_unlock (&enc->dicts_lock);
+}
+
+/* minimum amount of pixels a stripe must have */
+#define MIN_STRIPE_PIXELS (64 * 1024)
+
+struct _GifencStripe {
+  GifencBuffer *	buffer;		/* output buffer */
+  guint			y;		/* first row of this stripe */
+  guint			height;		/* number of rows in this stripe */
+  guint			n_rows;		/* number of rows added so far */
+  gboolean		first;		/* stripe starts the image */
+  gboolean		last;		/* stripe ends the image */
+  GifencLzw		lzw;		/* compressor state */
+  GifencLzw *		exact;		/* lossless compressor to measure lossy compression or NULL */
+  GifencBuffer *	exact_buffer;	/* output buffer of exact */
+  guint64		exact_bits;	/* size of the stripe without lossy compression */
+};
+
+static guint
+gifenc_image_get_codesize (const GifencImage *image)
+{
+  guint codesize;
+
+  codesize = log2n (gifenc_palette_get_num_colors (image->palette ? 
+	image->palette : image->enc->palette) - 1);
+  return MAX (codesize, 2);
+}
+
+static void
+gifenc_stripe_start (GifencImage *image, GifencStripe *stripe)
+{
+  Gifenc *enc = image->enc;
+  const GifencPalette *palette = image->palette ? image->palette : enc->palette;
+  guint codesize, transparent;
+  gsize n_pixels;
+
+  codesize = gifenc_image_get_codesize (image);
+  transparent = palette->alpha ? palette->num_colors : G_MAXUINT;
+  /* the first stripe gets the other stripes appended later */
+  if (stripe->first)
+    n_pixels = (gsize) image->width * image->height;
+  else
+    n_pixels = (gsize) image->width * stripe->height;
+
+  stripe->buffer = gifenc_acquire_buffer (enc, n_pixels);
+  gifenc_bits_init (&stripe->lzw.bits, &stripe->buffer->data, &stripe->buffer->size,
+      n_pixels);
+  gifenc_lzw_init (&stripe->lzw, gifenc_acquire_dict (enc, codesize), codesize, 
+      transparent, stripe->first);
+  /* the replacement colors are computed for the global palette */
+  if (enc->lossy && image->palette == NULL) {
+    stripe->lzw.near = enc->lossy_near;
+    stripe->lzw.near_start = enc->lossy_near_start;
+    if (enc->measure_exact) {
+      stripe->exact = g_slice_new (GifencLzw);
+      n_pixels = (gsize) image->width * stripe->height;
+      stripe->exact_buffer = gifenc_acquire_buffer (enc, n_pixels);
+      gifenc_bits_init (&stripe->exact->bits, &stripe->exact_buffer->data, 
+	  &stripe->exact_buffer->size, n_pixels);
+      gifenc_lzw_init (stripe->exact, gifenc_acquire_dict (enc, codesize), codesize,
+	  transparent, stripe->first);
+    }
+  }
+}
+
+static void
+gifenc_stripe_finish (GifencImage *image, GifencStripe *stripe)
+{
+  Gifenc *enc = image->enc;
+
+  /* every stripe but the last starts a new dictionary for the next one */
+  gifenc_lzw_finish (&stripe->lzw, 
+      stripe->last ? stripe->lzw.eof : stripe->lzw.clear);
+  gifenc_release_dict (enc, stripe->lzw.dict);
+  stripe->lzw.dict = NULL;
+
+  if (stripe->exact) {
+    gifenc_lzw_finish (stripe->exact, 
+	stripe->last ? stripe->exact->eof : stripe->exact->clear);
+    stripe->exact_bits = stripe->exact->bits.len * 8 + stripe->exact->bits.n_bits;
+    gifenc_release_dict (enc, stripe->exact->dict);
+    gifenc_release_buffer (enc, stripe->exact_buffer);
+    g_slice_free (GifencLzw, stripe->exact);
+    stripe->exact = NULL;
+    stripe->exact_buffer = NULL;
+  }
+}
+
+static gboolean
+gifenc_write_image_data (Gifenc *enc, GifencImage *image, GError **error)
+{
+  GifencStripe *stripe = &image->stripes[0];
+  guint64 exact_bits;
+  guint i;
+
+  /* join the stripes at the bit level */
+  exact_bits = stripe->exact_bits;
+  for (i = 1; i < image->n_stripes; i++) {
+    gifenc_bits_append (&stripe->lzw.bits, &image->stripes[i].lzw.bits);
+    exact_bits += image->stripes[i].exact_bits;
+  }
+  gifenc_bits_flush (&stripe->lzw.bits);
+  enc->stats.n_images++;
+  enc->stats.image_bytes += stripe->lzw.bits.len;
+  if (image->palette) {
+    enc->stats.n_local_palettes++;
+    /* images with a local palette are always compressed losslessly */
+    if (enc->measure_exact)
+      exact_bits = (guint64) stripe->lzw.bits.len * 8;
+  }
+  enc->stats.exact_image_bytes += (exact_bits + 7) / 8;
+
+  gifenc_write_byte (enc, gifenc_image_get_codesize (image));
+  return gifenc_write_sub_blocks (enc, stripe->lzw.bits.data, stripe->lzw.bits.len, error);
 }
 
 static void
@@ -369,6 +972,8 @@ gifenc_new (guint width, guint height, GifencWriteFunc write_func,
   enc->write_func = write_func;
   enc->write_data = write_data;
   enc->write_destroy = write_destroy;
+  enc->n_stripes = 1;
+  g_mutex_init (&enc->dicts_lock);
 
   return enc;
 }
@@ -393,11 +998,358 @@ gifenc_initialize (Gifenc *enc, GifencPalette *palette, gboolean loop, GError **
   return TRUE;
 }
 
+static int
+gifenc_compare_near (gconstpointer a, gconstpointer b)
+{
+  const guint32 *ia = a, *ib = b;
+
+  /* sort by distance, then by index */
+  return *ia < *ib ? -1 : *ia > *ib;
+}
+
+/* builds the list of replacement colors for lossy compression */
+static void
+gifenc_lossy_init (Gifenc *enc)
+{
+  const GifencPalette *palette = enc->palette;
+  guint32 near[256], max_dist, dist;
+  guint i, j, n, n_total;
+  int dr, dg, db;
+
+  g_free (enc->lossy_near);
+  g_free (enc->lossy_near_start);
+  enc->lossy_near = g_new (guint8, palette->num_colors * palette->num_colors + 1);
+  /* the transparent index and unused indexes get empty lists */
+  enc->lossy_near_start = g_new (guint16, 256 + 1);
+  max_dist = enc->lossy * enc->lossy;
+
+  n_total = 0;
+  for (i = 0; i < palette->num_colors; i++) {
+    enc->lossy_near_start[i] = n_total;
+    n = 0;
+    for (j = 0; j < palette->num_colors; j++) {
+      if (i == j)
+	continue;
+      dr = (int) RED (palette->colors[i]) - RED (palette->colors[j]);
+      dg = (int) GREEN (palette->colors[i]) - GREEN (palette->colors[j]);
+      db = (int) BLUE (palette->colors[i]) - BLUE (palette->colors[j]);
+      dist = dr * dr + dg * dg + db * db;
+      if (dist > max_dist)
+	continue;
+      /* distance in the upper bits, index in the lower ones */
+      near[n++] = (dist << 8) | j;
+    }
+    qsort (near, n, sizeof (guint32), gifenc_compare_near);
+    for (j = 0; j < n; j++) {
+      enc->lossy_near[n_total++] = near[j] & 0xFF;
+    }
+  }
+  for (; i <= 256; i++) {
+    enc->lossy_near_start[i] = n_total;
+  }
+}
+
+/**
+ * gifenc_image_new:
+ * @enc: an initialized encoder
+ * @x: x coordinate of the image
+ * @y: y coordinate of the image
+ * @width: width of the image
+ * @height: height of the image
+ *
+ * Creates a new image that is compressed row by row while the rows are 
+ * added, so callers can produce the rows just in time. Large images are 
+ * split into horizontal stripes that can be filled in parallel, use 
+ * gifenc_image_get_stripe() to query them. When all rows have been added,
+ * write the image with gifenc_image_write().
+ *
+ * Returns: a new image to be freed with gifenc_image_free()
+ **/
+GifencImage *
+gifenc_image_new (Gifenc *enc, guint x, guint y, guint width, guint height)
+{
+  GifencImage *image;
+  guint i, rows;
+
+  g_return_val_if_fail (enc != NULL, NULL);
+  g_return_val_if_fail (enc->state == GIFENC_STATE_INITIALIZED, NULL);
+  g_return_val_if_fail (width > 0, NULL);
+  g_return_val_if_fail (x + width <= enc->width, NULL);
+  g_return_val_if_fail (height > 0, NULL);
+  g_return_val_if_fail (y + height <= enc->height, NULL);
+
+  if (enc->lossy && enc->lossy_near == NULL)
+    gifenc_lossy_init (enc);
+
+  image = g_slice_new0 (GifencImage);
+  image->enc = enc;
+  image->x = x;
+  image->y = y;
+  image->width = width;
+  image->height = height;
+  image->n_stripes = (gsize) width * height / MIN_STRIPE_PIXELS;
+  image->n_stripes = CLAMP (image->n_stripes, 1, MIN (enc->n_stripes, height));
+  image->stripes = g_new0 (GifencStripe, image->n_stripes);
+  rows = height / image->n_stripes;
+  for (i = 0; i < image->n_stripes; i++) {
+    image->stripes[i].y = i * rows;
+    image->stripes[i].height = i + 1 == image->n_stripes ? height - i * rows : rows;
+    image->stripes[i].first = i == 0;
+    image->stripes[i].last = i + 1 == image->n_stripes;
+  }
+
+  return image;
+}
+
+/**
+ * gifenc_image_get_n_stripes:
+ * @image: an image
+ *
+ * Queries the number of stripes @image is split into.
+ *
+ * Returns: the number of stripes
+ **/
+guint
+gifenc_image_get_n_stripes (const GifencImage *image)
+{
+  g_return_val_if_fail (image != NULL, 0);
+
+  return image->n_stripes;
+}
+
+/**
+ * gifenc_image_get_stripe:
+ * @image: an image
+ * @stripe: index of the stripe
+ * @y: location to take the first row of the stripe or %NULL
+ * @height: location to take the number of rows of the stripe or %NULL
+ *
+ * Queries the rows of @image that belong to the given stripe.
+ **/
+void
+gifenc_image_get_stripe (const GifencImage *image, guint stripe, guint *y, guint *height)
+{
+  g_return_if_fail (image != NULL);
+  g_return_if_fail (stripe < image->n_stripes);
+
+  if (y)
+    *y = image->stripes[stripe].y;
+  if (height)
+    *height = image->stripes[stripe].height;
+}
+
+/**
+ * gifenc_image_add_row:
+ * @image: an image
+ * @stripe: the stripe to add the row to
+ * @row: @image's width palette indexes
+ *
+ * Compresses the next row of the given stripe. Rows of different stripes
+ * may be added from different threads at the same time.
+ **/
+void
+gifenc_image_add_row (GifencImage *image, guint stripe, const guint8 *row)
+{
+  gifenc_image_add_row_with_full_image (image, stripe, row, NULL);
+}
+
+/**
+ * gifenc_image_add_row_with_full_image:
+ * @image: an image
+ * @stripe: the stripe to add the row to
+ * @row: @image's width palette indexes
+ * @full: the same row of the currently displayed image or %NULL
+ *
+ * Like gifenc_image_add_row(), but transparent pixels of @row may be 
+ * encoded as the pixel from @full instead, whichever continues the LZW 
+ * string. This makes the result smaller when only parts of an area were
+ * repainted, at the cost of some speed.
+ **/
+void
+gifenc_image_add_row_with_full_image (GifencImage *image, guint stripe, 
+    const guint8 *row, const guint8 *full)
+{
+  GifencStripe *s;
+
+  g_return_if_fail (image != NULL);
+  g_return_if_fail (stripe < image->n_stripes);
+  g_return_if_fail (image->stripes[stripe].n_rows < image->stripes[stripe].height);
+  g_return_if_fail (row != NULL);
+
+  s = &image->stripes[stripe];
+  if (s->n_rows == 0)
+    gifenc_stripe_start (image, s);
+  gifenc_lzw_encode (&s->lzw, row, full, image->width);
+  if (s->exact)
+    gifenc_lzw_encode (s->exact, row, full, image->width);
+  s->n_rows++;
+  if (s->n_rows == s->height)
+    gifenc_stripe_finish (image, s);
+}
+
+/**
+ * gifenc_image_write:
+ * @image: an image with all rows added
+ * @display_millis: time to display the resulting image
+ * @error: location to take an error or %NULL
+ *
+ * Writes @image to the encoder it was created for. To write a frame that
+ * consists of multiple images, pass 0 as @display_millis for all but the
+ * last image.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gifenc_image_write (GifencImage *image, guint display_millis, GError **error)
+{
+  Gifenc *enc;
+  guint i;
+
+  g_return_val_if_fail (image != NULL, FALSE);
+  for (i = 0; i < image->n_stripes; i++) {
+    g_return_val_if_fail (image->stripes[i].n_rows == image->stripes[i].height, FALSE);
+  }
+
+  enc = image->enc;
+  gifenc_write_graphic_control (enc, image->palette ? image->palette : enc->palette, 
+      display_millis);
+  gifenc_write_image_description (enc, image);
+  if (!gifenc_write_image_data (enc, image, error))
+    return FALSE;
+
+  return gifenc_flush (enc, error);
+}
+
+/**
+ * gifenc_image_free:
+ * @image: an image
+ *
+ * Frees @image. Images do not need to be written before freeing them.
+ **/
+void
+gifenc_image_free (GifencImage *image)
+{
+  guint i;
+
+  g_return_if_fail (image != NULL);
+
+  for (i = 0; i < image->n_stripes; i++) {
+    GifencStripe *stripe = &image->stripes[i];
+
+    if (stripe->n_rows > 0 && stripe->n_rows < stripe->height) {
+      gifenc_release_dict (image->enc, stripe->lzw.dict);
+      if (stripe->exact) {
+	gifenc_release_dict (image->enc, stripe->exact->dict);
+	gifenc_release_buffer (image->enc, stripe->exact_buffer);
+	g_slice_free (GifencLzw, stripe->exact);
+      }
+    }
+    if (stripe->buffer)
+      gifenc_release_buffer (image->enc, stripe->buffer);
+  }
+  g_free (image->stripes);
+  if (image->palette)
+    gifenc_palette_free (image->palette);
+  g_slice_free (GifencImage, image);
+}
+
+/**
+ * gifenc_image_set_palette:
+ * @image: an image without any rows added
+ * @palette: the palette the rows of @image will index or %NULL
+ *
+ * Makes @image use @palette as a local color table instead of the global 
+ * palette of the encoder. This is useful when the colors of the image are
+ * far from the global palette. Only the colors of @palette are copied, so
+ * it can be freed right away. Lossy compression is not applied to images 
+ * with a local palette.
+ **/
+void
+gifenc_image_set_palette (GifencImage *image, const GifencPalette *palette)
+{
+  guint i;
+
+  g_return_if_fail (image != NULL);
+  for (i = 0; i < image->n_stripes; i++) {
+    g_return_if_fail (image->stripes[i].n_rows == 0);
+  }
+  g_return_if_fail (palette == NULL || gifenc_palette_get_num_colors (palette) >= 2);
+
+  if (image->palette) {
+    gifenc_palette_free (image->palette);
+    image->palette = NULL;
+  }
+  if (palette == NULL)
+    return;
+
+  image->palette = g_new0 (GifencPalette, 1);
+  image->palette->alpha = palette->alpha;
+  image->palette->num_colors = palette->num_colors;
+  image->palette->colors = g_memdup (palette->colors, 
+      sizeof (guint32) * palette->num_colors);
+}
+
+typedef struct {
+  GifencImage *		image;		/* image to compress */
+  guint			stripe;		/* stripe of image to compress */
+  const guint8 *	data;		/* image data for image */
+  guint			rowstride;	/* rowstride of data */
+} GifencImageJob;
+
+static void
+gifenc_image_job_run (gpointer data, guint id)
+{
+  GifencImageJob *job = (GifencImageJob *) data + id;
+  guint y, height;
+
+  gifenc_image_get_stripe (job->image, job->stripe, &y, &height);
+  for (; height > 0; height--, y++) {
+    gifenc_image_add_row (job->image, job->stripe, job->data + (gsize) job->rowstride * y);
+  }
+}
+
+/* writes all images, only the last one is displayed for display_millis.
+ * data starts at data_x, data_y of the image. */
+static gboolean
+gifenc_write_images (Gifenc *enc, const cairo_rectangle_int_t *rects, guint n_rects,
+    guint display_millis, const guint8 *data, guint data_x, guint data_y, 
+    guint rowstride, GError **error)
+{
+  GifencImage **images;
+  GArray *jobs;
+  gboolean result = TRUE;
+  guint i, j;
+
+  images = g_new (GifencImage *, n_rects);
+  jobs = g_array_new (FALSE, FALSE, sizeof (GifencImageJob));
+  for (i = 0; i < n_rects; i++) {
+    images[i] = gifenc_image_new (enc, rects[i].x, rects[i].y, 
+	rects[i].width, rects[i].height);
+    for (j = 0; j < images[i]->n_stripes; j++) {
+      GifencImageJob job = { images[i], j, 
+	  data + (gsize) rowstride * (rects[i].y - data_y) + rects[i].x - data_x, 
+	  rowstride };
+      g_array_append_val (jobs, job);
+    }
+  }
+  gifenc_parallel (gifenc_image_job_run, jobs->data, jobs->len);
+  g_array_free (jobs, TRUE);
+
+  for (i = 0; i < n_rects; i++) {
+    if (result)
+      result = gifenc_image_write (images[i], i + 1 == n_rects ? display_millis : 0, error);
+    gifenc_image_free (images[i]);
+  }
+  g_free (images);
+
+  return result;
+}
+
 gboolean
 gifenc_add_image (Gifenc *enc, guint x, guint y, guint width, guint height, 
     guint display_millis, guint8 *data, guint rowstride, GError **error)
 {
-  GifencImage image = { x, y, width, height, NULL, data, rowstride };
+  cairo_rectangle_int_t rect = { x, y, width, height };
 
   g_return_val_if_fail (enc != NULL, FALSE);
   g_return_val_if_fail (enc->state == GIFENC_STATE_INITIALIZED, FALSE);
@@ -406,12 +1358,48 @@ gifenc_add_image (Gifenc *enc, guint x, guint y, guint width, guint height,
   g_return_val_if_fail (height > 0, FALSE);
   g_return_val_if_fail (y + height <= enc->height, FALSE);
 
-  //g_print ("adding image (display time %u)\n", display_millis);
-  gifenc_write_graphic_control (enc, image.palette ? image.palette : enc->palette, 
-      display_millis);
-  gifenc_write_image_description (enc, &image);
-  gifenc_write_image_data (enc, &image);
-  return gifenc_flush (enc, error);
+  return gifenc_write_images (enc, &rect, 1, display_millis, data, x, y, 
+      rowstride, error);
+}
+
+/**
+ * gifenc_add_images:
+ * @enc: the encoder
+ * @rects: areas of the image that changed
+ * @n_rects: number of rectangles in @rects
+ * @display_millis: time to display the resulting image
+ * @data: image data for the whole image
+ * @rowstride: rowstride of @data
+ * @error: location to take an error or %NULL
+ *
+ * Adds one frame that is made up of @n_rects sub-images. The sub-images are
+ * compressed in parallel and all but the last one are displayed for 0 
+ * milliseconds.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gifenc_add_images (Gifenc *enc, const cairo_rectangle_int_t *rects, guint n_rects,
+    guint display_millis, guint8 *data, guint rowstride, GError **error)
+{
+  guint i;
+
+  g_return_val_if_fail (enc != NULL, FALSE);
+  g_return_val_if_fail (enc->state == GIFENC_STATE_INITIALIZED, FALSE);
+  g_return_val_if_fail (rects != NULL, FALSE);
+  g_return_val_if_fail (n_rects > 0, FALSE);
+
+  for (i = 0; i < n_rects; i++) {
+    g_return_val_if_fail (rects[i].x >= 0, FALSE);
+    g_return_val_if_fail (rects[i].width > 0, FALSE);
+    g_return_val_if_fail (rects[i].x + rects[i].width <= (int) enc->width, FALSE);
+    g_return_val_if_fail (rects[i].y >= 0, FALSE);
+    g_return_val_if_fail (rects[i].height > 0, FALSE);
+    g_return_val_if_fail (rects[i].y + rects[i].height <= (int) enc->height, FALSE);
+  }
+
+  return gifenc_write_images (enc, rects, n_rects, display_millis, data, 0, 0, 
+      rowstride, error);
 }
 
 gboolean
@@ -442,11 +1430,102 @@ gifenc_free (Gifenc *enc)
   if (enc->palette)
     gifenc_palette_free (enc->palette);
   g_byte_array_unref (enc->buffer);
+  g_slist_free_full (enc->dicts, (GDestroyNotify) gifenc_dict_free);
+  g_slist_free_full (enc->buffers, (GDestroyNotify) gifenc_buffer_free);
+  g_free (enc->lossy_near);
+  g_free (enc->lossy_near_start);
+  g_mutex_clear (&enc->dicts_lock);
   g_slice_free (Gifenc, enc);
 
   return success;
 }
 
+/**
+ * gifenc_set_n_stripes:
+ * @enc: the encoder
+ * @n_stripes: maximum number of stripes to split an image into
+ *
+ * Allows splitting large images into up to @n_stripes horizontal stripes 
+ * that are compressed in parallel. Every stripe starts with an empty 
+ * dictionary, so this trades a bit of compression for speed.
+ **/
+void
+gifenc_set_n_stripes (Gifenc *enc, guint n_stripes)
+{
+  g_return_if_fail (enc != NULL);
+  g_return_if_fail (n_stripes > 0);
+
+  enc->n_stripes = n_stripes;
+}
+
+/**
+ * gifenc_set_writev_func:
+ * @enc: the encoder
+ * @writev_func: function to write multiple buffers at once or %NULL
+ *
+ * Sets a function that is used instead of the write function to write image
+ * data. It is called with the same closure as the write function and gets
+ * passed the compressed data directly instead of a copy, in batches of 
+ * a bounded number of sub-blocks. The function may modify the vectors it
+ * gets passed.
+ **/
+void
+gifenc_set_writev_func (Gifenc *enc, GifencWritevFunc writev_func)
+{
+  g_return_if_fail (enc != NULL);
+
+  enc->writev_func = writev_func;
+}
+
+/**
+ * gifenc_set_lossy:
+ * @enc: the encoder
+ * @tolerance: maximum distance in RGB space between a pixel and the color
+ *             it may be encoded as or 0 for lossless compression
+ * @measure_exact: %TRUE to also compress every image losslessly so the 
+ *                 savings can be queried with gifenc_get_stats(). This
+ *                 about doubles the time spent compressing.
+ *
+ * Enables lossy compression. When a pixel does not continue the current
+ * LZW string, a palette color within @tolerance of it that does is used 
+ * instead. Transparent pixels are never changed and never used as a 
+ * replacement.
+ **/
+void
+gifenc_set_lossy (Gifenc *enc, guint tolerance, gboolean measure_exact)
+{
+  g_return_if_fail (enc != NULL);
+
+  /* larger than the distance between black and white */
+  tolerance = MIN (tolerance, 442);
+  if (enc->lossy != tolerance) {
+    g_free (enc->lossy_near);
+    enc->lossy_near = NULL;
+    g_free (enc->lossy_near_start);
+    enc->lossy_near_start = NULL;
+  }
+  enc->lossy = tolerance;
+  enc->measure_exact = measure_exact;
+}
+
+/**
+ * gifenc_get_stats:
+ * @enc: the encoder
+ *
+ * Queries statistics about the images written so far. The 
+ * exact_image_bytes member is only valid if lossy compression is enabled
+ * and measuring was requested via gifenc_set_lossy().
+ *
+ * Returns: the statistics of @enc
+ **/
+const GifencStats *
+gifenc_get_stats (Gifenc *enc)
+{
+  g_return_val_if_fail (enc != NULL, NULL);
+
+  return &enc->stats;
+}
+
 guint
 gifenc_get_width (Gifenc *gifenc)
 {
@@ -463,134 +1542,502 @@ gifenc_get_height (Gifenc *gifenc)
   return gifenc->height;
 }
 
+/* CPU extensions that may be used */
+static GifencCpuFlags cpu_flags_allowed = ~0;
+
+/**
+ * gifenc_get_cpu_flags:
+ *
+ * Gets the CPU extensions used for dithering. These are the ones the CPU
+ * supports, limited by gifenc_set_cpu_flags().
+ *
+ * Returns: the CPU extensions in use
+ **/
+GifencCpuFlags
+gifenc_get_cpu_flags (void)
+{
+  static gsize detected = 0;
+  static GifencCpuFlags supported = 0;
+
+  if (g_once_init_enter (&detected)) {
+#ifdef GIFENC_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse2"))
+      supported |= GIFENC_CPU_SSE2;
+#endif
+    g_once_init_leave (&detected, 1);
+  }
+
+  return supported & cpu_flags_allowed;
+}
+
+/**
+ * gifenc_set_cpu_flags:
+ * @flags: the CPU extensions that may be used
+ *
+ * Limits the CPU extensions used for dithering to @flags. Extensions that
+ * the CPU does not support are never used. The result is the same with 
+ * all extensions, so this is only useful for benchmarking and debugging.
+ * It must not be called while images are dithered.
+ **/
+void
+gifenc_set_cpu_flags (GifencCpuFlags flags)
+{
+  cpu_flags_allowed = flags;
+}
+
+/* finds the palette index for a 0xRRGGBB color */
+#define PALETTE_LOOKUP(palette, pixel) ((palette)->lut ? \
+    (palette)->lut[(((pixel) >> 9) & 0x7C00) | (((pixel) >> 6) & 0x3E0) | (((pixel) >> 3) & 0x1F)] : \
+    (palette)->lookup ((palette)->data, (pixel), &(pixel)))
+
+/* Maps a row to the palette using palette->exact. This is only correct
+ * when there is no error to diffuse into the row. Returns FALSE if a color
+ * isn't in the palette, the row must be dithered then. */
+static gboolean
+gifenc_dither_row_exact (const GifencPalette *palette, guint8 *target,
+    const guint8 *data, guint width)
+{
+  const guint32 *row = (const guint32 *) (void *) data;
+  guint32 color, entry, last_color;
+  guint x, hash;
+  guint8 last_index;
+
+  /* UI content has lots of runs of the same color */
+  last_color = GIFENC_EXACT_UNUSED;
+  last_index = 0;
+  for (x = 0; x < width; x++) {
+    color = row[x] & 0xFFFFFF;
+    if (color != last_color) {
+      hash = GIFENC_EXACT_HASH (color);
+      for (;;) {
+	entry = palette->exact[hash];
+	if (entry == GIFENC_EXACT_UNUSED)
+	  return FALSE;
+	if (entry >> 8 == color)
+	  break;
+	hash = (hash + 1) & ((1 << GIFENC_EXACT_BITS) - 1);
+      }
+      last_color = color;
+      last_index = entry;
+    }
+    target[x] = last_index;
+  }
+  return TRUE;
+}
+
 /* Floyd-Steinman factors */
 #define FACTOR0 (23)
 #define FACTOR1 (79)
 #define FACTOR2 (41)
 #define FACTOR_FRONT (113)
 
+/* Dithers a row of width pixels into target. this_error is the error to
+ * apply to the row, offset by one pixel. The error for the next row is put
+ * into next_error. Both hold (width + 2) * 3 values. Returns FALSE if all
+ * of next_error is 0. */
+typedef gboolean (* GifencDitherRowFunc) (const GifencPalette *	palette,
+				      guint8 *			target,
+				      const guint32 *		row,
+				      guint			width,
+				      const gint *		this_error,
+				      gint *			next_error);
+
+static gboolean
+gifenc_dither_row_c (const GifencPalette *palette, guint8 *target, 
+    const guint32 *row, guint width, const gint *this_error, gint *next_error)
+{
+  const gint *cur_error = this_error + 3;
+  gint *cur_next_error = next_error;
+  gint err[3] = { 0, 0, 0 };
+  gint diffused = 0;
+  guint32 pixel, color;
+  guint x, c;
+
+  memset (cur_next_error, 0, sizeof (gint) * 6);
+  for (x = 0; x < width; x++) {
+    for (c = 0; c < 3; c++) {
+      err[c] = ((err[c] + cur_error[c]) >> 8) + (guint8) (*row >> 8 * c);
+      err[c] = CLAMP (err[c], 0, 0xFF);
+    }
+    pixel = COLOR (err[2], err[1], err[0]);
+    target[x] = PALETTE_LOOKUP (palette, pixel);
+    color = palette->colors[target[x]];
+    for (c = 0; c < 3; c++) {
+      err[c] -= (guint8) (color >> 8 * c);
+      diffused |= err[c];
+      cur_next_error[c] += FACTOR0 * err[c];
+      cur_next_error[c + 3] += FACTOR1 * err[c];
+      cur_next_error[c + 6] = FACTOR2 * err[c];
+      err[c] *= FACTOR_FRONT;
+    }
+    row++;
+    cur_error += 3;
+    cur_next_error += 3;
+  }
+
+  return diffused != 0;
+}
+
+#ifdef GIFENC_X86
+#include <emmintrin.h>
+
+/* SSE2 has no 32bit multiplication, so multiply by the factors with shifts */
+G_STATIC_ASSERT (FACTOR0 == 16 + 8 - 1);
+G_STATIC_ASSERT (FACTOR1 == 64 + 16 - 1);
+G_STATIC_ASSERT (FACTOR2 == 32 + 8 + 1);
+G_STATIC_ASSERT (FACTOR_FRONT == 128 - 16 + 1);
+#define MUL_FACTOR0(v) _mm_sub_epi32 (_mm_add_epi32 (_mm_slli_epi32 (v, 4), _mm_slli_epi32 (v, 3)), v)
+#define MUL_FACTOR1(v) _mm_sub_epi32 (_mm_add_epi32 (_mm_slli_epi32 (v, 6), _mm_slli_epi32 (v, 4)), v)
+#define MUL_FACTOR2(v) _mm_add_epi32 (_mm_add_epi32 (_mm_slli_epi32 (v, 5), _mm_slli_epi32 (v, 3)), v)
+#define MUL_FACTOR_FRONT(v) _mm_add_epi32 (_mm_sub_epi32 (_mm_slli_epi32 (v, 7), _mm_slli_epi32 (v, 4)), v)
+
+/* Same as gifenc_dither_row_c(), but keeps the 3 channels of a pixel in
+ * one register. The 4th lane is always 0. Instead of adding to next_error
+ * three times, the values for the next two pixels are kept in registers
+ * and every value is stored once. */
+__attribute__ ((target ("sse2")))
+static gboolean
+gifenc_dither_row_sse2 (const GifencPalette *palette, guint8 *target, 
+    const guint32 *row, guint width, const gint *this_error, gint *next_error)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i mask = _mm_set_epi32 (0, -1, -1, -1);
+  __m128i err, src, clamped, color, next0, next1, diffused;
+  gint last[8];
+  guint32 pixel;
+  guint x;
+
+  err = next0 = next1 = diffused = zero;
+  for (x = 0; x < width; x++) {
+    /* this reads one value too many, but the array is big enough */
+    err = _mm_add_epi32 (err, _mm_and_si128 (mask,
+	  _mm_loadu_si128 ((const __m128i *) (void *) (this_error + 3 + 3 * x))));
+    src = _mm_cvtsi32_si128 (row[x] & 0xFFFFFF);
+    src = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (src, zero), zero);
+    err = _mm_add_epi32 (_mm_srai_epi32 (err, 8), src);
+    /* saturating to 16 and then to 8 bits clamps to 0-255 */
+    clamped = _mm_packus_epi16 (_mm_packs_epi32 (err, zero), zero);
+    pixel = _mm_cvtsi128_si32 (clamped);
+    target[x] = PALETTE_LOOKUP (palette, pixel);
+    err = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (clamped, zero), zero);
+    color = _mm_cvtsi32_si128 (palette->colors[target[x]] & 0xFFFFFF);
+    color = _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (color, zero), zero);
+    err = _mm_sub_epi32 (err, color);
+    diffused = _mm_or_si128 (diffused, err);
+    /* this stores one value too many, it's overwritten by the next pixel */
+    next0 = _mm_add_epi32 (next0, MUL_FACTOR0 (err));
+    _mm_storeu_si128 ((__m128i *) (void *) (next_error + 3 * x), next0);
+    next0 = _mm_add_epi32 (next1, MUL_FACTOR1 (err));
+    next1 = MUL_FACTOR2 (err);
+    err = MUL_FACTOR_FRONT (err);
+  }
+  _mm_storeu_si128 ((__m128i *) (void *) last, next0);
+  _mm_storeu_si128 ((__m128i *) (void *) (last + 4), next1);
+  memcpy (next_error + 3 * width, last, sizeof (gint) * 3);
+  memcpy (next_error + 3 * width + 3, last + 4, sizeof (gint) * 3);
+
+  return _mm_movemask_epi8 (_mm_cmpeq_epi32 (diffused, zero)) != 0xFFFF;
+}
+#endif /* GIFENC_X86 */
+
+static GifencDitherRowFunc
+gifenc_dither_get_row_func (void)
+{
+#ifdef GIFENC_X86
+  GifencCpuFlags flags = gifenc_get_cpu_flags ();
+
+  if (flags & GIFENC_CPU_SSE2)
+    return gifenc_dither_row_sse2;
+#endif
+  return gifenc_dither_row_c;
+}
+
+/* Ordered dithering adds an offset from this matrix to every pixel that
+ * isn't in the palette. So the index of a pixel only depends on its color
+ * and position, and pixels that didn't change keep their index. */
+static const guint8 bayer[8][8] = {
+  {  0, 32,  8, 40,  2, 34, 10, 42 },
+  { 48, 16, 56, 24, 50, 18, 58, 26 },
+  { 12, 44,  4, 36, 14, 46,  6, 38 },
+  { 60, 28, 52, 20, 62, 30, 54, 22 },
+  {  3, 35, 11, 43,  1, 33,  9, 41 },
+  { 51, 19, 59, 27, 49, 17, 57, 25 },
+  { 15, 47,  7, 39, 13, 45,  5, 37 },
+  { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+/* maps the matrix to offsets from -8 to 7 */
+#define ORDERED_OFFSET(value) ((gint) ((value) >> 2) - 8)
+
+/* Dithers a row of width pixels, the first one being at x, y in the image. */
+static void
+gifenc_dither_row_ordered (const GifencPalette *palette, guint8 *target,
+    const guint32 *row, guint width, guint x, guint y)
+{
+  const guint8 *thresholds = bayer[y & 7];
+  guint32 color, pixel;
+  guint i, c;
+  gint offset, value;
+
+  for (i = 0; i < width; i++) {
+    color = pixel = row[i] & 0xFFFFFF;
+    target[i] = PALETTE_LOOKUP (palette, pixel);
+    if (palette->colors[target[i]] == color)
+      continue;
+    offset = ORDERED_OFFSET (thresholds[(x + i) & 7]);
+    pixel = 0;
+    for (c = 0; c < 24; c += 8) {
+      value = (gint) ((color >> c) & 0xFF) + offset;
+      pixel |= (guint32) CLAMP (value, 0, 0xFF) << c;
+    }
+    target[i] = PALETTE_LOOKUP (palette, pixel);
+  }
+}
+
 void
 gifenc_dither_rgb (guint8* target, guint target_rowstride, 
     const GifencPalette *palette, const guint8 *data, guint width, guint height, 
     guint rowstride)
 {
-  guint x, y, c;
-  gint *this_error, *next_error;
-  guint8 this[3];
-  gint err[3] = { 0, 0, 0 };
-  guint32 pixel;
+  GifencDitherRowFunc dither_row;
+  guint y;
+  gint *this_error, *next_error, *tmp;
+  gboolean clean = TRUE;
   
   g_return_if_fail (palette != NULL);
 
+  dither_row = gifenc_dither_get_row_func ();
   this_error = g_new0 (gint, (width + 2) * 3);
   next_error = g_new (gint, (width + 2) * 3);
   for (y = 0; y < height; y++) {
-    const guint32 *row = (const guint32 *) (void *) data;
-    gint *cur_error = this_error + 3;
-    gint *cur_next_error = next_error;
-    err[0] = err[1] = err[2] = 0;
-    memset (cur_next_error, 0, sizeof (gint) * 6);
-    for (x = 0; x < width; x++) {
-      //g_print ("%dx%d  %2X%2X%2X  %2d %2d %2d", x, y, row[0], row[1], row[2],
-      //    (err[0] + cur_error[0]) >> 8, (err[1] + cur_error[1]) >> 8,
-      //    (err[2] + cur_error[2]) >> 8);
-      for (c = 0; c < 3; c++) {
-	err[c] = ((err[c] + cur_error[c]) >> 8) + (guint8) (*row >> 8 * c);
-	this[c] = err[c] = CLAMP (err[c], 0, 0xFF);
-      }
-      pixel = COLOR (err[2], err[1], err[0]);
-      //g_print ("  %2X%2X%2X =>", this[0], this[1], this[2]);
-      target[x] = palette->lookup (palette->data, pixel, &pixel);
-      //g_print (" %2X%2X%2X (%u) %p\n", this[0], this[1], this[2], (guint) target[x], target + x);
-      for (c = 0; c < 3; c++) {
-	this[c] = *row >> 8 * c;
-	err[c] -= this[c];
-	cur_next_error[c] += FACTOR0 * err[c];
-	cur_next_error[c + 3] += FACTOR1 * err[c];
-	cur_next_error[c + 6] = FACTOR2 * err[c];
-	err[c] *= FACTOR_FRONT;
-      }
-      row++;
-      cur_error += 3;
-      cur_next_error += 3;
+    if (palette->exact && clean && 
+	gifenc_dither_row_exact (palette, target, data, width)) {
+      /* this_error is all zeros and stays valid for the next row */
+    } else {
+      clean = !dither_row (palette, target, (const guint32 *) (void *) data, 
+	  width, this_error, next_error);
+      tmp = this_error;
+      this_error = next_error;
+      next_error = tmp;
     }
     data += rowstride;
-    cur_error = this_error;
-    this_error = next_error;
-    next_error = cur_error;
     target += target_rowstride;
   }
   g_free (this_error);
   g_free (next_error);
 }
 
+/**
+ * gifenc_dither_rgb_ordered:
+ * @target: place to put the palette indexes
+ * @target_rowstride: rowstride of @target
+ * @palette: palette to dither to
+ * @data: RGB data to dither
+ * @x: x position of @data in the image
+ * @y: y position of @data in the image
+ * @width: width of @data
+ * @height: height of @data
+ * @rowstride: rowstride of @data
+ *
+ * Like gifenc_dither_rgb(), but uses ordered dithering. The index of a 
+ * pixel then only depends on its color and its position in the image, so 
+ * pixels that didn't change between images get the same index, even if
+ * pixels next to them changed.
+ **/
+void
+gifenc_dither_rgb_ordered (guint8 *target, guint target_rowstride,
+    const GifencPalette *palette, const guint8 *data, guint x, guint y,
+    guint width, guint height, guint rowstride)
+{
+  guint i;
+
+  g_return_if_fail (palette != NULL);
+
+  for (i = 0; i < height; i++) {
+    if (!palette->exact || 
+	!gifenc_dither_row_exact (palette, target, data, width))
+      gifenc_dither_row_ordered (palette, target, 
+	  (const guint32 *) (void *) data, width, x, y + i);
+    data += rowstride;
+    target += target_rowstride;
+  }
+}
+
+struct _GifencDither {
+  const GifencPalette *	palette;	/* palette to dither to */
+  guint			width;		/* width of a row */
+  guint8		alpha;		/* transparent index of palette */
+  gint *		this_error;	/* error to apply to the current row */
+  gint *		next_error;	/* error to apply to the next row */
+  gboolean		clean;		/* TRUE if this_error is all zeros */
+  GifencDitherRowFunc	dither_row;	/* function dithering a row */
+  gboolean		ordered;	/* use ordered dithering */
+  guint			x;		/* x position of the rows in the image */
+  guint			y;		/* y position of the next row in the image */
+};
+
+/**
+ * gifenc_dither_new:
+ * @palette: a palette with transparency
+ * @width: width of the rows to dither
+ *
+ * Creates a state to dither an image row by row from top to bottom with
+ * gifenc_dither_row_with_full_image(). This allows producing rows just in 
+ * time for gifenc_image_add_row().
+ *
+ * Returns: a new dither state to be freed with gifenc_dither_free()
+ **/
+GifencDither *
+gifenc_dither_new (const GifencPalette *palette, guint width)
+{
+  GifencDither *dither;
+
+  g_return_val_if_fail (palette != NULL, NULL);
+  g_return_val_if_fail (palette->alpha, NULL);
+  g_return_val_if_fail (width > 0, NULL);
+
+  dither = g_slice_new (GifencDither);
+  dither->palette = palette;
+  dither->width = width;
+  dither->alpha = gifenc_palette_get_alpha_index (palette);
+  dither->this_error = g_new0 (gint, (width + 2) * 3);
+  dither->next_error = g_new (gint, (width + 2) * 3);
+  dither->clean = TRUE;
+  dither->dither_row = gifenc_dither_get_row_func ();
+  dither->ordered = FALSE;
+  dither->x = 0;
+  dither->y = 0;
+
+  return dither;
+}
+
+/**
+ * gifenc_dither_new_ordered:
+ * @palette: a palette with transparency
+ * @x: x position of the rows in the image
+ * @y: y position of the first row in the image
+ * @width: width of the rows to dither
+ *
+ * Like gifenc_dither_new(), but the rows are dithered like 
+ * gifenc_dither_rgb_ordered() does.
+ *
+ * Returns: a new dither state to be freed with gifenc_dither_free()
+ **/
+GifencDither *
+gifenc_dither_new_ordered (const GifencPalette *palette, guint x, guint y,
+    guint width)
+{
+  GifencDither *dither;
+
+  dither = gifenc_dither_new (palette, width);
+  if (dither == NULL)
+    return NULL;
+
+  dither->ordered = TRUE;
+  dither->x = x;
+  dither->y = y;
+
+  return dither;
+}
+
+void
+gifenc_dither_free (GifencDither *dither)
+{
+  g_return_if_fail (dither != NULL);
+
+  g_free (dither->this_error);
+  g_free (dither->next_error);
+  g_slice_free (GifencDither, dither);
+}
+
+/**
+ * gifenc_dither_row_with_full_image:
+ * @dither: the dither state
+ * @target: row to put the palette indexes into
+ * @full: row of the currently displayed image, will be updated
+ * @data: row of RGB data to dither
+ * @first_out: location to take the first changed pixel or %NULL
+ * @last_out: location to take the last changed pixel or %NULL
+ *
+ * Dithers the next row. Pixels that don't differ from @full are set to the
+ * transparent index.
+ *
+ * Returns: %TRUE if any pixel changed. The locations are only set in that 
+ *          case.
+ **/
+gboolean
+gifenc_dither_row_with_full_image (GifencDither *dither, guint8 *target, guint8 *full,
+    const guint8 *data, guint *first_out, guint *last_out)
+{
+  const GifencPalette *palette = dither->palette;
+  guint x, first, last;
+  gint *tmp;
+  
+  if (palette->exact && dither->clean &&
+      gifenc_dither_row_exact (palette, target, data, dither->width)) {
+    /* all colors are in the palette */
+  } else if (dither->ordered) {
+    gifenc_dither_row_ordered (palette, target, (const guint32 *) (void *) data,
+	dither->width, dither->x, dither->y);
+  } else {
+    dither->clean = !dither->dither_row (palette, target, 
+	(const guint32 *) (void *) data, dither->width, 
+	dither->this_error, dither->next_error);
+    tmp = dither->this_error;
+    dither->this_error = dither->next_error;
+    dither->next_error = tmp;
+  }
+  dither->y++;
+
+  first = G_MAXUINT;
+  last = 0;
+  for (x = 0; x < dither->width; x++) {
+    if (target[x] == full[x]) {
+      target[x] = dither->alpha;
+    } else {
+      first = MIN (x, first);
+      last = x;
+      full[x] = target[x];
+    }
+  }
+
+  if (first > last)
+    return FALSE;
+
+  if (first_out)
+    *first_out = first;
+  if (last_out)
+    *last_out = last;
+  return TRUE;
+}
+
 gboolean
 gifenc_dither_rgb_with_full_image (guint8 *target, guint target_rowstride, 
     guint8 *full, guint full_rowstride,
     const GifencPalette *palette, const guint8 *data, guint width, guint height, 
     guint rowstride, cairo_rectangle_int_t *rect_out)
 {
-  int x, y, c;
-  gint *this_error, *next_error;
-  guint8 this[3], alpha;
-  gint err[3] = { 0, 0, 0 };
-  guint32 pixel;
+  GifencDither *dither;
+  guint y, first, last;
   cairo_rectangle_int_t area = { width, height, 0, 0 };
   
   g_return_val_if_fail (palette != NULL, FALSE);
   g_return_val_if_fail (palette->alpha, FALSE);
-  alpha = gifenc_palette_get_alpha_index (palette);
 
-  this_error = g_new0 (gint, (width + 2) * 3);
-  next_error = g_new (gint, (width + 2) * 3);
-  for (y = 0; y < (int) height; y++) {
-    const guint32 *row = (const guint32 *) (void *) data;
-    gint *cur_error = this_error + 3;
-    gint *cur_next_error = next_error;
-    err[0] = err[1] = err[2] = 0;
-    memset (cur_next_error, 0, sizeof (gint) * 6);
-    for (x = 0; x < (int) width; x++) {
-      //g_print ("%dx%d  %2X%2X%2X  %2d %2d %2d", x, y, row[0], row[1], row[2],
-      //    (err[0] + cur_error[0]) >> 8, (err[1] + cur_error[1]) >> 8,
-      //    (err[2] + cur_error[2]) >> 8);
-      for (c = 0; c < 3; c++) {
-	err[c] = ((err[c] + cur_error[c]) >> 8) + (guint8) (*row >> 8 * c);
-	this[c] = err[c] = CLAMP (err[c], 0, 0xFF);
-      }
-      //g_print ("  %2X%2X%2X =>", this[0], this[1], this[2]);
-      pixel = COLOR (this[2], this[1], this[0]);
-      target[x] = palette->lookup (palette->data, pixel, &pixel);
-      if (target[x] == full[x]) {
-	target[x] = alpha;
-      } else {
-	area.x = MIN (x, area.x);
-	area.y = MIN (y, area.y);
-	area.width = MAX (x, area.width);
-	area.height = MAX (y, area.height);
-	full[x] = target[x];
-      }
-      //g_print (" %2X%2X%2X (%u) %p\n", this[0], this[1], this[2], (guint) target[x], target + x);
-      for (c = 0; c < 3; c++) {
-	this[0] = *row >> 8 * c;
-	err[c] -= this[c];
-	cur_next_error[c] += FACTOR0 * err[c];
-	cur_next_error[c + 3] += FACTOR1 * err[c];
-	cur_next_error[c + 6] = FACTOR2 * err[c];
-	err[c] *= FACTOR_FRONT;
-      }
-      row++;
-      cur_error += 3;
-      cur_next_error += 3;
+  dither = gifenc_dither_new (palette, width);
+  for (y = 0; y < height; y++) {
+    if (gifenc_dither_row_with_full_image (dither, target, full, data, &first, &last)) {
+      area.x = MIN ((int) first, area.x);
+      area.y = MIN ((int) y, area.y);
+      area.width = MAX ((int) last, area.width);
+      area.height = y;
     }
     data += rowstride;
-    cur_error = this_error;
-    this_error = next_error;
-    next_error = cur_error;
     target += target_rowstride;
     full += full_rowstride;
   }
-  g_free (this_error);
-  g_free (next_error);
+  gifenc_dither_free (dither);
 
   if (area.width < area.x || area.height < area.y) {
     return FALSE;
@@ -598,11 +2045,8 @@ gifenc_dither_rgb_with_full_image (guint8 *target, guint target_rowstride,
     if (rect_out) {
       area.width = area.width - area.x + 1;
       area.height = area.height - area.y + 1;
-      //g_print ("image was %d %d, relevant is %d %d %d %d\n", width, height,
-      //    area.x, area.y, area.width, area.height);
       *rect_out = area;
     }
     return TRUE;
   }
 }
-
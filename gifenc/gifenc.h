@@ -24,8 +24,17 @@
 typedef struct _GifencPalette GifencPalette;
 typedef struct _GifencColor GifencColor;
 typedef struct _Gifenc Gifenc;
+typedef struct _GifencDict GifencDict;
+typedef struct _GifencStripe GifencStripe;
+typedef struct _GifencBuffer GifencBuffer;
+typedef struct _GifencImage GifencImage;
+typedef struct _GifencDither GifencDither;
+typedef struct _GifencStats GifencStats;
+typedef struct _GifencHistogram GifencHistogram;
 
 typedef gboolean (* GifencWriteFunc) (gpointer closure, const guchar *data, gsize len, GError **error);
+typedef gboolean (* GifencWritevFunc) (gpointer closure, GOutputVector *vectors, gsize n_vectors, GError **error);
+typedef void (* GifencParallelFunc) (gpointer data, guint id);
 
 typedef enum {
   GIFENC_STATE_NEW = 0,
@@ -33,6 +42,16 @@ typedef enum {
   GIFENC_STATE_CLOSED,
 } GifencState;
 
+typedef enum {
+  GIFENC_QUANTIZER_OCTREE = 0,
+  GIFENC_QUANTIZER_MEDIAN_CUT,
+  GIFENC_QUANTIZER_WU
+} GifencQuantizer;
+
+typedef enum {
+  GIFENC_CPU_SSE2 = (1 << 0)
+} GifencCpuFlags;
+
 struct _GifencPalette {
   gboolean	alpha;
   guint32 *	colors;
@@ -43,6 +62,20 @@ struct _GifencPalette {
 				 guint32	      	color,
 				 guint32 *		resulting_color);
   void		(* free)	(gpointer		data);
+  guint8 *	lut;		/* 5-5-5 RGB to index table for fast lookups or NULL */
+  guint32 *	exact;		/* hash table of color << 8 | index for the exact colors or NULL */
+};
+
+/* size of GifencPalette.exact and where to start looking for a color in it */
+#define GIFENC_EXACT_BITS 10
+#define GIFENC_EXACT_HASH(color) (((color) * 0x9E3779B1u) >> (32 - GIFENC_EXACT_BITS))
+#define GIFENC_EXACT_UNUSED 0xFFFFFFFFu
+
+struct _GifencStats {
+  guint64		n_images;	/* number of images written */
+  guint64		image_bytes;	/* bytes of compressed image data written */
+  guint64		exact_image_bytes; /* image_bytes when compressing losslessly */
+  guint64		n_local_palettes; /* number of images written with a local palette */
 };
 
 struct _Gifenc {
@@ -51,11 +84,21 @@ struct _Gifenc {
 
   /* output */
   GifencWriteFunc       write_func;
+  GifencWritevFunc      writev_func;
   gpointer              write_data;
   GDestroyNotify        write_destroy;
   GByteArray *          buffer;
   guint			bits;
   guint			n_bits;
+  guint			n_stripes;	/* maximum number of stripes to encode in parallel */
+  GSList *		dicts;		/* unused LZW dictionaries */
+  GSList *		buffers;	/* unused output buffers */
+  GMutex		dicts_lock;	/* lock protecting dicts and buffers */
+  guint			lossy;		/* tolerance for lossy compression or 0 */
+  gboolean		measure_exact;	/* TRUE to compute exact_image_bytes */
+  guint8 *		lossy_near;	/* replacement colors, closest first */
+  guint16 *		lossy_near_start; /* start of every color's replacements in lossy_near */
+  GifencStats		stats;		/* statistics */
   
   /* image */
   guint		  	width;
@@ -84,8 +127,49 @@ gboolean        gifenc_add_image	(Gifenc *		enc,
 					 guint8 *		data,
 					 guint			rowstride,
                                          GError **		error);
+gboolean	gifenc_add_images	(Gifenc *		enc,
+					 const cairo_rectangle_int_t *rects,
+					 guint			n_rects,
+					 guint			display_millis,
+					 guint8 *		data,
+					 guint			rowstride,
+                                         GError **		error);
+GifencImage *	gifenc_image_new	(Gifenc *		enc,
+					 guint			x,
+					 guint			y,
+					 guint			width,
+					 guint			height);
+void		gifenc_image_free	(GifencImage *		image);
+void		gifenc_image_set_palette(GifencImage *		image,
+					 const GifencPalette *	palette);
+guint		gifenc_image_get_n_stripes
+					(const GifencImage *	image);
+void		gifenc_image_get_stripe	(const GifencImage *	image,
+					 guint			stripe,
+					 guint *		y,
+					 guint *		height);
+void		gifenc_image_add_row	(GifencImage *		image,
+					 guint			stripe,
+					 const guint8 *		row);
+void		gifenc_image_add_row_with_full_image
+					(GifencImage *		image,
+					 guint			stripe,
+					 const guint8 *		row,
+					 const guint8 *		full);
+gboolean	gifenc_image_write	(GifencImage *		image,
+					 guint			display_millis,
+					 GError **		error);
 gboolean        gifenc_close            (Gifenc *       	gifenc,
                                          GError **      	error);
+void		gifenc_set_n_stripes	(Gifenc *		enc,
+					 guint			n_stripes);
+void		gifenc_set_writev_func	(Gifenc *		enc,
+					 GifencWritevFunc	writev_func);
+void		gifenc_set_lossy	(Gifenc *		enc,
+					 guint			tolerance,
+					 gboolean		measure_exact);
+const GifencStats *
+		gifenc_get_stats	(Gifenc *		enc);
 guint           gifenc_get_width        (Gifenc *               gifenc);
 guint           gifenc_get_height       (Gifenc *               gifenc);
 
@@ -107,6 +191,38 @@ gboolean	gifenc_dither_rgb_with_full_image
 					 guint			 height,
 					 guint			 rowstride,
 					 cairo_rectangle_int_t * rect_out);
+void		gifenc_dither_rgb_ordered
+					(guint8 *		target,
+					 guint			target_rowstride,
+					 const GifencPalette *	palette,
+					 const guint8 *		data,
+					 guint			x,
+					 guint			y,
+					 guint			width,
+					 guint			height,
+					 guint			rowstride);
+GifencDither *	gifenc_dither_new	(const GifencPalette *	palette,
+					 guint			width);
+GifencDither *	gifenc_dither_new_ordered
+					(const GifencPalette *	palette,
+					 guint			x,
+					 guint			y,
+					 guint			width);
+void		gifenc_dither_free	(GifencDither *		dither);
+gboolean	gifenc_dither_row_with_full_image
+					(GifencDither *		 dither,
+					 guint8 *		 target,
+					 guint8 *		 full,
+					 const guint8 *		 data,
+					 guint *		 first_out,
+					 guint *		 last_out);
+
+GifencCpuFlags	gifenc_get_cpu_flags	(void);
+void		gifenc_set_cpu_flags	(GifencCpuFlags		flags);
+
+void		gifenc_parallel		(GifencParallelFunc	func,
+					 gpointer		data,
+					 guint			n_jobs);
 
 /* from quantize.c */
 void		gifenc_palette_free	(GifencPalette *	palette);
@@ -117,12 +233,39 @@ GifencPalette *	gifenc_quantize_image	(const guint8 *		data,
 					 guint			rowstride, 
 					 gboolean		alpha,
 					 guint			max_colors);
+GifencHistogram *
+		gifenc_histogram_new	(void);
+void		gifenc_histogram_free	(GifencHistogram *	hist);
+void		gifenc_histogram_add_image
+					(GifencHistogram *	hist,
+					 const guint8 *		data,
+					 guint			width,
+					 guint			height,
+					 guint			rowstride,
+					 guint			max_samples);
+guint		gifenc_histogram_get_n_colors
+					(const GifencHistogram *hist);
+GifencPalette *	gifenc_quantize_histogram
+					(const GifencHistogram *hist,
+					 GifencQuantizer	quantizer,
+					 gboolean		alpha,
+					 guint			max_colors);
+void		gifenc_palette_set_fast_lookup
+					(GifencPalette *	palette,
+					 gboolean		fast);
 guint		gifenc_palette_get_alpha_index
 					(const GifencPalette *	palette);
 guint		gifenc_palette_get_num_colors
 					(const GifencPalette *	palette);
 guint32		gifenc_palette_get_color(const GifencPalette *	palette,
 					 guint			id);
+guint64		gifenc_palette_get_error(const GifencPalette *	palette,
+					 const guint8 *		data,
+					 guint			width,
+					 guint			height,
+					 guint			rowstride,
+					 guint			max_samples,
+					 guint *		n_samples);
 					
 
 #endif /* __HAVE_GIFENC_H__ */
@@ -32,6 +32,9 @@ gifenc_palette_free (GifencPalette *palette)
 
   if (palette->free)
     palette->free (palette->data);
+  g_free (palette->colors);
+  g_free (palette->lut);
+  g_free (palette->exact);
   g_free (palette);
 }
 
@@ -61,6 +64,270 @@ gifenc_palette_get_color (const GifencPalette *palette, guint id)
   return palette->colors[id];
 }
 
+/*** NEAREST COLOR ***/
+
+/* Finds the palette color closest to a given color in RGB space. The 
+ * colors are sorted by a luma-like key. As the difference in key gives a 
+ * lower bound for the distance, the search walks outwards from the key of 
+ * the color and stops once no closer color can follow. Results are
+ * remembered in a direct-mapped cache that can be used from many threads at
+ * once: every entry is a single 32bit value of color << 8 | index. */
+
+/* weights of red, green and blue in the key and the sum of their squares */
+#define NEAREST_KEY(color) (3 * (((color) >> 16) & 0xFF) + 6 * (((color) >> 8) & 0xFF) + ((color) & 0xFF))
+#define NEAREST_KEY_NORM (3 * 3 + 6 * 6 + 1 * 1)
+/* number of cached colors */
+#define NEAREST_CACHE_BITS (16)
+#define NEAREST_CACHE_SLOT(color) (((color) * 0x9E3779B1u) >> (32 - NEAREST_CACHE_BITS))
+
+typedef struct {
+  guint			key;		/* NEAREST_KEY (color) */
+  guint32		color;		/* the color */
+  guint			id;		/* its index in the palette */
+} GifencNearestEntry;
+
+typedef struct {
+  GifencNearestEntry *	entries;	/* colors sorted by key */
+  guint			n_entries;	/* number of colors */
+  guint32 *		colors;		/* colors in palette order */
+  gint *		cache;		/* NEAREST_CACHE_BITS cached lookups */
+} GifencNearest;
+
+static int
+gifenc_nearest_compare (gconstpointer a, gconstpointer b)
+{
+  const GifencNearestEntry *ea = a, *eb = b;
+
+  if (ea->key != eb->key)
+    return ea->key < eb->key ? -1 : 1;
+  return ea->id < eb->id ? -1 : ea->id > eb->id;
+}
+
+static GifencNearest *
+gifenc_nearest_new (const guint32 *colors, guint n_colors)
+{
+  GifencNearest *nearest;
+  guint i;
+
+  g_assert (n_colors > 0);
+
+  nearest = g_new (GifencNearest, 1);
+  nearest->n_entries = n_colors;
+  nearest->entries = g_new (GifencNearestEntry, n_colors);
+  nearest->colors = g_new (guint32, n_colors);
+  for (i = 0; i < n_colors; i++) {
+    nearest->colors[i] = colors[i] & 0xFFFFFF;
+    nearest->entries[i].color = nearest->colors[i];
+    nearest->entries[i].key = NEAREST_KEY (nearest->entries[i].color);
+    nearest->entries[i].id = i;
+  }
+  qsort (nearest->entries, n_colors, sizeof (GifencNearestEntry), gifenc_nearest_compare);
+
+  /* Every slot starts out with a color that doesn't belong into it, so 
+   * it can never match. Color 0 goes everywhere but into its own slot. */
+  nearest->cache = g_new (gint, 1 << NEAREST_CACHE_BITS);
+  for (i = 0; i < 1 << NEAREST_CACHE_BITS; i++) {
+    nearest->cache[i] = 0;
+  }
+  for (i = 1; NEAREST_CACHE_SLOT (i) == NEAREST_CACHE_SLOT (0); i++);
+  nearest->cache[NEAREST_CACHE_SLOT (0)] = i << 8;
+
+  return nearest;
+}
+
+static void
+gifenc_nearest_free (GifencNearest *nearest)
+{
+  g_free (nearest->cache);
+  g_free (nearest->colors);
+  g_free (nearest->entries);
+  g_free (nearest);
+}
+
+static inline guint
+gifenc_nearest_distance (guint32 a, guint32 b)
+{
+  gint dr = (gint) ((a >> 16) & 0xFF) - (gint) ((b >> 16) & 0xFF);
+  gint dg = (gint) ((a >> 8) & 0xFF) - (gint) ((b >> 8) & 0xFF);
+  gint db = (gint) (a & 0xFF) - (gint) (b & 0xFF);
+
+  return dr * dr + dg * dg + db * db;
+}
+
+static guint
+gifenc_nearest_search (const GifencNearest *nearest, guint32 color)
+{
+  const GifencNearestEntry *entries = nearest->entries;
+  guint key = NEAREST_KEY (color);
+  guint lo, hi, mid, dist, best, best_dist;
+  gint up, down;
+  gboolean searching;
+
+  /* find the first color with a key that isn't smaller */
+  lo = 0;
+  hi = nearest->n_entries;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (entries[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  best = entries[MIN (lo, nearest->n_entries - 1)].id;
+  best_dist = G_MAXUINT;
+  up = lo;
+  down = (gint) lo - 1;
+  do {
+    searching = FALSE;
+    if (up < (gint) nearest->n_entries) {
+      guint diff = entries[up].key - key;
+      if (diff * diff < best_dist * (guint64) NEAREST_KEY_NORM) {
+	dist = gifenc_nearest_distance (color, entries[up].color);
+	if (dist < best_dist) {
+	  best_dist = dist;
+	  best = entries[up].id;
+	}
+	up++;
+	searching = TRUE;
+      }
+    }
+    if (down >= 0) {
+      guint diff = key - entries[down].key;
+      if (diff * diff < best_dist * (guint64) NEAREST_KEY_NORM) {
+	dist = gifenc_nearest_distance (color, entries[down].color);
+	if (dist < best_dist) {
+	  best_dist = dist;
+	  best = entries[down].id;
+	}
+	down--;
+	searching = TRUE;
+      }
+    }
+  } while (searching);
+
+  return best;
+}
+
+/* returns the index of the palette color closest to color */
+static guint
+gifenc_nearest_lookup (GifencNearest *nearest, guint32 color)
+{
+  gint *slot;
+  guint cached, id;
+
+  color &= 0xFFFFFF;
+  slot = &nearest->cache[NEAREST_CACHE_SLOT (color)];
+  cached = g_atomic_int_get (slot);
+  if ((cached >> 8) == color)
+    return cached & 0xFF;
+
+  id = gifenc_nearest_search (nearest, color);
+  g_atomic_int_set (slot, (color << 8) | id);
+  return id;
+}
+
+/**
+ * gifenc_palette_set_fast_lookup:
+ * @palette: the palette
+ * @fast: %TRUE to look up colors in a table
+ *
+ * Decides how the dither functions find the index for a color. By default
+ * the palette's lookup function is used. With fast lookups a table of
+ * 32768 entries is built that maps the top 5 bits of every channel to the
+ * closest color in the palette, so a lookup is a single load. This is a 
+ * lot faster, but colors that differ only in their lower bits map to the 
+ * same index.
+ **/
+void
+gifenc_palette_set_fast_lookup (GifencPalette *palette, gboolean fast)
+{
+  GifencNearest *nearest;
+  guint r, g, b;
+
+  g_return_if_fail (palette != NULL);
+
+  if (!fast) {
+    g_free (palette->lut);
+    palette->lut = NULL;
+    return;
+  }
+  if (palette->lut)
+    return;
+
+  palette->lut = g_malloc (32 * 32 * 32);
+  nearest = gifenc_nearest_new (palette->colors, palette->num_colors);
+  for (r = 0; r < 32; r++) {
+    for (g = 0; g < 32; g++) {
+      for (b = 0; b < 32; b++) {
+	/* use the color closest to the center of the cell */
+	palette->lut[(r << 10) | (g << 5) | b] = gifenc_nearest_search (nearest, 
+	    ((r << 19) | (g << 11) | (b << 3)) + 0x040404);
+      }
+    }
+  }
+  gifenc_nearest_free (nearest);
+}
+
+/**
+ * gifenc_palette_get_error:
+ * @palette: the palette
+ * @data: RGB image data
+ * @width: width of the image
+ * @height: height of the image
+ * @rowstride: rowstride of @data
+ * @max_samples: maximum number of pixels to look at or 0 for all
+ * @n_samples: location to take the number of pixels looked at or %NULL
+ *
+ * Finds out how well @palette fits an image by looking up its pixels the 
+ * way the dither functions do, but without dithering. Only every n-th 
+ * pixel of every n-th row is looked at if the image has more than 
+ * @max_samples pixels.
+ *
+ * Returns: the sum of the squared distances in RGB space between the 
+ *          pixels looked at and the colors they map to
+ **/
+guint64
+gifenc_palette_get_error (const GifencPalette *palette, const guint8 *data,
+    guint width, guint height, guint rowstride, guint max_samples, guint *n_samples)
+{
+  const guint32 *row;
+  guint32 color, result;
+  guint64 error = 0;
+  guint x, y, step, n = 0;
+  int dr, dg, db;
+
+  g_return_val_if_fail (palette != NULL, 0);
+  g_return_val_if_fail (data != NULL || width == 0 || height == 0, 0);
+
+  step = 1;
+  if (max_samples > 0) {
+    while ((guint64) ((width + step - 1) / step) * ((height + step - 1) / step) > max_samples)
+      step++;
+  }
+
+  for (y = 0; y < height; y += step) {
+    row = (const guint32 *) (const void *) (data + (gsize) y * rowstride);
+    for (x = 0; x < width; x += step) {
+      color = row[x] & 0xFFFFFF;
+      if (palette->lut)
+	result = palette->colors[palette->lut[((color >> 9) & 0x7C00) | 
+	    ((color >> 6) & 0x3E0) | ((color >> 3) & 0x1F)]];
+      else
+	palette->lookup (palette->data, color, &result);
+      dr = (int) ((color >> 16) & 0xFF) - (int) ((result >> 16) & 0xFF);
+      dg = (int) ((color >> 8) & 0xFF) - (int) ((result >> 8) & 0xFF);
+      db = (int) (color & 0xFF) - (int) (result & 0xFF);
+      error += dr * dr + dg * dg + db * db;
+      n++;
+    }
+  }
+
+  if (n_samples)
+    *n_samples = n;
+  return error;
+}
+
 /*** SIMPLE ***/
 
 static guint
@@ -94,6 +361,8 @@ gifenc_palette_get_simple (gboolean alpha)
   palette->data = GINT_TO_POINTER (alpha ? 1 : 0);
   palette->lookup = gifenc_palette_simple_lookup;
   palette->free = NULL;
+  palette->lut = NULL;
+  palette->exact = NULL;
 
   return palette;
 }
@@ -105,69 +374,106 @@ gifenc_palette_get_simple (gboolean alpha)
 /* maximum number of leaves before stopping a running color reduction */
 #define STOP_LEAVES (MAX_LEAVES >> 2)
 
-typedef struct _GifencOctree GifencOctree;
-struct _GifencOctree {
-  GifencOctree *	children[8];	/* children nodes or NULL */
-  guint			level;		/* how deep in tree are we? */
-  guint			red;		/* sum of all red pixels */
-  guint			green;		/* sum of green pixels */
-  guint			blue;		/* sum of blue pixels */
-  guint			count;		/* amount of pixels at this node */
+/* The octree lives in one array of nodes that is grown as needed and freed
+ * in one go. Nodes refer to their children by index, the root is always
+ * node 0 and can never be a child, so 0 means "no child". Nodes removed
+ * by color reduction are put on a free list linked via children[0] and
+ * reused, so the tree never grows much beyond MAX_LEAVES leaves. */
+typedef struct _GifencOctreeNode GifencOctreeNode;
+struct _GifencOctreeNode {
+  guint32		children[8];	/* indexes of children nodes or 0 */
+  guint32		red;		/* sum of all red pixels */
+  guint32		green;		/* sum of green pixels */
+  guint32		blue;		/* sum of blue pixels */
+  guint32		count;		/* amount of pixels at this node */
   guint32     		color;		/* representations (depending on value):
 					   -1: random non-leaf node 
 					   -2: root node
 					   0x1000000: leaf node with undefined color
 					   0-0xFFFFFF: leaf node with defined color */
-  guint			id;		/* color index */
-};					  
+  guint8		level;		/* how deep in tree are we? */
+  guint8		id;		/* color index */
+};
+typedef struct _GifencOctree GifencOctree;
+struct _GifencOctree {
+  GifencOctreeNode *	nodes;		/* all nodes, root first */
+  guint			n_nodes;	/* number of nodes in use */
+  guint			n_allocated;	/* number of nodes allocated */
+  guint			free_nodes;	/* first unused node or 0 */
+  GifencNearest *	nearest;	/* exact lookups of palette colors or NULL */
+};
 typedef struct {
   GifencOctree *	tree;
-  GSList *		non_leaves;
+  GArray *		non_leaves;	/* indexes of all non-leaf nodes but the root */
   guint			num_leaves;
 } OctreeInfo;
-#define OCTREE_IS_LEAF(tree) ((tree)->color <= 0x1000000)
+#define OCTREE_IS_LEAF(node) ((node)->color <= 0x1000000)
+
+static guint
+gifenc_octree_add_node (GifencOctree *tree, guint level, guint32 color)
+{
+  GifencOctreeNode *node;
+  guint index;
+
+  if (tree->free_nodes) {
+    index = tree->free_nodes;
+    tree->free_nodes = tree->nodes[index].children[0];
+  } else {
+    if (tree->n_nodes == tree->n_allocated) {
+      tree->n_allocated = MAX (tree->n_allocated * 2, 64);
+      tree->nodes = g_renew (GifencOctreeNode, tree->nodes, tree->n_allocated);
+    }
+    index = tree->n_nodes++;
+  }
+  node = &tree->nodes[index];
+  memset (node, 0, sizeof (GifencOctreeNode));
+  node->level = level;
+  node->color = color;
+
+  return index;
+}
 
 static GifencOctree *
-gifenc_octree_new (void)
+gifenc_octree_new (guint n_nodes)
 {
-  GifencOctree *ret = g_new0 (GifencOctree, 1);
+  GifencOctree *tree = g_new0 (GifencOctree, 1);
 
-  ret->color = (guint) -1;
-  return ret;
+  tree->n_allocated = n_nodes;
+  tree->nodes = g_new (GifencOctreeNode, n_nodes);
+  return tree;
 }
 
 static void
 gifenc_octree_free (gpointer data)
 {
   GifencOctree *tree = data;
-  guint i;
   
-  for (i = 0; i < 8; i++) {
-    if (tree->children[i])
-      gifenc_octree_free (tree->children[i]);
-  }
+  if (tree->nearest)
+    gifenc_nearest_free (tree->nearest);
+  g_free (tree->nodes);
   g_free (tree);
 }
 
 #if 0
 #define PRINT_NON_LEAVES 1
 static void
-gifenc_octree_print (GifencOctree *tree, guint flags)
+gifenc_octree_print (const GifencOctree *tree, guint index, guint flags)
 {
+  const GifencOctreeNode *node = &tree->nodes[index];
 #define FLAG_SET(flag) (flags & (flag))
-  if (OCTREE_IS_LEAF (tree)) {
-    g_print ("%*s %6d %2X-%2X-%2X\n", tree->level * 2, "", tree->count, 
-	tree->red / tree->count, tree->green / tree->count, tree->blue / tree->count);
+  if (OCTREE_IS_LEAF (node)) {
+    g_print ("%*s %6d %2X-%2X-%2X\n", node->level * 2, "", node->count, 
+	node->red / node->count, node->green / node->count, node->blue / node->count);
   } else {
     guint i;
     if (FLAG_SET(PRINT_NON_LEAVES))
-      g_print ("%*s %6d\n", tree->level * 2, "", tree->count);
-    g_assert (tree->red == 0);
-    g_assert (tree->green == 0);
-    g_assert (tree->blue == 0);
+      g_print ("%*s %6d\n", node->level * 2, "", node->count);
+    g_assert (node->red == 0);
+    g_assert (node->green == 0);
+    g_assert (node->blue == 0);
     for (i = 0; i < 8; i++) {
-      if (tree->children[i])
-	gifenc_octree_print (tree->children[i], flags);
+      if (node->children[i])
+	gifenc_octree_print (tree, node->children[i], flags);
     }
   }
 #undef FLAG_SET
@@ -191,213 +497,1230 @@ color_to_index (guint color, guint level)
 }
 
 static void
-gifenc_octree_add_one (GifencOctree *tree, guint32 color, guint count)
+gifenc_octree_add_one (GifencOctreeNode *node, guint32 color, guint count)
 {
-  tree->red += ((color >> 16) & 0xFF) * count;
-  tree->green += ((color >> 8) & 0xFF) * count;
-  tree->blue += (color & 0xFF) * count;
+  node->red += ((color >> 16) & 0xFF) * count;
+  node->green += ((color >> 8) & 0xFF) * count;
+  node->blue += (color & 0xFF) * count;
 }
 
 static void
 gifenc_octree_add_color (OctreeInfo *info, guint32 color, guint count)
 {
-  guint i;
   GifencOctree *tree = info->tree;
+  GifencOctreeNode *node;
+  guint i, index, new;
 
   color &= 0xFFFFFF;
 
-  for (;;) {
-    tree->count += count;
-    if (tree->level == 8 || OCTREE_IS_LEAF (tree)) {
-      if (tree->color < 0x1000000 && tree->color != color) {
-	GifencOctree *new = gifenc_octree_new ();
-	new->level = tree->level + 1;
-	new->count = tree->count - count;
-	new->red = tree->red; tree->red = 0;
-	new->green = tree->green; tree->green = 0;
-	new->blue = tree->blue; tree->blue = 0;
-	new->color = tree->color; tree->color = (guint) -1;
-	i = color_to_index (new->color, tree->level);
-	tree->children[i] = new;
-	info->non_leaves = g_slist_prepend (info->non_leaves, tree);
+  for (index = 0;; index = node->children[i]) {
+    node = &tree->nodes[index];
+    node->count += count;
+    if (node->level == 8 || OCTREE_IS_LEAF (node)) {
+      if (node->color < 0x1000000 && node->color != color) {
+	GifencOctreeNode *split;
+	new = gifenc_octree_add_node (tree, node->level + 1, node->color);
+	/* adding a node may have moved the array */
+	node = &tree->nodes[index];
+	split = &tree->nodes[new];
+	split->count = node->count - count;
+	split->red = node->red; node->red = 0;
+	split->green = node->green; node->green = 0;
+	split->blue = node->blue; node->blue = 0;
+	node->color = (guint) -1;
+	i = color_to_index (split->color, node->level);
+	node->children[i] = new;
+	g_array_append_val (info->non_leaves, index);
       } else {
-	gifenc_octree_add_one (tree, color, count);
+	gifenc_octree_add_one (node, color, count);
 	return;
       }
     } 
-    i = color_to_index (color, tree->level);
-    if (tree->children[i]) {
-      tree = tree->children[i];
-    } else {
-      GifencOctree *new = gifenc_octree_new ();
-      new->level = tree->level + 1;
-      gifenc_octree_add_one (new, color, count);
-      new->count = count;
-      new->color = color;
-      tree->children[i] = new;
+    i = color_to_index (color, node->level);
+    if (node->children[i] == 0) {
+      GifencOctreeNode *leaf;
+      new = gifenc_octree_add_node (tree, node->level + 1, color);
+      leaf = &tree->nodes[new];
+      gifenc_octree_add_one (leaf, color, count);
+      leaf->count = count;
+      tree->nodes[index].children[i] = new;
       info->num_leaves++;
       return;
     }
   }
 }
 
-static int
-octree_compare_count (gconstpointer a, gconstpointer b)
+/* Orders nodes by how many pixels they cover. A node never covers fewer
+ * pixels than its children and deeper nodes go first when the count is 
+ * the same, so children are always reduced before their parents.
+ * If deepest_first is set, deeper nodes always go first. */
+static gboolean
+octree_node_less (const GifencOctreeNode *nodes, guint32 a, guint32 b,
+    gboolean deepest_first)
 {
-  return ((const GifencOctree *) a)->count - ((const GifencOctree *) b)->count;
+  if (deepest_first && nodes[a].level != nodes[b].level)
+    return nodes[a].level > nodes[b].level;
+  if (nodes[a].count != nodes[b].count)
+    return nodes[a].count < nodes[b].count;
+  if (nodes[a].level != nodes[b].level)
+    return nodes[a].level > nodes[b].level;
+  return a < b;
+}
+
+static void
+octree_heap_sift_down (const GifencOctreeNode *nodes, guint32 *heap, guint n, guint i,
+    gboolean deepest_first)
+{
+  guint child;
+  guint32 tmp;
+
+  for (;;) {
+    child = 2 * i + 1;
+    if (child >= n)
+      break;
+    if (child + 1 < n && octree_node_less (nodes, heap[child + 1], heap[child], deepest_first))
+      child++;
+    if (!octree_node_less (nodes, heap[child], heap[i], deepest_first))
+      break;
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
 }
 
 static void
-gifenc_octree_reduce_one (OctreeInfo *info, GifencOctree *tree)
+gifenc_octree_reduce_one (OctreeInfo *info, GifencOctreeNode *node)
 {
+  GifencOctree *tree = info->tree;
   guint i;
 
-  g_assert (!OCTREE_IS_LEAF (tree));
+  g_assert (!OCTREE_IS_LEAF (node));
   for (i = 0; i < 8; i++) {
-    if (!tree->children[i])
+    GifencOctreeNode *child;
+    if (!node->children[i])
       continue;
-    g_assert (OCTREE_IS_LEAF (tree->children[i]));
-    tree->red += tree->children[i]->red;
-    tree->green += tree->children[i]->green;
-    tree->blue += tree->children[i]->blue;
-    gifenc_octree_free (tree->children[i]);
-    tree->children[i] = NULL;
+    child = &tree->nodes[node->children[i]];
+    g_assert (OCTREE_IS_LEAF (child));
+    node->red += child->red;
+    node->green += child->green;
+    node->blue += child->blue;
+    child->children[0] = tree->free_nodes;
+    tree->free_nodes = node->children[i];
+    node->children[i] = 0;
     info->num_leaves--;
   }
-  tree->color = 0x1000000;
+  node->color = 0x1000000;
   info->num_leaves++;
-  info->non_leaves = g_slist_remove (info->non_leaves, tree);
 }
 
+/* Reduces the tree to at most stop leaves. While colors are still being
+ * added, the counts don't tell yet which parts of the tree are important,
+ * so only the deepest nodes are merged. */
 static void
-gifenc_octree_reduce_colors (OctreeInfo *info, guint stop)
+gifenc_octree_reduce_colors (OctreeInfo *info, guint stop, gboolean deepest_first)
 {
-  info->non_leaves = g_slist_sort (info->non_leaves, octree_compare_count);
-  //g_print ("reducing %u leaves (%u non-leaves)\n", info->num_leaves, 
-  //    g_slist_length (info->non_leaves));
+  const GifencOctreeNode *nodes = info->tree->nodes;
+  guint32 *heap = (guint32 *) (void *) info->non_leaves->data;
+  guint i, n = info->non_leaves->len;
+
+  //g_print ("reducing %u leaves (%u non-leaves)\n", info->num_leaves, n);
+  /* counts change whenever colors are added, so rebuild the heap */
+  for (i = n / 2; i-- > 0;)
+    octree_heap_sift_down (nodes, heap, n, i, deepest_first);
   while (info->num_leaves > stop) {
-    gifenc_octree_reduce_one (info, info->non_leaves->data);
+    g_assert (n > 0);
+    gifenc_octree_reduce_one (info, &info->tree->nodes[heap[0]]);
+    heap[0] = heap[--n];
+    octree_heap_sift_down (nodes, heap, n, 0, deepest_first);
   }
+  g_array_set_size (info->non_leaves, n);
   //g_print (" ==> to %u leaves\n", info->num_leaves);
 }
 
+static void
+gifenc_octree_info_init (OctreeInfo *info)
+{
+  guint r, g, b;
+  static const guint8 colors[] = { 0, 85, 170, 255 };
+
+  info->tree = gifenc_octree_new (4096);
+  gifenc_octree_add_node (info->tree, 0, (guint) -2); /* special node */
+  info->non_leaves = g_array_new (FALSE, FALSE, sizeof (guint32));
+  info->num_leaves = 0;
+
+  for (r = 0; r < 4; r++) {
+    for (g = 0; g < 4; g++) {
+      for (b = 0; b < 4; b++) {
+	gifenc_octree_add_color (info, 
+	    (colors[r] << 16) + (colors[g] << 8) + colors[b], 1);
+      }
+    }
+  }
+}
+
+static void
+gifenc_octree_info_copy (OctreeInfo *info, const OctreeInfo *src)
+{
+  info->tree = gifenc_octree_new (src->tree->n_allocated);
+  memcpy (info->tree->nodes, src->tree->nodes, 
+      src->tree->n_nodes * sizeof (GifencOctreeNode));
+  info->tree->n_nodes = src->tree->n_nodes;
+  info->tree->free_nodes = src->tree->free_nodes;
+  info->non_leaves = g_array_sized_new (FALSE, FALSE, sizeof (guint32), src->non_leaves->len);
+  g_array_append_vals (info->non_leaves, src->non_leaves->data, src->non_leaves->len);
+  info->num_leaves = src->num_leaves;
+}
+
+static void
+gifenc_octree_info_clear (OctreeInfo *info)
+{
+  if (info->tree) {
+    gifenc_octree_free (info->tree);
+    g_array_free (info->non_leaves, TRUE);
+    info->tree = NULL;
+    info->non_leaves = NULL;
+  }
+}
+
+/* adds a color, reducing the tree whenever it gets too large */
+static void
+gifenc_octree_info_add_color (OctreeInfo *info, guint32 color, guint count)
+{
+  gifenc_octree_add_color (info, color, count);
+  if (info->num_leaves > MAX_LEAVES)
+    gifenc_octree_reduce_colors (info, STOP_LEAVES, TRUE);
+}
+
+/* copies the subtree at index from tree into target, leaving out all
+ * reduced nodes and assigning colors to the leaves */
 static guint
-gifenc_octree_finalize (GifencOctree *tree, guint start_id, guint *colors)
-{
-  if (OCTREE_IS_LEAF (tree)) {
-    if (tree->color > 0xFFFFFF)
-      tree->color = 
-	((tree->red / tree->count) << 16) |
-	((tree->green / tree->count) << 8) |
-	(tree->blue / tree->count);
-    tree->id = start_id;
-    colors[start_id] = tree->color;
-    return tree->id + 1;
+gifenc_octree_finalize (const GifencOctree *tree, guint index, 
+    GifencOctree *target, guint *next_id, guint *colors)
+{
+  const GifencOctreeNode *node = &tree->nodes[index];
+  guint new, i, child;
+
+  new = gifenc_octree_add_node (target, node->level, node->color);
+  if (OCTREE_IS_LEAF (node)) {
+    GifencOctreeNode *leaf = &target->nodes[new];
+    if (node->color > 0xFFFFFF)
+      leaf->color = 
+	((node->red / node->count) << 16) |
+	((node->green / node->count) << 8) |
+	(node->blue / node->count);
+    leaf->id = *next_id;
+    colors[*next_id] = leaf->color;
+    (*next_id)++;
   } else {
-    guint i;
     for (i = 0; i < 8; i++) {
-      if (tree->children[i])
-	start_id = gifenc_octree_finalize (tree->children[i], start_id, colors);
+      if (node->children[i]) {
+	child = gifenc_octree_finalize (tree, node->children[i], target, next_id, colors);
+	target->nodes[new].children[i] = child;
+      }
     }
-    return start_id;
   }
-  g_assert_not_reached ();
-  return 0;
+  return new;
 }
 
 static guint
 gifenc_octree_lookup (gpointer data, guint32 color, guint32 *looked_up_color)
 {
-  GifencOctree *tree = data;
-  guint idx;
-
-  if (OCTREE_IS_LEAF (tree)) {
-    *looked_up_color = tree->color;
-    return tree->id;
-  } 
-  idx = color_to_index (color, tree->level);
-  if (tree->children[idx] == NULL) {
-    static const guint order[8][7] = {
-      { 2, 1, 4, 3, 6, 5, 7 },
-      { 3, 0, 5, 2, 7, 4, 6 },
-      { 0, 3, 6, 1, 4, 7, 5 },
-      { 1, 2, 7, 6, 5, 0, 4 },
-      { 6, 5, 0, 7, 2, 1, 3 },
-      { 7, 4, 1, 6, 3, 0, 2 },
-      { 4, 7, 2, 5, 0, 3, 1 },
-      { 5, 6, 3, 4, 1, 2, 0 }
-    };
-    guint i, tmp;
-    for (i = 0; i < 7; i++) {
-      tmp = order[idx][i];
-      if (!tree->children[tmp])
-	continue;
-      /* make selection smarter, like using closest match */
-      return gifenc_octree_lookup (
-	  tree->children[tmp],
-	  color, looked_up_color);
+  const GifencOctree *tree = data;
+  const GifencOctreeNode *node = tree->nodes;
+  guint idx, id;
+
+  while (!OCTREE_IS_LEAF (node)) {
+    idx = color_to_index (color, node->level);
+    if (node->children[idx] == 0) {
+      /* the color isn't in the tree, so find the closest one */
+      id = gifenc_nearest_lookup (tree->nearest, color);
+      *looked_up_color = tree->nearest->colors[id];
+      return id;
     }
-    g_assert_not_reached ();
+    node = &tree->nodes[node->children[idx]];
   }
-  return gifenc_octree_lookup (
-      tree->children[idx],
-      color, looked_up_color);
+  *looked_up_color = node->color;
+  return node->id;
 }
 
-GifencPalette *
-gifenc_quantize_image (const guint8 *data, guint width, guint height,
-    guint rowstride, gboolean alpha, guint max_colors)
+/*** HISTOGRAM ***/
+
+/* A histogram collects the distinct colors of one or more images together
+ * with how often they occur, in the order they first appear. The colors
+ * are found via an open addressing hash table. Once it holds
+ * MAX_HISTOGRAM_COLORS colors, they are moved into an octree that is
+ * reduced as it grows, so memory use stays bounded. */
+
+/* maximum number of colors kept in the hash table */
+#define MAX_HISTOGRAM_COLORS (1 << 16)
+/* maximum sum of all counts, so the sums in the octree don't overflow */
+#define MAX_HISTOGRAM_PIXELS (G_MAXUINT >> 8)
+
+typedef struct {
+  guint32		key;		/* color | 0x1000000 or 0 if unused */
+  guint32		index;		/* index into the entries */
+} GifencHistogramSlot;
+
+typedef struct {
+  guint32		color;		/* the color */
+  guint32		count;		/* how often it was seen */
+} GifencHistogramEntry;
+
+struct _GifencHistogram {
+  GifencHistogramEntry *entries;	/* all colors in order of appearance */
+  guint			n_entries;	/* number of colors */
+  GifencHistogramSlot *	slots;		/* hash table, 2^n_bits slots */
+  guint			n_bits;		/* log2 of the number of slots */
+  guint64		n_pixels;	/* sum of all counts */
+  OctreeInfo		spill;		/* colors moved out of the table or tree == NULL */
+};
+
+#define HISTOGRAM_HASH(color, n_bits) (((color) * 0x9E3779B1u) >> (32 - (n_bits)))
+
+/**
+ * gifenc_histogram_new:
+ *
+ * Creates a new empty histogram. Add images to it using 
+ * gifenc_histogram_add_image() and compute a palette from it using
+ * gifenc_quantize_histogram().
+ *
+ * Returns: a new histogram, free with gifenc_histogram_free()
+ **/
+GifencHistogram *
+gifenc_histogram_new (void)
+{
+  GifencHistogram *hist = g_new0 (GifencHistogram, 1);
+
+  hist->n_bits = 10;
+  hist->slots = g_new0 (GifencHistogramSlot, 1 << hist->n_bits);
+  hist->entries = g_new (GifencHistogramEntry, 1 << (hist->n_bits - 1));
+  return hist;
+}
+
+void
+gifenc_histogram_free (GifencHistogram *hist)
+{
+  g_return_if_fail (hist != NULL);
+
+  gifenc_octree_info_clear (&hist->spill);
+  g_free (hist->slots);
+  g_free (hist->entries);
+  g_free (hist);
+}
+
+/**
+ * gifenc_histogram_get_n_colors:
+ * @hist: the histogram
+ *
+ * Gets the number of distinct colors in @hist. This is only exact for
+ * histograms with less than 65536 colors.
+ *
+ * Returns: the number of colors
+ **/
+guint
+gifenc_histogram_get_n_colors (const GifencHistogram *hist)
+{
+  g_return_val_if_fail (hist != NULL, 0);
+
+  if (hist->spill.tree)
+    return MAX_HISTOGRAM_COLORS + hist->n_entries;
+  return hist->n_entries;
+}
+
+#define MAKE_COLOR(r, g, b) (((guint32) (r) << 16) | ((guint32) (g) << 8) | (guint32) (b))
+
+/* collects all colors of the histogram, including those that were moved
+ * into the octree, the latter only approximated by their leaves */
+static void
+gifenc_histogram_collect_leaves (const GifencOctree *tree, guint index, GArray *array)
+{
+  const GifencOctreeNode *node = &tree->nodes[index];
+  GifencHistogramEntry entry;
+  guint i;
+
+  if (OCTREE_IS_LEAF (node)) {
+    if (node->color <= 0xFFFFFF)
+      entry.color = node->color;
+    else
+      entry.color = MAKE_COLOR (node->red / node->count,
+	  node->green / node->count, node->blue / node->count);
+    entry.count = node->count;
+    g_array_append_val (array, entry);
+  } else {
+    for (i = 0; i < 8; i++) {
+      if (node->children[i])
+	gifenc_histogram_collect_leaves (tree, node->children[i], array);
+    }
+  }
+}
+
+static GArray *
+gifenc_histogram_collect (const GifencHistogram *hist)
+{
+  GArray *array;
+
+  array = g_array_sized_new (FALSE, FALSE, sizeof (GifencHistogramEntry), hist->n_entries);
+  if (hist->spill.tree)
+    gifenc_histogram_collect_leaves (hist->spill.tree, 0, array);
+  g_array_append_vals (array, hist->entries, hist->n_entries);
+
+  return array;
+}
+
+static void
+gifenc_histogram_spill (GifencHistogram *hist)
 {
-  guint x, y;
+  guint i;
+
+  if (hist->spill.tree == NULL)
+    gifenc_octree_info_init (&hist->spill);
+  for (i = 0; i < hist->n_entries; i++) {
+    gifenc_octree_info_add_color (&hist->spill, hist->entries[i].color, hist->entries[i].count);
+  }
+  memset (hist->slots, 0, sizeof (GifencHistogramSlot) << hist->n_bits);
+  hist->n_entries = 0;
+}
+
+static void
+gifenc_histogram_grow (GifencHistogram *hist)
+{
+  guint i, j, mask;
+
+  hist->n_bits++;
+  mask = (1 << hist->n_bits) - 1;
+  g_free (hist->slots);
+  hist->slots = g_new0 (GifencHistogramSlot, 1 << hist->n_bits);
+  hist->entries = g_renew (GifencHistogramEntry, hist->entries, 1 << (hist->n_bits - 1));
+  for (i = 0; i < hist->n_entries; i++) {
+    j = HISTOGRAM_HASH (hist->entries[i].color, hist->n_bits);
+    while (hist->slots[j].key)
+      j = (j + 1) & mask;
+    hist->slots[j].key = hist->entries[i].color | 0x1000000;
+    hist->slots[j].index = i;
+  }
+}
+
+/* Halves all counts, because the octree can only sum up
+ * MAX_HISTOGRAM_PIXELS pixels. */
+static void
+gifenc_histogram_halve (GifencHistogram *hist)
+{
+  GifencHistogramEntry *leaves;
+  GArray *array;
+  guint i;
+
+  hist->n_pixels = 0;
+  for (i = 0; i < hist->n_entries; i++) {
+    hist->entries[i].count = (hist->entries[i].count + 1) / 2;
+    hist->n_pixels += hist->entries[i].count;
+  }
+  if (hist->spill.tree == NULL)
+    return;
+
+  array = g_array_new (FALSE, FALSE, sizeof (GifencHistogramEntry));
+  gifenc_histogram_collect_leaves (hist->spill.tree, 0, array);
+  gifenc_octree_info_clear (&hist->spill);
+  gifenc_octree_info_init (&hist->spill);
+  leaves = (GifencHistogramEntry *) (void *) array->data;
+  for (i = 0; i < array->len; i++) {
+    gifenc_octree_info_add_color (&hist->spill, leaves[i].color, (leaves[i].count + 1) / 2);
+    hist->n_pixels += (leaves[i].count + 1) / 2;
+  }
+  g_array_free (array, TRUE);
+}
+
+static void
+gifenc_histogram_add_color (GifencHistogram *hist, guint32 color, guint count)
+{
+  guint32 key = color | 0x1000000;
+  guint mask, i;
+
+  if (hist->n_pixels + count > MAX_HISTOGRAM_PIXELS)
+    gifenc_histogram_halve (hist);
+  hist->n_pixels += count;
+  mask = (1 << hist->n_bits) - 1;
+  i = HISTOGRAM_HASH (color, hist->n_bits);
+  for (;; i = (i + 1) & mask) {
+    if (hist->slots[i].key == key) {
+      hist->entries[hist->slots[i].index].count += count;
+      return;
+    }
+    if (hist->slots[i].key == 0)
+      break;
+  }
+  /* keep the table at most half full */
+  if (hist->n_entries == 1u << (hist->n_bits - 1)) {
+    if (hist->n_entries == MAX_HISTOGRAM_COLORS)
+      gifenc_histogram_spill (hist);
+    else
+      gifenc_histogram_grow (hist);
+    mask = (1 << hist->n_bits) - 1;
+    for (i = HISTOGRAM_HASH (color, hist->n_bits); hist->slots[i].key; i = (i + 1) & mask);
+  }
+  hist->slots[i].key = key;
+  hist->slots[i].index = hist->n_entries;
+  hist->entries[hist->n_entries].color = color;
+  hist->entries[hist->n_entries].count = count;
+  hist->n_entries++;
+}
+
+/* Large images are split into stripes of about this many samples, which
+ * are counted in parallel. Their histograms are then merged in order, so
+ * the result doesn't depend on the number of threads. Every stripe starts
+ * with an empty octree, so smaller stripes cost more time in total. */
+#define HISTOGRAM_STRIPE_SAMPLES (1 << 19)
+
+static void
+gifenc_histogram_merge (GifencHistogram *hist, const GifencHistogram *other)
+{
+  GifencHistogramEntry *entries;
+  GArray *array;
+  guint i;
+
+  array = gifenc_histogram_collect (other);
+  entries = (GifencHistogramEntry *) (void *) array->data;
+  for (i = 0; i < array->len; i++) {
+    gifenc_histogram_add_color (hist, entries[i].color, entries[i].count);
+  }
+  g_array_free (array, TRUE);
+}
+
+/* adds a run of samples that stand for weight pixels each */
+static void
+gifenc_histogram_add_run (GifencHistogram *hist, guint32 color, guint run,
+    guint weight)
+{
+  guint64 count = (guint64) run * weight;
+
+  /* more than the histogram can hold only happens for huge images */
+  gifenc_histogram_add_color (hist, color, MIN (count, MAX_HISTOGRAM_PIXELS));
+}
+
+/* adds every step'th pixel of the rows from y to end, y being a multiple
+ * of step */
+static void
+gifenc_histogram_add_rows (GifencHistogram *hist, const guint8 *data,
+    guint width, guint y, guint end, guint rowstride, guint step)
+{
+  guint x, weight, run;
   const guint32 *row;
-  OctreeInfo info = { NULL, NULL, 0 };
+  guint32 color, last;
+
+  weight = step * step;
+  /* Screen content is mostly runs of the same color, so count runs and
+   * only look up the color once the run ends. */
+  last = 0;
+  run = 0;
+  for (; y < end; y += step) {
+    row = (const guint32 *) (const void *) (data + (gsize) y * rowstride);
+    /* move the samples around to not miss vertical lines */
+    for (x = (y / step) % step; x < width; x += step) {
+      color = row[x] & 0xFFFFFF;
+      if (run > 0 && color == last) {
+	run++;
+      } else {
+	if (run > 0)
+	  gifenc_histogram_add_run (hist, last, run, weight);
+	last = color;
+	run = 1;
+      }
+    }
+  }
+  if (run > 0)
+    gifenc_histogram_add_run (hist, last, run, weight);
+}
+
+typedef struct {
+  const guint8 *	data;		/* the image */
+  guint			width;		/* width of the image */
+  guint			height;		/* height of the image */
+  guint			rowstride;	/* rowstride of the image */
+  guint			step;		/* distance between samples */
+  guint			stripe_height;	/* rows per stripe, a multiple of step */
+  guint			first_stripe;	/* stripe of the first job */
+  GifencHistogram **	stripes;	/* histograms of the jobs */
+} GifencHistogramJobs;
+
+static void
+gifenc_histogram_job_run (gpointer data, guint id)
+{
+  GifencHistogramJobs *jobs = data;
+  guint y = (jobs->first_stripe + id) * jobs->stripe_height;
+
+  jobs->stripes[id] = gifenc_histogram_new ();
+  gifenc_histogram_add_rows (jobs->stripes[id], jobs->data, jobs->width, y,
+      MIN (y + jobs->stripe_height, jobs->height), jobs->rowstride, jobs->step);
+  /* If the stripe has too many colors, merging only the leaves of its
+   * octree keeps the part that can't run in parallel short. */
+  if (jobs->stripes[id]->spill.tree)
+    gifenc_histogram_spill (jobs->stripes[id]);
+}
+
+/**
+ * gifenc_histogram_add_image:
+ * @hist: the histogram
+ * @data: image data in native-endian xRGB
+ * @width: width of the image
+ * @height: height of the image
+ * @rowstride: rowstride of @data
+ * @max_samples: maximum number of pixels to look at or 0 for all
+ *
+ * Adds the colors of the given image to @hist. If the image has more than
+ * @max_samples pixels, only a regular subset of them is looked at and 
+ * counted for the pixels around it, so the time taken stays bounded for
+ * large images. Large images are counted using all processors.
+ **/
+void
+gifenc_histogram_add_image (GifencHistogram *hist, const guint8 *data,
+    guint width, guint height, guint rowstride, guint max_samples)
+{
+  GifencHistogramJobs jobs;
+  guint i, step, n_stripes, n_jobs, batch;
+
+  g_return_if_fail (hist != NULL);
+  g_return_if_fail (data != NULL);
+
+  if (width == 0 || height == 0)
+    return;
+
+  step = 1;
+  if (max_samples > 0) {
+    while ((guint64) ((width + step - 1) / step) * ((height + step - 1) / step) > max_samples)
+      step++;
+  }
+
+  jobs.stripe_height = MAX (1, HISTOGRAM_STRIPE_SAMPLES / ((width + step - 1) / step)) * step;
+  n_stripes = (height + jobs.stripe_height - 1) / jobs.stripe_height;
+  if (n_stripes == 1) {
+    gifenc_histogram_add_rows (hist, data, width, 0, height, rowstride, step);
+    return;
+  }
+
+  jobs.data = data;
+  jobs.width = width;
+  jobs.height = height;
+  jobs.rowstride = rowstride;
+  jobs.step = step;
+  /* only keep a few stripes around at once to bound memory use */
+  batch = g_get_num_processors ();
+  jobs.stripes = g_new (GifencHistogram *, batch);
+  for (jobs.first_stripe = 0; jobs.first_stripe < n_stripes; jobs.first_stripe += n_jobs) {
+    n_jobs = MIN (batch, n_stripes - jobs.first_stripe);
+    gifenc_parallel (gifenc_histogram_job_run, &jobs, n_jobs);
+    for (i = 0; i < n_jobs; i++) {
+      gifenc_histogram_merge (hist, jobs.stripes[i]);
+      gifenc_histogram_free (jobs.stripes[i]);
+    }
+  }
+  g_free (jobs.stripes);
+}
+
+/*** PALETTES WITH NEAREST COLOR LOOKUP ***/
+
+static guint
+gifenc_palette_nearest_lookup (gpointer data, guint32 color, guint32 *resulting_color)
+{
+  GifencNearest *nearest = data;
+  guint id;
+
+  id = gifenc_nearest_lookup (nearest, color);
+  *resulting_color = nearest->colors[id];
+  return id;
+}
+
+static void
+gifenc_palette_nearest_free (gpointer data)
+{
+  gifenc_nearest_free (data);
+}
+
+/* creates a palette from the given colors, which it takes ownership of */
+static GifencPalette *
+gifenc_palette_new_nearest (guint32 *colors, guint n_colors, gboolean alpha)
+{
   GifencPalette *palette;
-  
-  g_return_val_if_fail (width * height <= (G_MAXUINT >> 8), NULL);
 
-  info.tree = gifenc_octree_new ();
-  info.tree->color = (guint) -2; /* special node */
-
-  if (TRUE) {
-    guint r, g, b;
-    static const guint8 colors[] = { 0, 85, 170, 255 };
-    for (r = 0; r < 4; r++) {
-      for (g = 0; g < 4; g++) {
-	for (b = 0; b < 4; b++) {
-	  gifenc_octree_add_color (&info, 
-	      (colors[r] << 16) + (colors[g] << 8) + colors[b], 1);
+  g_assert (n_colors > 0);
+
+  palette = g_new (GifencPalette, 1);
+  palette->alpha = alpha;
+  palette->colors = colors;
+  palette->num_colors = n_colors;
+  palette->data = gifenc_nearest_new (colors, n_colors);
+  palette->lookup = gifenc_palette_nearest_lookup;
+  palette->free = gifenc_palette_nearest_free;
+  palette->lut = NULL;
+  palette->exact = NULL;
+
+  return palette;
+}
+
+/*** MEDIAN CUT ***/
+
+/* Heckbert's median cut: Starting with one box containing all colors, the
+ * box with the longest side - weighted by the number of pixels in it - is
+ * split at the median of that side until there are enough boxes. */
+
+typedef struct {
+  guint			start;		/* first color of the box */
+  guint			end;		/* color after the last color of the box */
+  guint64		count;		/* number of pixels in the box */
+  guint			shift;		/* shift of the longest side's channel */
+  guint			length;		/* length of the longest side */
+} MedianCutBox;
+
+static int
+median_cut_compare (gconstpointer a, gconstpointer b, gpointer shift)
+{
+  guint ca = ((const GifencHistogramEntry *) a)->color;
+  guint cb = ((const GifencHistogramEntry *) b)->color;
+  guint s = GPOINTER_TO_UINT (shift);
+
+  if (((ca >> s) & 0xFF) != ((cb >> s) & 0xFF))
+    return ((ca >> s) & 0xFF) < ((cb >> s) & 0xFF) ? -1 : 1;
+  return ca < cb ? -1 : ca > cb;
+}
+
+static void
+median_cut_box_init (MedianCutBox *box, const GifencHistogramEntry *colors,
+    guint start, guint end)
+{
+  static const guint shifts[3] = { 8, 16, 0 };
+  guint min[3] = { 255, 255, 255 }, max[3] = { 0, 0, 0 };
+  guint i, c, val;
+
+  box->start = start;
+  box->end = end;
+  box->count = 0;
+  for (i = start; i < end; i++) {
+    box->count += colors[i].count;
+    for (c = 0; c < 3; c++) {
+      val = (colors[i].color >> shifts[c]) & 0xFF;
+      min[c] = MIN (min[c], val);
+      max[c] = MAX (max[c], val);
+    }
+  }
+  /* prefer green, then red, then blue, like the eye does */
+  box->length = 0;
+  box->shift = 8;
+  for (c = 0; c < 3; c++) {
+    if (max[c] - min[c] > box->length) {
+      box->length = max[c] - min[c];
+      box->shift = shifts[c];
+    }
+  }
+}
+
+static GifencPalette *
+gifenc_quantize_median_cut (const GifencHistogram *hist, gboolean alpha, guint max_colors)
+{
+  GArray *array;
+  GifencHistogramEntry *colors;
+  MedianCutBox *boxes;
+  guint n_boxes, n_colors, i, j, best, split;
+  guint64 score, best_score, sum, r, g, b;
+  guint32 *palette_colors;
+
+  array = gifenc_histogram_collect (hist);
+  colors = (GifencHistogramEntry *) (void *) array->data;
+  boxes = g_new (MedianCutBox, MAX (max_colors, 1));
+
+  n_boxes = 0;
+  if (array->len > 0)
+    median_cut_box_init (&boxes[n_boxes++], colors, 0, array->len);
+  while (n_boxes < max_colors) {
+    best = n_boxes;
+    best_score = 0;
+    for (i = 0; i < n_boxes; i++) {
+      score = boxes[i].length * boxes[i].count;
+      if (score > best_score) {
+	best_score = score;
+	best = i;
+      }
+    }
+    if (best == n_boxes)
+      break;
+
+    g_qsort_with_data (colors + boxes[best].start, boxes[best].end - boxes[best].start,
+	sizeof (GifencHistogramEntry), median_cut_compare, GUINT_TO_POINTER (boxes[best].shift));
+    /* split so that both halves have colors */
+    sum = 0;
+    for (split = boxes[best].start; split < boxes[best].end - 2; split++) {
+      sum += colors[split].count;
+      if (sum * 2 >= boxes[best].count)
+	break;
+    }
+    split++;
+    median_cut_box_init (&boxes[n_boxes++], colors, split, boxes[best].end);
+    median_cut_box_init (&boxes[best], colors, boxes[best].start, split);
+  }
+
+  palette_colors = g_new (guint32, MAX (n_boxes, 1));
+  n_colors = 0;
+  for (i = 0; i < n_boxes; i++) {
+    /* boxes of colors that were never counted have no color */
+    if (boxes[i].count == 0)
+      continue;
+    r = g = b = 0;
+    for (j = boxes[i].start; j < boxes[i].end; j++) {
+      r += ((colors[j].color >> 16) & 0xFF) * (guint64) colors[j].count;
+      g += ((colors[j].color >> 8) & 0xFF) * (guint64) colors[j].count;
+      b += (colors[j].color & 0xFF) * (guint64) colors[j].count;
+    }
+    palette_colors[n_colors++] = MAKE_COLOR ((r + boxes[i].count / 2) / boxes[i].count,
+	(g + boxes[i].count / 2) / boxes[i].count,
+	(b + boxes[i].count / 2) / boxes[i].count);
+  }
+  if (n_colors == 0)
+    palette_colors[n_colors++] = 0;
+  g_free (boxes);
+  g_array_free (array, TRUE);
+
+  return gifenc_palette_new_nearest (palette_colors, n_colors, alpha);
+}
+
+/*** WU ***/
+
+/* Xiaolin Wu's color quantizer ("Efficient Statistical Computations for
+ * Optimal Color Quantization", Graphics Gems II): Colors are counted in a
+ * 32x32x32 cube. Using cumulative moments the variance of any box can be
+ * computed in constant time, so boxes can always be split at the position
+ * that minimizes the total variance. */
+
+#define WU_SIZE (33)
+#define WU_INDEX(r, g, b) (((r) * WU_SIZE + (g)) * WU_SIZE + (b))
+
+typedef struct {
+  gint64 *		wt;		/* cumulative pixel counts */
+  gint64 *		mr;		/* cumulative sums of red */
+  gint64 *		mg;		/* cumulative sums of green */
+  gint64 *		mb;		/* cumulative sums of blue */
+  gdouble *		m2;		/* cumulative sums of squared colors */
+} WuMoments;
+
+typedef struct {
+  guint			r0, r1;		/* red range, exclusive r0, inclusive r1 */
+  guint			g0, g1;		/* green range */
+  guint			b0, b1;		/* blue range */
+  gdouble		variance;	/* variance of the box or 0 if it can't be split */
+} WuBox;
+
+typedef enum {
+  WU_RED,
+  WU_GREEN,
+  WU_BLUE
+} WuDirection;
+
+#define WU_VOLUME(box, m) ( \
+    (m)[WU_INDEX ((box)->r1, (box)->g1, (box)->b1)] - (m)[WU_INDEX ((box)->r1, (box)->g1, (box)->b0)] \
+  - (m)[WU_INDEX ((box)->r1, (box)->g0, (box)->b1)] + (m)[WU_INDEX ((box)->r1, (box)->g0, (box)->b0)] \
+  - (m)[WU_INDEX ((box)->r0, (box)->g1, (box)->b1)] + (m)[WU_INDEX ((box)->r0, (box)->g1, (box)->b0)] \
+  + (m)[WU_INDEX ((box)->r0, (box)->g0, (box)->b1)] - (m)[WU_INDEX ((box)->r0, (box)->g0, (box)->b0)])
+
+/* part of the volume that doesn't depend on the position of the cut */
+static gint64
+wu_bottom (const WuBox *box, WuDirection dir, const gint64 *m)
+{
+  switch (dir) {
+    case WU_RED:
+      return - m[WU_INDEX (box->r0, box->g1, box->b1)] + m[WU_INDEX (box->r0, box->g1, box->b0)]
+	     + m[WU_INDEX (box->r0, box->g0, box->b1)] - m[WU_INDEX (box->r0, box->g0, box->b0)];
+    case WU_GREEN:
+      return - m[WU_INDEX (box->r1, box->g0, box->b1)] + m[WU_INDEX (box->r1, box->g0, box->b0)]
+	     + m[WU_INDEX (box->r0, box->g0, box->b1)] - m[WU_INDEX (box->r0, box->g0, box->b0)];
+    case WU_BLUE:
+      return - m[WU_INDEX (box->r1, box->g1, box->b0)] + m[WU_INDEX (box->r1, box->g0, box->b0)]
+	     + m[WU_INDEX (box->r0, box->g1, box->b0)] - m[WU_INDEX (box->r0, box->g0, box->b0)];
+    default:
+      g_assert_not_reached ();
+      return 0;
+  }
+}
+
+/* part of the volume that depends on the position pos of the cut */
+static gint64
+wu_top (const WuBox *box, WuDirection dir, guint pos, const gint64 *m)
+{
+  switch (dir) {
+    case WU_RED:
+      return   m[WU_INDEX (pos, box->g1, box->b1)] - m[WU_INDEX (pos, box->g1, box->b0)]
+	     - m[WU_INDEX (pos, box->g0, box->b1)] + m[WU_INDEX (pos, box->g0, box->b0)];
+    case WU_GREEN:
+      return   m[WU_INDEX (box->r1, pos, box->b1)] - m[WU_INDEX (box->r1, pos, box->b0)]
+	     - m[WU_INDEX (box->r0, pos, box->b1)] + m[WU_INDEX (box->r0, pos, box->b0)];
+    case WU_BLUE:
+      return   m[WU_INDEX (box->r1, box->g1, pos)] - m[WU_INDEX (box->r1, box->g0, pos)]
+	     - m[WU_INDEX (box->r0, box->g1, pos)] + m[WU_INDEX (box->r0, box->g0, pos)];
+    default:
+      g_assert_not_reached ();
+      return 0;
+  }
+}
+
+static gdouble
+wu_variance (const WuBox *box, const WuMoments *mom)
+{
+  gdouble r = WU_VOLUME (box, mom->mr);
+  gdouble g = WU_VOLUME (box, mom->mg);
+  gdouble b = WU_VOLUME (box, mom->mb);
+  gdouble m2 = WU_VOLUME (box, mom->m2);
+
+  return m2 - (r * r + g * g + b * b) / WU_VOLUME (box, mom->wt);
+}
+
+/* finds the cut along dir that maximizes the sum of squared means of both
+ * halves, which is the same as minimizing their variance */
+static gdouble
+wu_maximize (const WuBox *box, WuDirection dir, guint first, guint last,
+    gint *cut, const WuMoments *mom, const gint64 whole[4])
+{
+  gint64 base[4], half[4];
+  gdouble result, max;
+  guint i;
+
+  base[0] = wu_bottom (box, dir, mom->mr);
+  base[1] = wu_bottom (box, dir, mom->mg);
+  base[2] = wu_bottom (box, dir, mom->mb);
+  base[3] = wu_bottom (box, dir, mom->wt);
+  max = 0.0;
+  *cut = -1;
+  for (i = first; i < last; i++) {
+    half[0] = base[0] + wu_top (box, dir, i, mom->mr);
+    half[1] = base[1] + wu_top (box, dir, i, mom->mg);
+    half[2] = base[2] + wu_top (box, dir, i, mom->mb);
+    half[3] = base[3] + wu_top (box, dir, i, mom->wt);
+    /* both halves must contain pixels */
+    if (half[3] == 0 || half[3] == whole[3])
+      continue;
+    result = ((gdouble) half[0] * half[0] + (gdouble) half[1] * half[1] +
+	(gdouble) half[2] * half[2]) / half[3];
+    half[0] = whole[0] - half[0];
+    half[1] = whole[1] - half[1];
+    half[2] = whole[2] - half[2];
+    half[3] = whole[3] - half[3];
+    result += ((gdouble) half[0] * half[0] + (gdouble) half[1] * half[1] +
+	(gdouble) half[2] * half[2]) / half[3];
+    if (result > max) {
+      max = result;
+      *cut = i;
+    }
+  }
+
+  return max;
+}
+
+static gboolean
+wu_cut (WuBox *box1, WuBox *box2, const WuMoments *mom)
+{
+  gint64 whole[4];
+  gdouble max_r, max_g, max_b;
+  gint cut_r, cut_g, cut_b;
+
+  whole[0] = WU_VOLUME (box1, mom->mr);
+  whole[1] = WU_VOLUME (box1, mom->mg);
+  whole[2] = WU_VOLUME (box1, mom->mb);
+  whole[3] = WU_VOLUME (box1, mom->wt);
+
+  max_r = wu_maximize (box1, WU_RED, box1->r0 + 1, box1->r1, &cut_r, mom, whole);
+  max_g = wu_maximize (box1, WU_GREEN, box1->g0 + 1, box1->g1, &cut_g, mom, whole);
+  max_b = wu_maximize (box1, WU_BLUE, box1->b0 + 1, box1->b1, &cut_b, mom, whole);
+
+  *box2 = *box1;
+  if (max_r >= max_g && max_r >= max_b) {
+    if (cut_r < 0)
+      return FALSE;
+    box2->r0 = box1->r1 = cut_r;
+  } else if (max_g >= max_r && max_g >= max_b) {
+    box2->g0 = box1->g1 = cut_g;
+  } else {
+    box2->b0 = box1->b1 = cut_b;
+  }
+
+  return TRUE;
+}
+
+static void
+wu_box_set_variance (WuBox *box, const WuMoments *mom)
+{
+  if ((box->r1 - box->r0) * (box->g1 - box->g0) * (box->b1 - box->b0) > 1)
+    box->variance = wu_variance (box, mom);
+  else
+    box->variance = 0;
+}
+
+static void
+wu_moments_compute (WuMoments *mom, const GArray *array)
+{
+  const GifencHistogramEntry *colors = (const GifencHistogramEntry *) (const void *) array->data;
+  gint64 area[4][WU_SIZE], line[4];
+  gdouble area2[WU_SIZE], line2;
+  guint i, r, g, b, c, idx;
+
+  /* histogram of the top 5 bits of every channel, index 0 is left empty */
+  for (i = 0; i < array->len; i++) {
+    guint32 color = colors[i].color;
+    gint64 count = colors[i].count;
+    r = (color >> 16) & 0xFF;
+    g = (color >> 8) & 0xFF;
+    b = color & 0xFF;
+    idx = WU_INDEX ((r >> 3) + 1, (g >> 3) + 1, (b >> 3) + 1);
+    mom->wt[idx] += count;
+    mom->mr[idx] += r * count;
+    mom->mg[idx] += g * count;
+    mom->mb[idx] += b * count;
+    mom->m2[idx] += (gdouble) (r * r + g * g + b * b) * count;
+  }
+
+  /* make the moments cumulative */
+  for (r = 1; r < WU_SIZE; r++) {
+    memset (area, 0, sizeof (area));
+    memset (area2, 0, sizeof (area2));
+    for (g = 1; g < WU_SIZE; g++) {
+      memset (line, 0, sizeof (line));
+      line2 = 0;
+      for (b = 1; b < WU_SIZE; b++) {
+	gint64 *m[4] = { mom->wt, mom->mr, mom->mg, mom->mb };
+	idx = WU_INDEX (r, g, b);
+	for (c = 0; c < 4; c++) {
+	  line[c] += m[c][idx];
+	  area[c][b] += line[c];
+	  m[c][idx] = m[c][WU_INDEX (r - 1, g, b)] + area[c][b];
 	}
+	line2 += mom->m2[idx];
+	area2[b] += line2;
+	mom->m2[idx] = mom->m2[WU_INDEX (r - 1, g, b)] + area2[b];
       }
     }
   }
-  
-  for (y = 0; y < height; y++) {
-    row = (const guint32 *) (void *) data;
-    for (x = 0; x < width; x++) {
-      gifenc_octree_add_color (&info, row[x] & 0xFFFFFF, 1);
+}
+
+static GifencPalette *
+gifenc_quantize_wu (const GifencHistogram *hist, gboolean alpha, guint max_colors)
+{
+  WuMoments mom;
+  WuBox *boxes;
+  GArray *array;
+  guint32 *palette_colors;
+  guint n_boxes, next, i, n_colors;
+  gint64 weight;
+
+  mom.wt = g_new0 (gint64, WU_SIZE * WU_SIZE * WU_SIZE);
+  mom.mr = g_new0 (gint64, WU_SIZE * WU_SIZE * WU_SIZE);
+  mom.mg = g_new0 (gint64, WU_SIZE * WU_SIZE * WU_SIZE);
+  mom.mb = g_new0 (gint64, WU_SIZE * WU_SIZE * WU_SIZE);
+  mom.m2 = g_new0 (gdouble, WU_SIZE * WU_SIZE * WU_SIZE);
+  array = gifenc_histogram_collect (hist);
+  wu_moments_compute (&mom, array);
+  g_array_free (array, TRUE);
+
+  boxes = g_new (WuBox, MAX (max_colors, 1));
+  boxes[0].r0 = boxes[0].g0 = boxes[0].b0 = 0;
+  boxes[0].r1 = boxes[0].g1 = boxes[0].b1 = WU_SIZE - 1;
+  boxes[0].variance = 0;
+  n_boxes = 1;
+  next = 0;
+  while (n_boxes < max_colors) {
+    if (wu_cut (&boxes[next], &boxes[n_boxes], &mom)) {
+      wu_box_set_variance (&boxes[next], &mom);
+      wu_box_set_variance (&boxes[n_boxes], &mom);
+      n_boxes++;
+    } else {
+      boxes[next].variance = 0;
+    }
+    /* continue with the box with the largest variance */
+    next = 0;
+    for (i = 1; i < n_boxes; i++) {
+      if (boxes[i].variance > boxes[next].variance)
+	next = i;
     }
-    //if (info.num_leaves > MAX_LEAVES)
-    //  gifenc_octree_reduce_colors (&info, STOP_LEAVES);
-    data += rowstride;
+    if (boxes[next].variance <= 0)
+      break;
+  }
+
+  palette_colors = g_new (guint32, n_boxes);
+  n_colors = 0;
+  for (i = 0; i < n_boxes; i++) {
+    weight = WU_VOLUME (&boxes[i], mom.wt);
+    if (weight == 0)
+      continue;
+    palette_colors[n_colors++] = MAKE_COLOR (
+	(WU_VOLUME (&boxes[i], mom.mr) + weight / 2) / weight,
+	(WU_VOLUME (&boxes[i], mom.mg) + weight / 2) / weight,
+	(WU_VOLUME (&boxes[i], mom.mb) + weight / 2) / weight);
   }
-  //gifenc_octree_print (info.tree, 1);
-  gifenc_octree_reduce_colors (&info, max_colors - (alpha ? 1 : 0));
+  if (n_colors == 0)
+    palette_colors[n_colors++] = 0;
+
+  g_free (boxes);
+  g_free (mom.wt);
+  g_free (mom.mr);
+  g_free (mom.mg);
+  g_free (mom.mb);
+  g_free (mom.m2);
+
+  return gifenc_palette_new_nearest (palette_colors, n_colors, alpha);
+}
+
+/*** EXACT COLORS ***/
+
+/* When all colors of a histogram fit into the palette, they are used as
+ * they are. Like the octree, the palette is filled up with a coarse spread
+ * of colors, so colors that only show up later have something close.
+ * Such a palette also gets a small hash table in palette->exact, so
+ * dithering can map pixels to indexes without searching for the nearest
+ * color. */
+
+/* adds color to the exact table unless it's there already */
+static gboolean
+gifenc_exact_add (guint32 *exact, guint32 color, guint id)
+{
+  guint hash = GIFENC_EXACT_HASH (color);
+
+  while (exact[hash] != GIFENC_EXACT_UNUSED) {
+    if (exact[hash] >> 8 == color)
+      return FALSE;
+    hash = (hash + 1) & ((1 << GIFENC_EXACT_BITS) - 1);
+  }
+  exact[hash] = (color << 8) | id;
+  return TRUE;
+}
+
+static GifencPalette *
+gifenc_quantize_exact (const GifencHistogram *hist, gboolean alpha,
+    guint max_colors)
+{
+  static const guint8 spread[] = { 0, 85, 170, 255 };
+  GifencPalette *palette;
+  guint32 *colors, *exact;
+  guint i, n_colors;
+
+  g_assert (hist->n_entries <= max_colors);
+  g_assert (max_colors < 256);
+
+  colors = g_new (guint32, max_colors);
+  exact = g_new (guint32, 1 << GIFENC_EXACT_BITS);
+  memset (exact, 0xFF, sizeof (guint32) << GIFENC_EXACT_BITS);
+  n_colors = 0;
+  for (i = 0; i < hist->n_entries; i++) {
+    if (gifenc_exact_add (exact, hist->entries[i].color, n_colors))
+      colors[n_colors++] = hist->entries[i].color;
+  }
+  for (i = 0; i < 64 && n_colors < max_colors; i++) {
+    guint32 color = (spread[i >> 4] << 16) + (spread[(i >> 2) & 3] << 8) + spread[i & 3];
+    if (gifenc_exact_add (exact, color, n_colors))
+      colors[n_colors++] = color;
+  }
+
+  palette = gifenc_palette_new_nearest (colors, n_colors, alpha);
+  palette->exact = exact;
+
+  return palette;
+}
+
+/*** QUANTIZATION ***/
+
+static GifencPalette *
+gifenc_quantize_octree (const GifencHistogram *hist, gboolean alpha,
+    guint max_colors)
+{
+  guint i, n_colors;
+  OctreeInfo info = { NULL, NULL, 0 };
+  GifencPalette *palette;
+  GifencOctree *tree;
   
-  //gifenc_octree_print (info.tree, 1);
+  if (hist->spill.tree)
+    gifenc_octree_info_copy (&info, &hist->spill);
+  else
+    gifenc_octree_info_init (&info);
+  for (i = 0; i < hist->n_entries; i++) {
+    gifenc_octree_info_add_color (&info, hist->entries[i].color, hist->entries[i].count);
+  }
+  //gifenc_octree_print (info.tree, 0, 1);
+  gifenc_octree_reduce_colors (&info, max_colors - (alpha ? 1 : 0), FALSE);
+  
+  //gifenc_octree_print (info.tree, 0, 1);
   //g_print ("total: %u colors (%u non-leaves)\n", info.num_leaves, 
-  //    g_slist_length (info.non_leaves));
+  //    info.non_leaves->len);
 
   palette = g_new (GifencPalette, 1);
   palette->alpha = alpha;
   palette->colors = g_new (guint, info.num_leaves);
   palette->num_colors = info.num_leaves;
-  palette->data = info.tree;
+
+  /* Copy the remaining nodes into a tree of their own, so lookups only
+   * touch a few kilobytes and the big tree can go away. */
+  tree = gifenc_octree_new (info.non_leaves->len + 1 + info.num_leaves);
+  n_colors = 0;
+  gifenc_octree_finalize (info.tree, 0, tree, &n_colors, palette->colors);
+  g_assert (n_colors == info.num_leaves);
+  gifenc_octree_info_clear (&info);
+  tree->nearest = gifenc_nearest_new (palette->colors, palette->num_colors);
+
+  palette->data = tree;
   palette->lookup = gifenc_octree_lookup;
   palette->free = gifenc_octree_free;
-
-  gifenc_octree_finalize (info.tree, 0, palette->colors);
-  g_slist_free (info.non_leaves);
+  palette->lut = NULL;
+  palette->exact = NULL;
 
   return (GifencPalette *) palette;
 }
 
+/**
+ * gifenc_quantize_histogram:
+ * @hist: histogram of the colors to quantize
+ * @quantizer: the algorithm to use
+ * @alpha: %TRUE to reserve a color for transparency
+ * @max_colors: maximum number of colors in the palette, including
+ *              the transparent one
+ *
+ * Computes a palette for the colors in @hist. %GIFENC_QUANTIZER_OCTREE is
+ * the fastest, %GIFENC_QUANTIZER_MEDIAN_CUT and %GIFENC_QUANTIZER_WU take
+ * a bit longer but usually get closer to the original colors. If all
+ * colors fit, no quantizer is used and the palette contains them exactly.
+ *
+ * Returns: a new palette, free with gifenc_palette_free()
+ **/
+GifencPalette *
+gifenc_quantize_histogram (const GifencHistogram *hist, GifencQuantizer quantizer,
+    gboolean alpha, guint max_colors)
+{
+  guint n_exact;
+
+  g_return_val_if_fail (hist != NULL, NULL);
+  g_return_val_if_fail (max_colors > (alpha ? 1 : 0), NULL);
+  g_return_val_if_fail (max_colors <= 256, NULL);
+
+  /* 255 colors at most, so no color and index can look like GIFENC_EXACT_UNUSED */
+  n_exact = MIN (max_colors - (alpha ? 1 : 0), 255);
+  if (hist->spill.tree == NULL && hist->n_entries > 0 && hist->n_entries <= n_exact)
+    return gifenc_quantize_exact (hist, alpha, n_exact);
+
+  switch (quantizer) {
+    case GIFENC_QUANTIZER_OCTREE:
+      return gifenc_quantize_octree (hist, alpha, max_colors);
+    case GIFENC_QUANTIZER_MEDIAN_CUT:
+      return gifenc_quantize_median_cut (hist, alpha, max_colors - (alpha ? 1 : 0));
+    case GIFENC_QUANTIZER_WU:
+      return gifenc_quantize_wu (hist, alpha, max_colors - (alpha ? 1 : 0));
+    default:
+      g_return_val_if_reached (NULL);
+  }
+}
+
+GifencPalette *
+gifenc_quantize_image (const guint8 *data, guint width, guint height,
+    guint rowstride, gboolean alpha, guint max_colors)
+{
+  GifencHistogram *hist;
+  GifencPalette *palette;
+
+  g_return_val_if_fail (width * height <= (G_MAXUINT >> 8), NULL);
+
+  hist = gifenc_histogram_new ();
+  gifenc_histogram_add_image (hist, data, width, height, rowstride, 0);
+  palette = gifenc_quantize_histogram (hist, GIFENC_QUANTIZER_OCTREE, alpha, max_colors);
+  gifenc_histogram_free (hist);
+
+  return palette;
+}
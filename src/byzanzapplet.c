@@ -189,7 +189,7 @@ byzanz_applet_select_done (GdkWindow *window, const cairo_rectangle_int_t *area,
     if (encoder_type == 0)
       encoder_type = byzanz_encoder_get_type_from_file (priv->file);
     priv->rec = byzanz_session_new (priv->file, encoder_type, window, area, FALSE,
-        g_settings_get_boolean (priv->settings, "record-audio"));
+        g_settings_get_boolean (priv->settings, "record-audio"), NULL);
     g_signal_connect_swapped (priv->rec, "notify", G_CALLBACK (byzanz_applet_session_notify), priv);
     byzanz_session_start (priv->rec);
   }
@@ -133,6 +133,7 @@ enum {
   PROP_OUTPUT,
   PROP_SOUND,
   PROP_CANCELLABLE,
+  PROP_OPTIONS,
   PROP_ERROR,
   PROP_RUNNING
 };
@@ -211,6 +212,9 @@ byzanz_encoder_get_property (GObject *object, guint param_id, GValue *value,
     case PROP_CANCELLABLE:
       g_value_set_object (value, encoder->cancellable);
       break;
+    case PROP_OPTIONS:
+      g_value_set_variant (value, encoder->options);
+      break;
     case PROP_ERROR:
       g_value_set_pointer (value, encoder->error);
       break;
@@ -244,6 +248,9 @@ byzanz_encoder_set_property (GObject *object, guint param_id, const GValue *valu
     case PROP_CANCELLABLE:
       encoder->cancellable = g_value_dup_object (value);
       break;
+    case PROP_OPTIONS:
+      encoder->options = g_value_dup_variant (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -263,6 +270,8 @@ byzanz_encoder_finalize (GObject *object)
     g_object_unref (encoder->cancellable);
   if (encoder->error)
     g_error_free (encoder->error);
+  if (encoder->options)
+    g_variant_unref (encoder->options);
 
   g_async_queue_unref (encoder->jobs);
 
@@ -304,6 +313,9 @@ byzanz_encoder_class_init (ByzanzEncoderClass *klass)
   g_object_class_install_property (object_class, PROP_CANCELLABLE,
       g_param_spec_object ("cancellable", "cancellable", "cancellable for stopping the thread",
 	  G_TYPE_CANCELLABLE, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class, PROP_OPTIONS,
+      g_param_spec_variant ("options", "options", "encoder-specific options",
+	  G_VARIANT_TYPE_VARDICT, NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
   g_object_class_install_property (object_class, PROP_ERROR,
       g_param_spec_pointer ("error", "error", "error that happened on the thread",
 	  G_PARAM_READABLE));
@@ -327,6 +339,7 @@ byzanz_encoder_new (GType           encoder_type,
                     GInputStream *  input,
                     GOutputStream * output,
                     gboolean        record_audio,
+                    GVariant *      options,
                     GCancellable *  cancellable)
 {
   ByzanzEncoder *encoder;
@@ -334,14 +347,55 @@ byzanz_encoder_new (GType           encoder_type,
   g_return_val_if_fail (g_type_is_a (encoder_type, BYZANZ_TYPE_ENCODER), NULL);
   g_return_val_if_fail (G_IS_INPUT_STREAM (input), NULL);
   g_return_val_if_fail (G_IS_OUTPUT_STREAM (output), NULL);
+  g_return_val_if_fail (options == NULL || 
+      g_variant_is_of_type (options, G_VARIANT_TYPE_VARDICT), NULL);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
 
   encoder = g_object_new (encoder_type, "input", input, "output", output, 
-      "record-audio", record_audio, "cancellable", cancellable, NULL);
+      "record-audio", record_audio, "options", options, "cancellable", cancellable, NULL);
 
   return encoder;
 }
 
+/**
+ * byzanz_encoder_options_to_variant:
+ * @options: the options to pass to the encoder
+ *
+ * Creates the value of the ByzanzEncoder:options property for @options.
+ * Options that are set to their default are left out.
+ *
+ * Returns: a new floating a{sv} #GVariant
+ **/
+GVariant *
+byzanz_encoder_options_to_variant (const ByzanzEncoderOptions *options)
+{
+  GVariantBuilder builder;
+
+  g_return_val_if_fail (options != NULL, NULL);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  if (options->batch > 1)
+    g_variant_builder_add (&builder, "{sv}", "batch", g_variant_new_uint32 (options->batch));
+  if (options->lossy > 0)
+    g_variant_builder_add (&builder, "{sv}", "lossy", g_variant_new_uint32 (options->lossy));
+  if (options->optimize)
+    g_variant_builder_add (&builder, "{sv}", "optimize", g_variant_new_boolean (TRUE));
+  if (options->fast_colors)
+    g_variant_builder_add (&builder, "{sv}", "fast-colors", g_variant_new_boolean (TRUE));
+  if (options->ordered_dither)
+    g_variant_builder_add (&builder, "{sv}", "ordered-dither", g_variant_new_boolean (TRUE));
+  if (options->quantizer)
+    g_variant_builder_add (&builder, "{sv}", "quantizer", g_variant_new_string (options->quantizer));
+  if (options->two_pass)
+    g_variant_builder_add (&builder, "{sv}", "two-pass", g_variant_new_boolean (TRUE));
+  if (options->measure_lossy)
+    g_variant_builder_add (&builder, "{sv}", "measure-lossy", g_variant_new_boolean (TRUE));
+  if (options->statistics)
+    g_variant_builder_add (&builder, "{sv}", "statistics", g_variant_new_boolean (TRUE));
+
+  return g_variant_builder_end (&builder);
+}
+
 /*
 void
 byzanz_encoder_process (ByzanzEncoder *	 encoder,
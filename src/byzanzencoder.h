@@ -44,6 +44,7 @@ struct _ByzanzEncoder {
   gboolean              record_audio;           /* TRUE when we're recording audio */
   GCancellable *        cancellable;            /* cancellable to use in thread */
   GError *              error;                  /* NULL or the encoding error */
+  GVariant *            options;                /* NULL or a{sv} of encoder-specific options */
 
   GAsyncQueue *         jobs;                   /* the stuff we still need to encode */
   GThread *             thread;                 /* the encoding thread */
@@ -84,12 +85,28 @@ struct _ByzanzEncoderClass {
 						 GError **		error);
 };
 
+typedef struct _ByzanzEncoderOptions ByzanzEncoderOptions;
+
+/* the options encoders understand, as set from the command line */
+struct _ByzanzEncoderOptions {
+  int			batch;		/* frames to encode at once, 0 or 1 to encode one by one */
+  int			lossy;		/* tolerance for lossy compression or 0 */
+  gboolean		optimize;	/* spend more time to compress better */
+  gboolean		fast_colors;	/* look up colors in a table */
+  gboolean		ordered_dither;	/* dither with a fixed pattern */
+  char *		quantizer;	/* name of the color quantizer or NULL for the default */
+  gboolean		two_pass;	/* collect colors from all frames before encoding */
+  gboolean		measure_lossy;	/* also compress losslessly to measure lossy compression */
+  gboolean		statistics;	/* print statistics when done */
+};
+
 GType		byzanz_encoder_get_type		(void) G_GNUC_CONST;
 
 ByzanzEncoder *	byzanz_encoder_new		(GType                  encoder_type,
                                                  GInputStream *         input,
                                                  GOutputStream *        output,
                                                  gboolean               record_audio,
+                                                 GVariant *             options,
                                                  GCancellable *         cancellable);
 /*
 void		byzanz_encoder_process		(ByzanzEncoder *	encoder,
@@ -99,6 +116,9 @@ void		byzanz_encoder_process		(ByzanzEncoder *	encoder,
 void		byzanz_encoder_close		(ByzanzEncoder *	encoder,
 						 const GTimeVal *	total_elapsed);
 */
+GVariant *      byzanz_encoder_options_to_variant
+                                                (const ByzanzEncoderOptions *options);
+
 gboolean        byzanz_encoder_is_running       (ByzanzEncoder *        encoder);
 const GError *  byzanz_encoder_get_error        (ByzanzEncoder *        encoder);
 
@@ -0,0 +1,382 @@
+/* desktop session recorder
+ * Copyright (C) 2005,2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Encodes a made up recording with the GIF encoder using different
+ * options, decodes the result and compares the frames. Run it with
+ * "make check". */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "byzanzencodergif.h"
+#include "byzanzserialize.h"
+#include "gifdecode.h"
+
+#define WIDTH 512
+#define HEIGHT 384
+#define N_FRAMES 8
+
+/*** RECORDING ***/
+
+/* a smooth gradient with more colors than a GIF can have, so it has to be
+ * dithered. The phase makes it look different for every frame. */
+static void
+draw_gradient (guint32 *canvas, const cairo_rectangle_int_t *rect, guint phase)
+{
+  int x, y;
+
+  for (y = rect->y; y < rect->y + rect->height; y++) {
+    for (x = rect->x; x < rect->x + rect->width; x++) {
+      canvas[y * WIDTH + x] = ((x / 2 + phase * 16) & 0xFF) << 16
+                            | ((y * 2 / 3) & 0xFF) << 8
+                            | (((x + y) / 4 + phase * 8) & 0xFF);
+    }
+  }
+}
+
+/* a pattern of 200 colors, so they all fit into the palette and nothing
+ * is dithered */
+static void
+draw_few_colors (guint32 *canvas, const cairo_rectangle_int_t *rect, guint phase)
+{
+  guint i;
+  int x, y;
+
+  for (y = rect->y; y < rect->y + rect->height; y++) {
+    for (x = rect->x; x < rect->x + rect->width; x++) {
+      i = (x / 16 + (y / 16) * 32 + phase) % 200;
+      canvas[y * WIDTH + x] = (i * 0x010305) & 0xFFFFFF;
+    }
+  }
+}
+
+static void
+serialize_frame (GOutputStream *stream, guint64 msecs, const guint32 *canvas,
+    const cairo_region_t *region)
+{
+  cairo_rectangle_int_t extents;
+  cairo_surface_t *surface;
+  guint8 *data;
+  guint stride;
+  GError *error = NULL;
+  int y;
+
+  cairo_region_get_extents (region, &extents);
+  surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, extents.width, extents.height);
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+  for (y = 0; y < extents.height; y++) {
+    memcpy (data + y * stride, canvas + (extents.y + y) * WIDTH + extents.x,
+        extents.width * sizeof (guint32));
+  }
+  cairo_surface_mark_dirty (surface);
+
+  byzanz_serialize (stream, msecs, surface, region, NULL, &error);
+  g_assert_no_error (error);
+  cairo_surface_destroy (surface);
+}
+
+/* Creates a recording of a gradient with a moving box and a big band that
+ * changes in every frame, so the rectangles are both bigger and smaller than
+ * what the encoder dithers in one go. */
+static GBytes *
+create_recording (void)
+{
+  cairo_rectangle_int_t full = { 0, 0, WIDTH, HEIGHT };
+  cairo_rectangle_int_t box, band;
+  GOutputStream *stream;
+  cairo_region_t *region;
+  GError *error = NULL;
+  guint32 *canvas;
+  GBytes *bytes;
+  guint f;
+
+  stream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  byzanz_serialize_header (stream, WIDTH, HEIGHT, NULL, &error);
+  g_assert_no_error (error);
+
+  canvas = g_new (guint32, WIDTH * HEIGHT);
+  draw_gradient (canvas, &full, 0);
+  region = cairo_region_create_rectangle (&full);
+  serialize_frame (stream, 0, canvas, region);
+  cairo_region_destroy (region);
+
+  for (f = 1; f < N_FRAMES; f++) {
+    box.x = 16 + f * 40;
+    box.y = 32 + f * 8;
+    box.width = 96;
+    box.height = 200;
+    band.x = 0;
+    band.y = 160 + f * 4;
+    band.width = WIDTH;
+    band.height = 180;
+    draw_gradient (canvas, &box, f);
+    draw_gradient (canvas, &band, f + 3);
+
+    region = cairo_region_create_rectangle (&box);
+    cairo_region_union_rectangle (region, &band);
+    serialize_frame (stream, f * 100, canvas, region);
+    cairo_region_destroy (region);
+  }
+  g_free (canvas);
+
+  byzanz_serialize (stream, N_FRAMES * 100, NULL, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_output_stream_close (stream, NULL, &error);
+  g_assert_no_error (error);
+
+  bytes = g_bytes_new (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (stream)),
+      g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (stream)));
+  g_object_unref (stream);
+
+  return bytes;
+}
+
+/* Creates a recording where every frame reports the whole screen as
+ * damaged, but only a small box changes and every third frame doesn't
+ * change at all. The canvas of every frame is appended to canvases. */
+static GBytes *
+create_repaint_recording (GPtrArray *canvases)
+{
+  cairo_rectangle_int_t full = { 0, 0, WIDTH, HEIGHT };
+  cairo_rectangle_int_t box;
+  GOutputStream *stream;
+  cairo_region_t *region;
+  GError *error = NULL;
+  guint32 *canvas;
+  GBytes *bytes;
+  guint f;
+
+  stream = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  byzanz_serialize_header (stream, WIDTH, HEIGHT, NULL, &error);
+  g_assert_no_error (error);
+
+  canvas = g_new (guint32, WIDTH * HEIGHT);
+  draw_few_colors (canvas, &full, 0);
+  region = cairo_region_create_rectangle (&full);
+  for (f = 0; f < N_FRAMES; f++) {
+    if (f % 3 != 0) {
+      box.x = f * 40;
+      box.y = 50 + f * 10;
+      box.width = 64;
+      box.height = 48;
+      draw_few_colors (canvas, &box, f);
+    }
+    serialize_frame (stream, f * 100, canvas, region);
+    g_ptr_array_add (canvases, g_memdup (canvas, WIDTH * HEIGHT * sizeof (guint32)));
+  }
+  cairo_region_destroy (region);
+  g_free (canvas);
+
+  byzanz_serialize (stream, N_FRAMES * 100, NULL, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_output_stream_close (stream, NULL, &error);
+  g_assert_no_error (error);
+
+  bytes = g_bytes_new (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (stream)),
+      g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (stream)));
+  g_object_unref (stream);
+
+  return bytes;
+}
+
+/*** HELPERS ***/
+
+static DecodedGif *
+encode (GBytes *recording, const ByzanzEncoderOptions *options)
+{
+  ByzanzEncoder *encoder;
+  GInputStream *input;
+  GOutputStream *output;
+  DecodedGif *gif;
+
+  input = g_memory_input_stream_new_from_data (g_bytes_get_data (recording, NULL),
+      g_bytes_get_size (recording), NULL);
+  output = g_memory_output_stream_new (NULL, 0, g_realloc, g_free);
+  encoder = byzanz_encoder_new (BYZANZ_TYPE_ENCODER_GIF, input, output, FALSE,
+      byzanz_encoder_options_to_variant (options), NULL);
+
+  while (byzanz_encoder_is_running (encoder))
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_no_error (byzanz_encoder_get_error (encoder));
+
+  gif = decode_gif (g_memory_output_stream_get_data (G_MEMORY_OUTPUT_STREAM (output)),
+      g_memory_output_stream_get_data_size (G_MEMORY_OUTPUT_STREAM (output)));
+  g_assert_cmpuint (gif->width, ==, WIDTH);
+  g_assert_cmpuint (gif->height, ==, HEIGHT);
+
+  g_object_unref (encoder);
+  g_object_unref (output);
+  g_object_unref (input);
+
+  return gif;
+}
+
+/* checks that the GIFs show the same frames for the same time */
+static void
+check_same_frames (const DecodedGif *a, const DecodedGif *b)
+{
+  GPtrArray *frames_a, *frames_b;
+  GArray *delays_a, *delays_b;
+  guint i;
+
+  delays_a = g_array_new (FALSE, FALSE, sizeof (guint));
+  delays_b = g_array_new (FALSE, FALSE, sizeof (guint));
+  frames_a = decoded_gif_get_frames (a, delays_a);
+  frames_b = decoded_gif_get_frames (b, delays_b);
+
+  g_assert_cmpuint (frames_a->len, ==, frames_b->len);
+  g_assert_cmpuint (frames_a->len, >, 0);
+  for (i = 0; i < frames_a->len; i++) {
+    g_assert_cmpuint (g_array_index (delays_a, guint, i), ==, g_array_index (delays_b, guint, i));
+    g_assert (memcmp (g_ptr_array_index (frames_a, i), g_ptr_array_index (frames_b, i),
+          WIDTH * HEIGHT * sizeof (guint32)) == 0);
+  }
+
+  g_ptr_array_unref (frames_a);
+  g_ptr_array_unref (frames_b);
+  g_array_unref (delays_a);
+  g_array_unref (delays_b);
+}
+
+/*** TESTS ***/
+
+/* encoding frames in batches must not change what the GIF looks like */
+static void
+check_batch (ByzanzEncoderOptions *options)
+{
+  DecodedGif *single, *batch;
+  GBytes *recording;
+
+  recording = create_recording ();
+  options->batch = 0;
+  single = encode (recording, options);
+  options->batch = 4;
+  batch = encode (recording, options);
+
+  check_same_frames (single, batch);
+
+  decoded_gif_free (single);
+  decoded_gif_free (batch);
+  g_bytes_unref (recording);
+}
+
+static void
+test_batch (void)
+{
+  ByzanzEncoderOptions options = { 0, };
+
+  check_batch (&options);
+}
+
+static void
+test_batch_ordered (void)
+{
+  ByzanzEncoderOptions options = { 0, };
+
+  options.ordered_dither = TRUE;
+  check_batch (&options);
+}
+
+static void
+test_batch_optimize (void)
+{
+  ByzanzEncoderOptions options = { 0, };
+
+  options.optimize = TRUE;
+  check_batch (&options);
+}
+
+/* Pixels that were damaged but didn't change are skipped, frames without
+ * changes are dropped and the previous frame is shown longer. The GIF must
+ * still show the recorded pixels at all times. */
+static void
+check_repaint (ByzanzEncoderOptions *options)
+{
+  GPtrArray *canvases, *frames;
+  DecodedImage *image;
+  DecodedGif *gif;
+  GBytes *recording;
+  GArray *delays;
+  guint i, t, delay;
+
+  canvases = g_ptr_array_new_with_free_func (g_free);
+  recording = create_repaint_recording (canvases);
+  gif = encode (recording, options);
+
+  /* the first image is the whole screen, the others only the box */
+  g_assert_cmpuint (gif->images->len, <, N_FRAMES);
+  for (i = 1; i < gif->images->len; i++) {
+    image = g_ptr_array_index (gif->images, i);
+    g_assert_cmpuint (image->width * image->height, <=, WIDTH * HEIGHT / 16);
+  }
+
+  delays = g_array_new (FALSE, FALSE, sizeof (guint));
+  frames = decoded_gif_get_frames (gif, delays);
+  t = 0;
+  for (i = 0; i < frames->len; i++) {
+    /* frames last 10/100th seconds in the recording */
+    delay = g_array_index (delays, guint, i);
+    g_assert_cmpuint (delay % 10, ==, 0);
+    for (; delay > 0; delay -= 10, t += 10) {
+      g_assert_cmpuint (t / 10, <, N_FRAMES);
+      g_assert (memcmp (g_ptr_array_index (frames, i), g_ptr_array_index (canvases, t / 10),
+            WIDTH * HEIGHT * sizeof (guint32)) == 0);
+    }
+  }
+  g_assert_cmpuint (t, ==, N_FRAMES * 10);
+
+  g_ptr_array_unref (frames);
+  g_array_unref (delays);
+  decoded_gif_free (gif);
+  g_bytes_unref (recording);
+  g_ptr_array_unref (canvases);
+}
+
+static void
+test_repaint (void)
+{
+  ByzanzEncoderOptions options = { 0, };
+
+  check_repaint (&options);
+}
+
+static void
+test_repaint_batch (void)
+{
+  ByzanzEncoderOptions options = { 0, };
+
+  options.batch = 4;
+  check_repaint (&options);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/encoder-gif/batch", test_batch);
+  g_test_add_func ("/encoder-gif/batch-ordered", test_batch_ordered);
+  g_test_add_func ("/encoder-gif/batch-optimize", test_batch_optimize);
+  g_test_add_func ("/encoder-gif/repaint", test_repaint);
+  g_test_add_func ("/encoder-gif/repaint-batch", test_repaint_batch);
+
+  return g_test_run ();
+}
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <glib/gi18n.h>
 
+#include "byzanzserialize.h"
 #include "gifenc.h"
 
 G_DEFINE_TYPE (ByzanzEncoderGif, byzanz_encoder_gif, BYZANZ_TYPE_ENCODER)
@@ -40,6 +41,117 @@ byzanz_encoder_write_data (gpointer       closure,
       NULL, encoder->cancellable, error);
 }
 
+#if GLIB_CHECK_VERSION (2, 60, 0)
+static gboolean
+byzanz_encoder_writev_data (gpointer        closure,
+                            GOutputVector * vectors,
+                            gsize           n_vectors,
+                            GError **       error)
+{
+  ByzanzEncoder *encoder = closure;
+
+  return g_output_stream_writev_all (encoder->output_stream, vectors, n_vectors,
+      NULL, encoder->cancellable, error);
+}
+#endif
+
+/* a frame that is encoded together with other frames */
+typedef struct {
+  guint64			msecs;		/* timestamp of the frame */
+  cairo_surface_t *		surface;	/* captured data or NULL once dithered */
+  cairo_region_t *		region;		/* region captured in surface */
+  cairo_rectangle_int_t		extents;	/* extents of region */
+  const GifencPalette *		palette;	/* palette to dither to */
+  guint				palette_serial;	/* serial of palette or 0 for the global one */
+  gsize *			offsets;	/* start of every rectangle of region in data */
+  gsize				size;		/* size of data */
+  guint8 *			data;		/* rectangles of region as palette indexes */
+  guint8 *			full;		/* data before unchanged pixels were made transparent or NULL */
+  GArray *			areas;		/* cairo_rectangle_int_t areas that changed */
+  GPtrArray *			images;		/* GifencImages for areas */
+} ByzanzEncoderGifFrame;
+
+static void
+byzanz_encoder_gif_frame_free (ByzanzEncoderGifFrame *frame)
+{
+  if (frame->surface)
+    cairo_surface_destroy (frame->surface);
+  cairo_region_destroy (frame->region);
+  g_free (frame->offsets);
+  g_free (frame->data);
+  g_free (frame->full);
+  g_array_free (frame->areas, TRUE);
+  g_ptr_array_unref (frame->images);
+
+  g_slice_free (ByzanzEncoderGifFrame, frame);
+}
+
+/* Images are written by a separate thread, so writing the images of one 
+ * frame overlaps with encoding the next one. */
+
+/* maximum number of frames waiting to be written */
+#define MAX_QUEUED_WRITES 4
+
+/* images of a frame to be written, or the end of the queue if images is NULL */
+typedef struct {
+  GPtrArray *			images;		/* GifencImages to write */
+  guint				elapsed;	/* time to display the frame */
+} ByzanzEncoderGifWrite;
+
+static gpointer
+byzanz_encoder_gif_writer (gpointer data)
+{
+  ByzanzEncoderGif *gif = data;
+  ByzanzEncoderGifWrite *write;
+  GError *error = NULL;
+  guint i;
+
+  while ((write = g_async_queue_pop (gif->write_queue))->images) {
+    /* all but the last image are shown at once */
+    for (i = 0; i < write->images->len && error == NULL; i++) {
+      if (!gifenc_image_write (g_ptr_array_index (write->images, i),
+              i + 1 == write->images->len ? write->elapsed : 0, &error))
+        g_atomic_int_set (&gif->write_failed, TRUE);
+    }
+    g_ptr_array_unref (write->images);
+    g_slice_free (ByzanzEncoderGifWrite, write);
+    g_async_queue_push (gif->write_slots, GINT_TO_POINTER (1));
+  }
+  g_slice_free (ByzanzEncoderGifWrite, write);
+
+  return error;
+}
+
+/* waits until everything is written and returns the writer's error */
+static gboolean
+byzanz_encoder_gif_stop_writer (ByzanzEncoderGif *gif,
+                                GError **         error)
+{
+  GError *writer_error;
+
+  if (gif->writer == NULL)
+    return TRUE;
+
+  g_async_queue_push (gif->write_queue, g_slice_new0 (ByzanzEncoderGifWrite));
+  writer_error = g_thread_join (gif->writer);
+  gif->writer = NULL;
+  if (writer_error) {
+    g_propagate_error (error, writer_error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static const struct {
+  const char *		name;
+  GifencQuantizer	quantizer;
+} quantizers[] = {
+  { "octree", GIFENC_QUANTIZER_OCTREE },
+  { "median-cut", GIFENC_QUANTIZER_MEDIAN_CUT },
+  { "wu", GIFENC_QUANTIZER_WU }
+};
+
 static gboolean
 byzanz_encoder_gif_setup (ByzanzEncoder * encoder,
                           GOutputStream * stream,
@@ -49,27 +161,82 @@ byzanz_encoder_gif_setup (ByzanzEncoder * encoder,
                           GError **	  error)
 {
   ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
+  const char *quantizer = NULL;
+  guint i, lossy = 0;
+
+  if (encoder->options) {
+    g_variant_lookup (encoder->options, "lossy", "u", &lossy);
+    g_variant_lookup (encoder->options, "statistics", "b", &gif->print_statistics);
+    g_variant_lookup (encoder->options, "measure-lossy", "b", &gif->measure_lossy);
+    g_variant_lookup (encoder->options, "optimize", "b", &gif->optimize);
+    g_variant_lookup (encoder->options, "fast-colors", "b", &gif->fast_colors);
+    g_variant_lookup (encoder->options, "ordered-dither", "b", &gif->ordered_dither);
+    g_variant_lookup (encoder->options, "batch", "u", &gif->batch_size);
+    g_variant_lookup (encoder->options, "quantizer", "&s", &quantizer);
+  }
+  if (quantizer) {
+    for (i = 0; i < G_N_ELEMENTS (quantizers); i++) {
+      if (g_str_equal (quantizer, quantizers[i].name))
+        break;
+    }
+    if (i == G_N_ELEMENTS (quantizers)) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+          _("Unknown color quantizer \"%s\"."), quantizer);
+      return FALSE;
+    }
+    gif->quantizer = quantizers[i].quantizer;
+  }
 
   gif->gifenc = gifenc_new (width, height, byzanz_encoder_write_data, encoder, NULL);
+  gifenc_set_n_stripes (gif->gifenc, g_get_num_processors ());
+#if GLIB_CHECK_VERSION (2, 60, 0)
+  gifenc_set_writev_func (gif->gifenc, byzanz_encoder_writev_data);
+#endif
+  gifenc_set_lossy (gif->gifenc, lossy, gif->print_statistics && gif->measure_lossy);
 
   gif->image_data = g_malloc (width * height);
-  gif->cached_data = g_malloc (width * height);
-  gif->cached_tmp = g_malloc (width * height);
+  gif->source_data = g_malloc ((gsize) width * height * 4);
+  gif->source_region = cairo_region_create ();
+  gif->cached_images = g_ptr_array_new_with_free_func ((GDestroyNotify) gifenc_image_free);
+  gif->cached_images_tmp = g_ptr_array_new_with_free_func ((GDestroyNotify) gifenc_image_free);
+  if (gif->batch_size > 1)
+    gif->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) byzanz_encoder_gif_frame_free);
+
+  gif->write_queue = g_async_queue_new ();
+  gif->write_slots = g_async_queue_new ();
+  for (i = 0; i < MAX_QUEUED_WRITES; i++) {
+    g_async_queue_push (gif->write_slots, GINT_TO_POINTER (1));
+  }
+  gif->writer = g_thread_new ("gif writer", byzanz_encoder_gif_writer, gif);
   return TRUE;
 }
 
+/* maximum number of pixels to look at when computing the palette, larger
+ * frames are sampled so quantizing them doesn't take forever */
+#define MAX_QUANTIZE_SAMPLES (2560 * 1600)
+
 static gboolean
 byzanz_encoder_gif_quantize (ByzanzEncoderGif * gif,
                              cairo_surface_t *  surface,
                              GError **          error)
 {
+  GifencHistogram *hist;
   GifencPalette *palette;
 
   g_assert (!gif->has_quantized);
 
-  palette = gifenc_quantize_image (cairo_image_surface_get_data (surface),
-      cairo_image_surface_get_width (surface), cairo_image_surface_get_height (surface),
-      cairo_image_surface_get_stride (surface), TRUE, 255);
+  if (gif->histogram) {
+    hist = gif->histogram;
+    gif->histogram = NULL;
+  } else {
+    hist = gifenc_histogram_new ();
+    gifenc_histogram_add_image (hist, cairo_image_surface_get_data (surface),
+        cairo_image_surface_get_width (surface), cairo_image_surface_get_height (surface),
+        cairo_image_surface_get_stride (surface), MAX_QUANTIZE_SAMPLES);
+  }
+  palette = gifenc_quantize_histogram (hist, gif->quantizer, TRUE, 255);
+  gifenc_histogram_free (hist);
+  gifenc_palette_set_fast_lookup (palette, gif->fast_colors);
   
   if (!gifenc_initialize (gif->gifenc, palette, TRUE, error))
     return FALSE;
@@ -82,85 +249,1021 @@ byzanz_encoder_gif_quantize (ByzanzEncoderGif * gif,
   return TRUE;
 }
 
+/* adds the colors of the region's rectangles to hist, looking at no more
+ * than max_samples pixels of every rectangle */
+static void
+byzanz_encoder_gif_collect_frame (GifencHistogram *      hist,
+                                  cairo_surface_t *      surface,
+                                  const cairo_region_t * region,
+                                  guint                  max_samples)
+{
+  cairo_rectangle_int_t rect, extents;
+  guint i, n_rects, stride;
+
+  cairo_region_get_extents (region, &extents);
+  stride = cairo_image_surface_get_stride (surface);
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    gifenc_histogram_add_image (hist, cairo_image_surface_get_data (surface)
+            + (rect.y - extents.y) * stride + (rect.x - extents.x) * 4,
+        rect.width, rect.height, stride, max_samples);
+  }
+}
+
+/* Frames whose colors are far from the global palette, like a window with 
+ * a photo that opens during the recording, are encoded with a local 
+ * palette. To find them, only a few pixels of every frame are looked up in
+ * the palettes, so frames that fit the global palette cost next to nothing.
+ * Local palettes are computed from the colors of all frames that needed a 
+ * new one so far and are reused as long as they fit about as well as they 
+ * did when they were computed. */
+
+/* number of pixels to look at to find out how well a frame fits a palette */
+#define PALETTE_ERROR_SAMPLES (1024)
+/* mean squared distance in RGB space to the palette colors that still 
+ * counts as fitting */
+#define MAX_PALETTE_ERROR (3 * 16 * 16)
+/* minimum number of pixels in a frame to compute a new local palette for,
+ * the color table doesn't pay off for less */
+#define MIN_LOCAL_PALETTE_PIXELS (64 * 64)
+/* maximum number of pixels to look at in every rectangle of a frame when
+ * computing a local palette */
+#define MAX_LOCAL_PALETTE_SAMPLES (256 * 256)
+
+/* returns the mean squared distance of sampled pixels of the region to the
+ * colors they get in palette */
+static guint
+byzanz_encoder_gif_get_palette_error (const GifencPalette *  palette,
+                                      cairo_surface_t *      surface,
+                                      const cairo_region_t * region,
+                                      guint64                n_pixels)
+{
+  cairo_rectangle_int_t rect, extents;
+  guint i, n_rects, stride, n_samples, total = 0;
+  guint64 error = 0;
+
+  cairo_region_get_extents (region, &extents);
+  stride = cairo_image_surface_get_stride (surface);
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    error += gifenc_palette_get_error (palette, cairo_image_surface_get_data (surface)
+            + (rect.y - extents.y) * stride + (rect.x - extents.x) * 4,
+        rect.width, rect.height, stride,
+        MAX (1, PALETTE_ERROR_SAMPLES * (guint64) rect.width * rect.height / n_pixels),
+        &n_samples);
+    total += n_samples;
+  }
+
+  return total ? error / total : 0;
+}
+
+/* Returns the palette to encode the region with, either the global one or
+ * gif->local_palette. Local palettes that are replaced are added to 
+ * old_palettes, so frames still using them can finish, or freed right away
+ * if old_palettes is NULL. */
+static const GifencPalette *
+byzanz_encoder_gif_choose_palette (ByzanzEncoderGif *     gif,
+                                   cairo_surface_t *      surface,
+                                   const cairo_region_t * region,
+                                   GPtrArray *            old_palettes)
+{
+  const GifencPalette *palette = gif->gifenc->palette;
+  cairo_rectangle_int_t rect;
+  GifencPalette *local;
+  guint i, n_rects, error, local_error;
+  guint64 n_pixels = 0;
+
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    n_pixels += (guint64) rect.width * rect.height;
+  }
+  if (n_pixels == 0)
+    return palette;
+
+  error = byzanz_encoder_gif_get_palette_error (palette, surface, region, n_pixels);
+  if (error <= MAX_PALETTE_ERROR)
+    return palette;
+
+  if (gif->local_palette) {
+    local_error = byzanz_encoder_gif_get_palette_error (gif->local_palette, 
+        surface, region, n_pixels);
+    if (local_error <= MAX (MAX_PALETTE_ERROR, 2 * gif->local_palette_error) ||
+        n_pixels < MIN_LOCAL_PALETTE_PIXELS)
+      return local_error < error ? gif->local_palette : palette;
+  } else if (n_pixels < MIN_LOCAL_PALETTE_PIXELS) {
+    return palette;
+  }
+
+  if (gif->local_histogram == NULL)
+    gif->local_histogram = gifenc_histogram_new ();
+  byzanz_encoder_gif_collect_frame (gif->local_histogram, surface, region,
+      MAX_LOCAL_PALETTE_SAMPLES);
+  local = gifenc_quantize_histogram (gif->local_histogram, gif->quantizer, TRUE, 255);
+  gifenc_palette_set_fast_lookup (local, gif->fast_colors);
+  if (gif->local_palette) {
+    if (old_palettes)
+      g_ptr_array_add (old_palettes, gif->local_palette);
+    else
+      gifenc_palette_free (gif->local_palette);
+  }
+  gif->local_palette = local;
+  gif->local_palette_serial++;
+  gif->local_palette_error = byzanz_encoder_gif_get_palette_error (local, 
+      surface, region, n_pixels);
+
+  return gif->local_palette_error < error ? gif->local_palette : palette;
+}
+
+/* Indexes in image_data only mean something for the palette they were 
+ * dithered with. So once local palettes are used, image_palettes marks 
+ * every pixel with the id of its palette: 0 for the global palette and
+ * counting up for local palettes, identified by their serial. Returns the
+ * id for the given serial, must be called in the order frames are 
+ * encoded in. */
+static guint8
+byzanz_encoder_gif_get_palette_id (ByzanzEncoderGif *gif,
+                                   guint             serial)
+{
+  gsize i, size;
+
+  if (serial == 0)
+    return 0;
+  if (serial == gif->image_palette_serial)
+    return gif->image_palette_id;
+
+  size = (gsize) gifenc_get_width (gif->gifenc) * gifenc_get_height (gif->gifenc);
+  if (gif->image_palettes == NULL) {
+    gif->image_palettes = g_malloc0 (size);
+  } else if (gif->image_palette_id == G_MAXUINT8) {
+    /* out of ids, make all pixels of local palettes count as changed */
+    for (i = 0; i < size; i++) {
+      if (gif->image_palettes[i] == 0)
+        continue;
+      gif->image_palettes[i] = 0;
+      gif->image_data[i] = gifenc_palette_get_alpha_index (gif->gifenc->palette);
+    }
+    gif->image_palette_id = 0;
+  }
+  gif->image_palette_serial = serial;
+  return ++gif->image_palette_id;
+}
+
+/* Makes the n_pixels pixels of image_data starting at offset count as 
+ * changed if they don't index the palette with the given id, by setting
+ * them to its transparent index, and marks them as indexing it. */
+static void
+byzanz_encoder_gif_claim_pixels (ByzanzEncoderGif *gif,
+                                 gsize             offset,
+                                 guint             n_pixels,
+                                 guint8            id,
+                                 guint8            transparent)
+{
+  guint8 *palettes;
+  guint i;
+
+  if (gif->image_palettes == NULL)
+    return;
+
+  palettes = gif->image_palettes + offset;
+  for (i = 0; i < n_pixels; i++) {
+    if (palettes[i] != id) {
+      palettes[i] = id;
+      gif->image_data[offset + i] = transparent;
+    }
+  }
+}
+
 static gboolean
 byzanz_encoder_write_image (ByzanzEncoderGif *gif, guint64 msecs, GError **error)
 {
+  ByzanzEncoderGifWrite *write;
   guint elapsed;
-  guint width;
 
-  g_assert (gif->cached_data != NULL);
-  g_assert (gif->cached_area.width > 0);
-  g_assert (gif->cached_area.height > 0);
+  g_assert (gif->cached_images->len > 0);
+
+  if (g_atomic_int_get (&gif->write_failed)) {
+    byzanz_encoder_gif_stop_writer (gif, error);
+    return FALSE;
+  }
 
-  width = gifenc_get_width (gif->gifenc);
   elapsed = msecs - gif->cached_time;
   elapsed = MAX (elapsed, 10);
 
-  if (!gifenc_add_image (gif->gifenc, gif->cached_area.x, gif->cached_area.y, 
-            gif->cached_area.width, gif->cached_area.height, elapsed,
-            gif->cached_data + width * gif->cached_area.y + gif->cached_area.x,
-            width, error))
-    return FALSE;
+  write = g_slice_new (ByzanzEncoderGifWrite);
+  write->images = gif->cached_images;
+  write->elapsed = elapsed;
+  gif->cached_images = g_ptr_array_new_with_free_func ((GDestroyNotify) gifenc_image_free);
+  /* wait if the writer is too far behind */
+  g_async_queue_pop (gif->write_slots);
+  g_async_queue_push (gif->write_queue, write);
 
   gif->cached_time = msecs;
   return TRUE;
 }
 
+/* Every image costs a graphic control extension, an image descriptor and a
+ * fresh LZW dictionary. This is the amount of transparent pixels that is 
+ * assumed to encode to the same size. */
+#define IMAGE_COST (64 * 64)
+/* the same for the color table of an image with a local palette */
+#define LOCAL_PALETTE_COST (128 * 128)
+/* maximum number of areas to cluster, more are merged into one image */
+#define MAX_AREAS 64
+
+static gsize
+byzanz_encoder_gif_area_cost (const cairo_rectangle_int_t *area,
+                              gsize                        image_cost)
+{
+  return image_cost + (gsize) area->width * area->height;
+}
+
+/* merges areas as long as encoding the merged area is cheaper than encoding
+ * them as separate images that cost image_cost each */
+static void
+byzanz_encoder_gif_cluster_areas (GArray *areas,
+                                  gsize   image_cost)
+{
+  cairo_rectangle_int_t *a, *b, merged;
+  gboolean changed;
+  guint i, j;
+
+  if (areas->len > MAX_AREAS) {
+    a = &g_array_index (areas, cairo_rectangle_int_t, 0);
+    for (i = 1; i < areas->len; i++) {
+      gdk_rectangle_union ((const GdkRectangle *) a, 
+          (const GdkRectangle *) &g_array_index (areas, cairo_rectangle_int_t, i), 
+          (GdkRectangle *) a);
+    }
+    g_array_set_size (areas, 1);
+    return;
+  }
+
+  do {
+    changed = FALSE;
+    for (i = 0; i < areas->len; i++) {
+      a = &g_array_index (areas, cairo_rectangle_int_t, i);
+      for (j = i + 1; j < areas->len; j++) {
+        b = &g_array_index (areas, cairo_rectangle_int_t, j);
+        gdk_rectangle_union ((const GdkRectangle *) a, (const GdkRectangle *) b, 
+            (GdkRectangle *) &merged);
+        if (byzanz_encoder_gif_area_cost (&merged, image_cost) > 
+            byzanz_encoder_gif_area_cost (a, image_cost) + 
+            byzanz_encoder_gif_area_cost (b, image_cost))
+          continue;
+        *a = merged;
+        g_array_remove_index_fast (areas, j);
+        changed = TRUE;
+        j = i;
+      }
+    }
+  } while (changed);
+}
+
+/* minimum number of pixels to dither in one job */
+#define MIN_DITHER_PIXELS (64 * 1024)
+
+/* Returns the number of rows of an area to dither in one job. 
+ * Floyd-Steinberg carries the error from one row to the next, so a job 
+ * starting in the middle of a rectangle would leave a seam there. Ordered
+ * dithering doesn't look at other pixels, so it can be split up. */
+static guint
+byzanz_encoder_gif_get_dither_rows (ByzanzEncoderGif *gif,
+                                    guint             width,
+                                    guint             height)
+{
+  if (!gif->ordered_dither)
+    return height;
+
+  return MAX (1, MIN_DITHER_PIXELS / width);
+}
+
+typedef struct {
+  ByzanzEncoderGif *		gif;		/* the encoder */
+  const guint8 *		data;		/* data of the captured surface */
+  guint				stride;		/* stride of data */
+  cairo_rectangle_int_t		extents;	/* area of the screen captured in data */
+  const cairo_rectangle_int_t * rects;		/* rectangles of the region inside area */
+  guint				n_rects;	/* number of rectangles */
+  cairo_rectangle_int_t		area;		/* area to dither or covered by image */
+  guint8 *			rows;		/* palette indexes of area */
+  guint				rowstride;	/* rowstride of rows */
+  const GifencPalette *		palette;	/* palette to dither to */
+  guint8			palette_id;	/* id of palette in image_palettes */
+  cairo_rectangle_int_t		changed;	/* changed pixels of the dithered rows */
+  GifencImage *			image;		/* image to fill */
+  guint				stripe;		/* stripe of image to fill */
+  int				start;		/* first row to dither or fill */
+  int				end;		/* row after the last row to dither or fill */
+} ByzanzEncoderGifJob;
+
+/* makes changed include rect, changed is empty if its width is 0 */
+static void
+byzanz_encoder_gif_add_changed (cairo_rectangle_int_t *       changed,
+                                const cairo_rectangle_int_t * rect)
+{
+  if (changed->width > 0)
+    gdk_rectangle_union ((const GdkRectangle *) changed, (const GdkRectangle *) rect,
+        (GdkRectangle *) changed);
+  else
+    *changed = *rect;
+}
+
+/* Dithers row y of the area, parts not covered by the job's rectangles are
+ * transparent. Adds the pixels that changed to changed. */
+static void
+byzanz_encoder_gif_dither_row (ByzanzEncoderGifJob *   job,
+                               GifencDither **         dithers,
+                               int                     y,
+                               guint8 *                row,
+                               cairo_rectangle_int_t * changed)
+{
+  ByzanzEncoderGif *gif = job->gif;
+  const GifencPalette *palette = job->palette;
+  const cairo_rectangle_int_t *rect;
+  cairo_rectangle_int_t pixels;
+  guint i, width, first, last;
+
+  width = gifenc_get_width (gif->gifenc);
+  memset (row, gifenc_palette_get_alpha_index (palette), job->area.width);
+  for (i = 0; i < job->n_rects; i++) {
+    rect = &job->rects[i];
+    if (y < rect->y || y >= rect->y + rect->height)
+      continue;
+    if (dithers[i] == NULL) {
+      if (gif->ordered_dither)
+        dithers[i] = gifenc_dither_new_ordered (palette, rect->x, y, rect->width);
+      else
+        dithers[i] = gifenc_dither_new (palette, rect->width);
+    }
+    byzanz_encoder_gif_claim_pixels (gif, (gsize) width * y + rect->x, rect->width,
+        job->palette_id, gifenc_palette_get_alpha_index (palette));
+    if (!gifenc_dither_row_with_full_image (dithers[i], 
+            row + rect->x - job->area.x,
+            gif->image_data + width * y + rect->x,
+            job->data + (rect->x - job->extents.x) * 4 + (y - job->extents.y) * job->stride,
+            &first, &last))
+      continue;
+    pixels.x = rect->x + first;
+    pixels.y = y;
+    pixels.width = last - first + 1;
+    pixels.height = 1;
+    byzanz_encoder_gif_add_changed (changed, &pixels);
+  }
+}
+
+/* Returns row y of the area of image_data to encode unchanged pixels from
+ * or NULL if not optimizing. Pixels that index a different palette are
+ * replaced with transparent ones in buffer. */
+static const guint8 *
+byzanz_encoder_gif_full_row (ByzanzEncoderGifJob *job,
+                             int                  y,
+                             guint8 *             buffer)
+{
+  ByzanzEncoderGif *gif = job->gif;
+  guint8 transparent;
+  gsize offset;
+  int x;
+
+  if (!gif->optimize)
+    return NULL;
+
+  offset = (gsize) gifenc_get_width (gif->gifenc) * y + job->area.x;
+  if (gif->image_palettes == NULL)
+    return gif->image_data + offset;
+
+  transparent = gifenc_palette_get_alpha_index (job->palette);
+  for (x = 0; x < job->area.width; x++) {
+    buffer[x] = gif->image_palettes[offset + x] == job->palette_id ? 
+        gif->image_data[offset + x] : transparent;
+  }
+  return buffer;
+}
+
+static void
+byzanz_encoder_gif_job_dither (gpointer data,
+                               guint    id)
+{
+  ByzanzEncoderGifJob *job = (ByzanzEncoderGifJob *) data + id;
+  GifencDither **dithers;
+  guint i;
+  int y;
+
+  /* dithering restarts for every rectangle of the region, jobs only
+   * split rectangles when that doesn't change the result */
+  dithers = g_new0 (GifencDither *, job->n_rects);
+  for (y = job->start; y < job->end; y++) {
+    byzanz_encoder_gif_dither_row (job, dithers, y,
+        job->rows + (gsize) (y - job->area.y) * job->rowstride, &job->changed);
+  }
+  for (i = 0; i < job->n_rects; i++) {
+    if (dithers[i])
+      gifenc_dither_free (dithers[i]);
+  }
+  g_free (dithers);
+}
+
+static void
+byzanz_encoder_gif_job_compress (gpointer data,
+                                 guint    id)
+{
+  ByzanzEncoderGifJob *job = (ByzanzEncoderGifJob *) data + id;
+  guint8 *full;
+  int y;
+
+  full = g_malloc (job->area.width);
+  for (y = job->start; y < job->end; y++) {
+    gifenc_image_add_row_with_full_image (job->image, job->stripe, 
+        job->rows + (gsize) (y - job->area.y) * job->rowstride,
+        byzanz_encoder_gif_full_row (job, y, full));
+  }
+  g_free (full);
+}
+
+/* Starts an image for the job's area and queues a job for every stripe */
+static void
+byzanz_encoder_gif_start_image (ByzanzEncoderGifJob *job,
+                                GArray *             jobs)
+{
+  guint i, n_stripes, start, height;
+
+  job->image = gifenc_image_new (job->gif->gifenc, job->area.x, job->area.y, 
+      job->area.width, job->area.height);
+  if (job->palette != job->gif->gifenc->palette)
+    gifenc_image_set_palette (job->image, job->palette);
+  g_ptr_array_add (job->gif->cached_images_tmp, job->image);
+
+  n_stripes = gifenc_image_get_n_stripes (job->image);
+  for (i = 0; i < n_stripes; i++) {
+    gifenc_image_get_stripe (job->image, i, &start, &height);
+    job->stripe = i;
+    job->start = job->area.y + start;
+    job->end = job->start + height;
+    g_array_append_val (jobs, *job);
+  }
+}
+
+static gboolean
+byzanz_encoder_gif_contains (const cairo_rectangle_int_t *area,
+                             const cairo_rectangle_int_t *rect)
+{
+  return rect->x >= area->x && rect->x + rect->width <= area->x + area->width &&
+         rect->y >= area->y && rect->y + rect->height <= area->y + area->height;
+}
+
+/* Dithers the areas of the changed region in parallel, then compresses the
+ * pixels of every area that really changed into cached_images_tmp. 
+ * Returns FALSE if nothing changed. */
 static gboolean
 byzanz_encoder_gif_encode_image (ByzanzEncoderGif *      gif,
                                  cairo_surface_t *       surface,
-                                 const cairo_region_t *  region,
-                                 cairo_rectangle_int_t * area_out)
+                                 const cairo_region_t *  region)
 {
-  cairo_rectangle_int_t extents, area, rect;
-  guint8 transparent;
-  guint i, n_rects, stride, width;
+  ByzanzEncoderGifJob job = { gif, };
+  cairo_rectangle_int_t rect, area;
+  GArray *areas, *rects, *jobs;
+  GPtrArray *buffers;
+  gboolean *used;
+  guint *n_area_rects;
+  guint i, j, n_rects, n_dither_jobs, rows;
+  int y;
 
-  cairo_region_get_extents (region, &extents);
-  transparent = gifenc_palette_get_alpha_index (gif->gifenc->palette);
-  stride = cairo_image_surface_get_stride (surface);
+  job.data = cairo_image_surface_get_data (surface);
+  job.stride = cairo_image_surface_get_stride (surface);
+  cairo_region_get_extents (region, &job.extents);
+  job.palette = byzanz_encoder_gif_choose_palette (gif, surface, region, NULL);
+  job.palette_id = byzanz_encoder_gif_get_palette_id (gif, 
+      job.palette == gif->gifenc->palette ? 0 : gif->local_palette_serial);
+
+  n_rects = cairo_region_num_rectangles (region);
+  areas = g_array_sized_new (FALSE, FALSE, sizeof (cairo_rectangle_int_t), n_rects);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (region, i, &rect);
+    g_array_append_val (areas, rect);
+  }
+  byzanz_encoder_gif_cluster_areas (areas, job.palette == gif->gifenc->palette ? 
+      IMAGE_COST : IMAGE_COST + LOCAL_PALETTE_COST);
+
+  /* sort the rectangles by the area they belong to */
+  rects = g_array_sized_new (FALSE, FALSE, sizeof (cairo_rectangle_int_t), n_rects);
+  used = g_new0 (gboolean, n_rects);
+  n_area_rects = g_new0 (guint, areas->len);
+  for (i = 0; i < areas->len; i++) {
+    for (j = 0; j < n_rects; j++) {
+      cairo_region_get_rectangle (region, j, &rect);
+      if (used[j] || 
+          !byzanz_encoder_gif_contains (&g_array_index (areas, cairo_rectangle_int_t, i), &rect))
+        continue;
+      g_array_append_val (rects, rect);
+      used[j] = TRUE;
+      n_area_rects[i]++;
+    }
+  }
+
+  /* dither all areas in parallel */
+  jobs = g_array_new (FALSE, FALSE, sizeof (ByzanzEncoderGifJob));
+  buffers = g_ptr_array_new_with_free_func (g_free);
+  job.rects = (const cairo_rectangle_int_t *) rects->data;
+  for (i = 0; i < areas->len; i++) {
+    job.area = g_array_index (areas, cairo_rectangle_int_t, i);
+    job.n_rects = n_area_rects[i];
+    job.rows = g_malloc ((gsize) job.area.width * job.area.height);
+    job.rowstride = job.area.width;
+    g_ptr_array_add (buffers, job.rows);
+    rows = byzanz_encoder_gif_get_dither_rows (gif, job.area.width, job.area.height);
+    for (y = 0; y < job.area.height; y += rows) {
+      job.start = job.area.y + y;
+      job.end = job.area.y + MIN (y + (int) rows, job.area.height);
+      g_array_append_val (jobs, job);
+    }
+    job.rects += job.n_rects;
+  }
+  gifenc_parallel (byzanz_encoder_gif_job_dither, jobs->data, jobs->len);
+
+  /* compress the pixels of every area that changed in parallel */
+  g_ptr_array_set_size (gif->cached_images_tmp, 0);
+  n_dither_jobs = jobs->len;
+  for (i = 0; i < n_dither_jobs; i = j) {
+    job = g_array_index (jobs, ByzanzEncoderGifJob, i);
+    for (j = i + 1; j < n_dither_jobs &&
+        g_array_index (jobs, ByzanzEncoderGifJob, j).rows == job.rows; j++) {
+      byzanz_encoder_gif_add_changed (&job.changed, 
+          &g_array_index (jobs, ByzanzEncoderGifJob, j).changed);
+    }
+    if (job.changed.width == 0)
+      continue;
+    area = job.area;
+    job.area = job.changed;
+    job.rows += (gsize) (job.area.y - area.y) * job.rowstride + job.area.x - area.x;
+    byzanz_encoder_gif_start_image (&job, jobs);
+  }
+  gifenc_parallel (byzanz_encoder_gif_job_compress, 
+      &g_array_index (jobs, ByzanzEncoderGifJob, n_dither_jobs), 
+      jobs->len - n_dither_jobs);
+
+  g_array_free (jobs, TRUE);
+  g_ptr_array_unref (buffers);
+  g_free (n_area_rects);
+  g_free (used);
+  g_array_free (rects, TRUE);
+  g_array_free (areas, TRUE);
+
+  return gif->cached_images_tmp->len > 0;
+}
+
+static void
+byzanz_encoder_swap_image (ByzanzEncoderGif *gif)
+{
+  GPtrArray *swap;
+
+  swap = gif->cached_images;
+  gif->cached_images = gif->cached_images_tmp;
+  gif->cached_images_tmp = swap;
+}
+
+/* Frames can be encoded in parallel, because dithering doesn't depend on
+ * the previous frames. Only removing the unchanged pixels needs to be done 
+ * in order, and that is cheap. So the frames of a batch are dithered in 
+ * parallel, then compared with image_data one after another, then all 
+ * their images are compressed in parallel and finally written in order. */
+
+/* maximum number of pixels in a batch, to bound memory use */
+#define MAX_BATCH_PIXELS (32 * 1024 * 1024)
+
+typedef struct {
+  ByzanzEncoderGif *		gif;		/* the encoder */
+  ByzanzEncoderGifFrame *	frame;		/* frame to work on */
+  cairo_rectangle_int_t		rect;		/* rows of a rectangle of the frame's region */
+  guint8 *			data;		/* place to dither rect to */
+  GifencImage *			image;		/* image to compress */
+  guint				stripe;		/* stripe of image to compress */
+} ByzanzEncoderGifFrameJob;
+
+static void
+byzanz_encoder_gif_frame_dither (gpointer data,
+                                 guint    id)
+{
+  ByzanzEncoderGifFrameJob *job = (ByzanzEncoderGifFrameJob *) data + id;
+  ByzanzEncoderGifFrame *frame = job->frame;
+  const guint8 *pixels;
+  guint stride;
+
+  stride = cairo_image_surface_get_stride (frame->surface);
+  pixels = cairo_image_surface_get_data (frame->surface) 
+      + (job->rect.x - frame->extents.x) * 4
+      + (job->rect.y - frame->extents.y) * stride;
+  if (job->gif->ordered_dither)
+    gifenc_dither_rgb_ordered (job->data, job->rect.width, frame->palette, pixels,
+        job->rect.x, job->rect.y, job->rect.width, job->rect.height, stride);
+  else
+    gifenc_dither_rgb (job->data, job->rect.width, frame->palette, pixels,
+        job->rect.width, job->rect.height, stride);
+}
+
+/* copies row y of area from the rectangles in data, the rest is transparent */
+static void
+byzanz_encoder_gif_frame_get_row (ByzanzEncoderGifFrame *       frame,
+                                  const guint8 *                data,
+                                  const cairo_rectangle_int_t * area,
+                                  int                           y,
+                                  guint8 *                      row,
+                                  guint8                        transparent)
+{
+  cairo_rectangle_int_t rect;
+  guint i, n_rects;
+  int x, end;
+
+  memset (row, transparent, area->width);
+  n_rects = cairo_region_num_rectangles (frame->region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (frame->region, i, &rect);
+    if (y < rect.y || y >= rect.y + rect.height)
+      continue;
+    x = MAX (rect.x, area->x);
+    end = MIN (rect.x + rect.width, area->x + area->width);
+    if (x >= end)
+      continue;
+    memcpy (row + x - area->x,
+        data + frame->offsets[i] + (gsize) (y - rect.y) * rect.width + x - rect.x,
+        end - x);
+  }
+}
+
+static void
+byzanz_encoder_gif_frame_compress (gpointer data,
+                                   guint    id)
+{
+  ByzanzEncoderGifFrameJob *job = (ByzanzEncoderGifFrameJob *) data + id;
+  guint8 transparent, *row, *full;
+  guint y, height;
+
+  transparent = gifenc_palette_get_alpha_index (job->frame->palette);
+  row = g_malloc (job->rect.width);
+  full = job->frame->full ? g_malloc (job->rect.width) : NULL;
+  gifenc_image_get_stripe (job->image, job->stripe, &y, &height);
+  for (y += job->rect.y; height > 0; height--, y++) {
+    byzanz_encoder_gif_frame_get_row (job->frame, job->frame->data, &job->rect, y,
+        row, transparent);
+    if (full)
+      byzanz_encoder_gif_frame_get_row (job->frame, job->frame->full, &job->rect, y,
+          full, transparent);
+    gifenc_image_add_row_with_full_image (job->image, job->stripe, row, full);
+  }
+  g_free (row);
+  g_free (full);
+}
+
+/* makes unchanged pixels transparent and updates image_data and the 
+ * frame's areas */
+static void
+byzanz_encoder_gif_frame_compare (ByzanzEncoderGif *      gif,
+                                  ByzanzEncoderGifFrame * frame)
+{
+  cairo_rectangle_int_t rect, area;
+  guint i, n_rects, width;
+  guint8 transparent, id, *data, *full;
+  int x, y;
+
+  transparent = gifenc_palette_get_alpha_index (frame->palette);
+  id = byzanz_encoder_gif_get_palette_id (gif, frame->palette_serial);
   width = gifenc_get_width (gif->gifenc);
+  n_rects = cairo_region_num_rectangles (frame->region);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (frame->region, i, &rect);
+    data = frame->data + frame->offsets[i];
+    area.x = rect.x + rect.width;
+    area.y = rect.y + rect.height;
+    area.width = area.height = 0;
+    for (y = rect.y; y < rect.y + rect.height; y++) {
+      byzanz_encoder_gif_claim_pixels (gif, (gsize) width * y + rect.x, rect.width,
+          id, transparent);
+      full = gif->image_data + width * y;
+      for (x = rect.x; x < rect.x + rect.width; x++, data++) {
+        if (*data == full[x]) {
+          *data = transparent;
+        } else {
+          full[x] = *data;
+          area.x = MIN (area.x, x);
+          area.y = MIN (area.y, y);
+          area.width = MAX (area.width, x + 1);
+          area.height = y + 1;
+        }
+      }
+    }
+    if (area.width > area.x) {
+      area.width -= area.x;
+      area.height -= area.y;
+      g_array_append_val (frame->areas, area);
+    }
+  }
+  byzanz_encoder_gif_cluster_areas (frame->areas, frame->palette == gif->gifenc->palette ? 
+      IMAGE_COST : IMAGE_COST + LOCAL_PALETTE_COST);
+}
 
-  /* clear area */
-  /* FIXME: only do this in parts not captured by region */
-  for (i = extents.y; i < (guint) (extents.y + extents.height); i++) {
-    memset (gif->cached_tmp + width * i + extents.x, transparent, extents.width);
+static gboolean
+byzanz_encoder_gif_flush_batch (ByzanzEncoderGif *gif,
+                                GError **         error)
+{
+  ByzanzEncoderGifFrameJob job = { gif, };
+  ByzanzEncoderGifFrame *frame;
+  GPtrArray *swap, *old_palettes;
+  GArray *jobs;
+  guint i, j, k, n_rects, rows, n_stripes;
+
+  /* dither all frames */
+  jobs = g_array_new (FALSE, FALSE, sizeof (ByzanzEncoderGifFrameJob));
+  old_palettes = g_ptr_array_new_with_free_func ((GDestroyNotify) gifenc_palette_free);
+  for (i = 0; i < gif->batch->len; i++) {
+    frame = job.frame = g_ptr_array_index (gif->batch, i);
+    frame->palette = byzanz_encoder_gif_choose_palette (gif, frame->surface, 
+        frame->region, old_palettes);
+    if (frame->palette != gif->gifenc->palette)
+      frame->palette_serial = gif->local_palette_serial;
+    n_rects = cairo_region_num_rectangles (frame->region);
+    frame->offsets = g_new (gsize, n_rects);
+    for (j = 0; j < n_rects; j++) {
+      cairo_region_get_rectangle (frame->region, j, &job.rect);
+      frame->offsets[j] = frame->size;
+      frame->size += (gsize) job.rect.width * job.rect.height;
+    }
+    frame->data = g_malloc (frame->size);
+    for (j = 0; j < n_rects; j++) {
+      cairo_region_get_rectangle (frame->region, j, &job.rect);
+      job.data = frame->data + frame->offsets[j];
+      rows = byzanz_encoder_gif_get_dither_rows (gif, job.rect.width, job.rect.height);
+      for (k = 0; k < (guint) job.rect.height; k += rows) {
+        ByzanzEncoderGifFrameJob part = job;
+
+        part.rect.y += k;
+        part.rect.height = MIN (rows, job.rect.height - k);
+        part.data += (gsize) k * job.rect.width;
+        g_array_append_val (jobs, part);
+      }
+    }
+  }
+  gifenc_parallel (byzanz_encoder_gif_frame_dither, jobs->data, jobs->len);
+  g_array_set_size (jobs, 0);
+
+  /* remove unchanged pixels in order and create the images */
+  for (i = 0; i < gif->batch->len; i++) {
+    frame = job.frame = g_ptr_array_index (gif->batch, i);
+    cairo_surface_destroy (frame->surface);
+    frame->surface = NULL;
+    if (gif->optimize) {
+      frame->full = g_malloc (frame->size);
+      memcpy (frame->full, frame->data, frame->size);
+    }
+    byzanz_encoder_gif_frame_compare (gif, frame);
+    for (j = 0; j < frame->areas->len; j++) {
+      job.rect = g_array_index (frame->areas, cairo_rectangle_int_t, j);
+      job.image = gifenc_image_new (gif->gifenc, job.rect.x, job.rect.y, 
+          job.rect.width, job.rect.height);
+      if (frame->palette != gif->gifenc->palette)
+        gifenc_image_set_palette (job.image, frame->palette);
+      g_ptr_array_add (frame->images, job.image);
+      n_stripes = gifenc_image_get_n_stripes (job.image);
+      for (job.stripe = 0; job.stripe < n_stripes; job.stripe++)
+        g_array_append_val (jobs, job);
+    }
+  }
+
+  /* compress all images */
+  gifenc_parallel (byzanz_encoder_gif_frame_compress, jobs->data, jobs->len);
+  g_array_free (jobs, TRUE);
+  g_ptr_array_unref (old_palettes);
+
+  /* write them in order */
+  for (i = 0; i < gif->batch->len; i++) {
+    frame = g_ptr_array_index (gif->batch, i);
+    if (frame->images->len == 0)
+      continue;
+    /* only the first frame has nothing cached */
+    if (gif->cached_images->len > 0 &&
+        !byzanz_encoder_write_image (gif, frame->msecs, error))
+      return FALSE;
+    swap = gif->cached_images;
+    gif->cached_images = frame->images;
+    frame->images = swap;
   }
 
-  /* render changed parts */
+  g_ptr_array_set_size (gif->batch, 0);
+  gif->batch_pixels = 0;
+  return TRUE;
+}
+
+static gboolean
+byzanz_encoder_gif_add_to_batch (ByzanzEncoderGif *     gif,
+                                 guint64                msecs,
+                                 cairo_surface_t *      surface,
+                                 const cairo_region_t * region,
+                                 GError **              error)
+{
+  ByzanzEncoderGifFrame *frame;
+
+  frame = g_slice_new0 (ByzanzEncoderGifFrame);
+  frame->msecs = msecs;
+  frame->surface = cairo_surface_reference (surface);
+  frame->region = cairo_region_copy (region);
+  cairo_region_get_extents (region, &frame->extents);
+  frame->areas = g_array_new (FALSE, FALSE, sizeof (cairo_rectangle_int_t));
+  frame->images = g_ptr_array_new_with_free_func ((GDestroyNotify) gifenc_image_free);
+  g_ptr_array_add (gif->batch, frame);
+  gif->batch_pixels += (gsize) frame->extents.width * frame->extents.height;
+
+  if (gif->batch->len < gif->batch_size && gif->batch_pixels < MAX_BATCH_PIXELS)
+    return TRUE;
+
+  return byzanz_encoder_gif_flush_batch (gif, error);
+}
+
+/* Damage reports cover a lot of pixels that were only repainted with the
+ * same contents. So the captured pixels are kept in source_data and every
+ * damaged rectangle is compared with them tile by tile before anything is
+ * dithered. Only the rows of the tiles that changed are encoded.
+ * Floyd-Steinberg dithering starts over at the edges of the changed tiles,
+ * so the result is not the same as dithering the whole damaged rectangle.
+ * But the pixels that didn't change keep their indexes, which compresses
+ * better than dithering them again with a different error. */
+
+/* size of the tiles damaged rectangles are compared in */
+#define SOURCE_TILE_WIDTH 64
+#define SOURCE_TILE_HEIGHT 16
+
+static guint64
+byzanz_encoder_gif_count_pixels (const cairo_region_t *region)
+{
+  cairo_rectangle_int_t rect;
+  guint i, n_rects;
+  guint64 n_pixels = 0;
+
   n_rects = cairo_region_num_rectangles (region);
-  memset (area_out, 0, sizeof (cairo_rectangle_int_t));
   for (i = 0; i < n_rects; i++) {
     cairo_region_get_rectangle (region, i, &rect);
-    if (gifenc_dither_rgb_with_full_image (
-          gif->cached_tmp + width * rect.y + rect.x, width,
-	  gif->image_data + width * rect.y + rect.x, width, 
-	  gif->gifenc->palette, 
-          cairo_image_surface_get_data (surface) + (rect.x - extents.x) * 4
-              + (rect.y - extents.y) * stride,
-          rect.width, rect.height, stride, &area)) {
-      area.x += rect.x;
-      area.y += rect.y;
-      if (area_out->width > 0 && area_out->height > 0)
-        gdk_rectangle_union ((const GdkRectangle*)area_out, (const GdkRectangle*) &area, (GdkRectangle*)area_out);
-      else
-        *area_out = area;
+    n_pixels += (guint64) rect.width * rect.height;
+  }
+
+  return n_pixels;
+}
+
+/* The top byte of CAIRO_FORMAT_RGB24 pixels is undefined, so compare
+ * the color channels only. */
+static gboolean
+byzanz_encoder_gif_rows_equal (const guint8 *data,
+                               const guint8 *source,
+                               guint         width)
+{
+  const guint32 *a = (const guint32 *) data;
+  const guint32 *b = (const guint32 *) source;
+  guint x;
+
+  for (x = 0; x < width; x++) {
+    if ((a[x] ^ b[x]) & 0xFFFFFF)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Compares the tile of data with source and copies the rows that changed.
+ * Returns FALSE if nothing changed, otherwise shrinks tile to the changed
+ * rows. */
+static gboolean
+byzanz_encoder_gif_compare_tile (const guint8 *          data,
+                                 guint                   stride,
+                                 guint8 *                source,
+                                 guint                   source_stride,
+                                 cairo_rectangle_int_t * tile)
+{
+  guint bytes = tile->width * 4;
+  int first, last;
+
+  for (first = 0; first < tile->height; first++) {
+    if (!byzanz_encoder_gif_rows_equal (data + first * stride,
+          source + first * source_stride, tile->width))
+      break;
+  }
+  if (first == tile->height)
+    return FALSE;
+  for (last = tile->height - 1; last > first; last--) {
+    if (!byzanz_encoder_gif_rows_equal (data + last * stride,
+          source + last * source_stride, tile->width))
+      break;
+  }
+
+  tile->y += first;
+  tile->height = last - first + 1;
+  for (; first <= last; first++) {
+    memcpy (source + first * source_stride, data + first * stride, bytes);
+  }
+  return TRUE;
+}
+
+/* Returns the part of region whose pixels in surface differ from
+ * source_data and updates source_data with them. */
+static cairo_region_t *
+byzanz_encoder_gif_find_changes (ByzanzEncoderGif *     gif,
+                                 cairo_surface_t *      surface,
+                                 const cairo_region_t * region)
+{
+  cairo_rectangle_int_t extents, rect, tile, run;
+  cairo_region_t *known, *changed, *tiles;
+  const guint8 *data;
+  GArray *runs;
+  guint i, n_rects, stride, source_stride;
+  guint64 n_pixels;
+  int y;
+
+  cairo_region_get_extents (region, &extents);
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+  source_stride = gifenc_get_width (gif->gifenc) * 4;
+
+  /* pixels that were never captured before have changed */
+  known = cairo_region_copy (region);
+  cairo_region_intersect (known, gif->source_region);
+  changed = cairo_region_copy (region);
+  cairo_region_subtract (changed, known);
+  n_rects = cairo_region_num_rectangles (changed);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (changed, i, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y++) {
+      memcpy (gif->source_data + (gsize) y * source_stride + rect.x * 4,
+          data + (y - extents.y) * stride + (rect.x - extents.x) * 4, rect.width * 4);
+    }
+  }
+  cairo_region_union (gif->source_region, changed);
+
+  /* neighboring changed tiles of a row of tiles are merged into runs */
+  runs = g_array_new (FALSE, FALSE, sizeof (cairo_rectangle_int_t));
+  n_rects = cairo_region_num_rectangles (known);
+  for (i = 0; i < n_rects; i++) {
+    cairo_region_get_rectangle (known, i, &rect);
+    for (y = rect.y; y < rect.y + rect.height; y += SOURCE_TILE_HEIGHT) {
+      run.width = 0;
+      for (tile.x = rect.x; tile.x < rect.x + rect.width; tile.x += SOURCE_TILE_WIDTH) {
+        tile.y = y;
+        tile.width = MIN (SOURCE_TILE_WIDTH, rect.x + rect.width - tile.x);
+        tile.height = MIN (SOURCE_TILE_HEIGHT, rect.y + rect.height - y);
+        if (!byzanz_encoder_gif_compare_tile (
+                data + (y - extents.y) * stride + (tile.x - extents.x) * 4, stride,
+                gif->source_data + (gsize) y * source_stride + tile.x * 4, source_stride,
+                &tile)) {
+          if (run.width > 0)
+            g_array_append_val (runs, run);
+          run.width = 0;
+        } else if (run.width > 0) {
+          gdk_rectangle_union ((const GdkRectangle *) &run, (const GdkRectangle *) &tile,
+              (GdkRectangle *) &run);
+        } else {
+          run = tile;
+        }
+      }
+      if (run.width > 0)
+        g_array_append_val (runs, run);
     }
   }
+  tiles = cairo_region_create_rectangles ((cairo_rectangle_int_t *) runs->data, runs->len);
+  cairo_region_union (changed, tiles);
+  cairo_region_destroy (tiles);
+  g_array_free (runs, TRUE);
+  cairo_region_destroy (known);
+
+  n_pixels = byzanz_encoder_gif_count_pixels (region);
+  gif->damaged_pixels += n_pixels;
+  gif->skipped_pixels += n_pixels - byzanz_encoder_gif_count_pixels (changed);
 
-  return area_out->width > 0 && area_out->height > 0;
+  return changed;
 }
 
-static void
-byzanz_encoder_swap_image (ByzanzEncoderGif *      gif,
-                           cairo_rectangle_int_t * area)
+static cairo_user_data_key_t parent_surface_key;
+
+/* The frame functions expect the data of a surface to start at the extents
+ * of the region they get. This returns a surface like that for changed
+ * that shares the pixels of surface captured for region. */
+static cairo_surface_t *
+byzanz_encoder_gif_get_changed_surface (cairo_surface_t *      surface,
+                                        const cairo_region_t * region,
+                                        const cairo_region_t * changed)
 {
-  guint8 *swap;
+  cairo_rectangle_int_t extents, changed_extents;
+  cairo_surface_t *result;
+  guint stride;
 
-  swap = gif->cached_data;
-  gif->cached_data = gif->cached_tmp;
-  gif->cached_tmp = swap;
-  gif->cached_area = *area;
+  cairo_region_get_extents (region, &extents);
+  cairo_region_get_extents (changed, &changed_extents);
+  if (changed_extents.x == extents.x && changed_extents.y == extents.y)
+    return cairo_surface_reference (surface);
+
+  stride = cairo_image_surface_get_stride (surface);
+  result = cairo_image_surface_create_for_data (cairo_image_surface_get_data (surface)
+          + (changed_extents.y - extents.y) * stride + (changed_extents.x - extents.x) * 4,
+      cairo_image_surface_get_format (surface), changed_extents.width,
+      changed_extents.height, stride);
+  cairo_surface_set_user_data (result, &parent_surface_key,
+      cairo_surface_reference (surface), (cairo_destroy_func_t) cairo_surface_destroy);
+
+  return result;
 }
 
 static gboolean
@@ -173,25 +1276,67 @@ byzanz_encoder_gif_process (ByzanzEncoder *        encoder,
                             GError **	           error)
 {
   ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
-  cairo_rectangle_int_t area;
+  cairo_region_t *changed;
+  gboolean success = TRUE;
+
+  /* the first frame is never compared, so it is encoded completely */
+  changed = byzanz_encoder_gif_find_changes (gif, surface, region);
+  if (cairo_region_is_empty (changed)) {
+    /* the previous frame is shown longer */
+    cairo_region_destroy (changed);
+    return TRUE;
+  }
+  surface = byzanz_encoder_gif_get_changed_surface (surface, region, changed);
 
   if (!gif->has_quantized) {
-    if (!byzanz_encoder_gif_quantize (gif, surface, error))
-      return FALSE;
-    gif->cached_time = msecs;
-    if (!byzanz_encoder_gif_encode_image (gif, surface, region, &area)) {
-      g_assert_not_reached ();
+    if (!byzanz_encoder_gif_quantize (gif, surface, error)) {
+      success = FALSE;
+    } else {
+      gif->cached_time = msecs;
+      if (gif->batch) {
+        success = byzanz_encoder_gif_add_to_batch (gif, msecs, surface, changed, error);
+      } else {
+        if (!byzanz_encoder_gif_encode_image (gif, surface, changed)) {
+          g_assert_not_reached ();
+        }
+        byzanz_encoder_swap_image (gif);
+      }
     }
-    byzanz_encoder_swap_image (gif, &area);
+  } else if (gif->batch) {
+    success = byzanz_encoder_gif_add_to_batch (gif, msecs, surface, changed, error);
   } else {
-    if (byzanz_encoder_gif_encode_image (gif, surface, region, &area)) {
-      if (!byzanz_encoder_write_image (gif, msecs, error))
-        return FALSE;
-      byzanz_encoder_swap_image (gif, &area);
+    if (byzanz_encoder_gif_encode_image (gif, surface, changed)) {
+      success = byzanz_encoder_write_image (gif, msecs, error);
+      if (success)
+        byzanz_encoder_swap_image (gif);
     }
   }
 
-  return TRUE;
+  cairo_surface_destroy (surface);
+  cairo_region_destroy (changed);
+  return success;
+}
+
+static void
+byzanz_encoder_gif_print_statistics (ByzanzEncoderGif *gif)
+{
+  const GifencStats *stats = gifenc_get_stats (gif->gifenc);
+
+  g_print (_("Wrote %" G_GUINT64_FORMAT " images with %" G_GUINT64_FORMAT " bytes of image data.\n"),
+      stats->n_images, stats->image_bytes);
+  if (stats->n_local_palettes > 0) {
+    g_print (_("%" G_GUINT64_FORMAT " images got their own palette.\n"),
+        stats->n_local_palettes);
+  }
+  if (gif->gifenc->lossy && stats->exact_image_bytes > 0) {
+    g_print (_("Lossy compression saved %" G_GINT64_FORMAT " bytes (%.1f%%).\n"),
+        (gint64) (stats->exact_image_bytes - stats->image_bytes),
+        100.0 - 100.0 * stats->image_bytes / stats->exact_image_bytes);
+  }
+  if (gif->damaged_pixels > 0) {
+    g_print (_("%.1f%% of the damaged pixels didn't change and weren't dithered.\n"),
+        100.0 * gif->skipped_pixels / gif->damaged_pixels);
+  }
 }
 
 static gboolean
@@ -208,23 +1353,120 @@ byzanz_encoder_gif_close (ByzanzEncoder *  encoder,
     return FALSE;
   }
 
+  if (gif->batch && gif->batch->len > 0 &&
+      !byzanz_encoder_gif_flush_batch (gif, error))
+    return FALSE;
+
   if (!byzanz_encoder_write_image (gif, msecs, error) ||
+      !byzanz_encoder_gif_stop_writer (gif, error) ||
       !gifenc_close (gif->gifenc, error))
     return FALSE;
 
+  if (gif->print_statistics)
+    byzanz_encoder_gif_print_statistics (gif);
+
   return TRUE;
 }
 
+/* In two-pass mode, the colors of all frames are collected before
+ * encoding starts, so colors that only show up later in the recording
+ * get into the palette, too. */
+
+/* maximum number of pixels to look at in every rectangle of the frames
+ * after the first one, so the first pass stays fast */
+#define MAX_COLLECT_SAMPLES (256 * 256)
+
+static gboolean
+byzanz_encoder_gif_collect_colors (ByzanzEncoderGif * gif,
+                                   GInputStream *     input,
+                                   GCancellable *     cancellable,
+                                   GError **          error)
+{
+  cairo_surface_t *surface;
+  cairo_region_t *region;
+  gboolean first = TRUE;
+  guint width, height;
+  guint64 msecs;
+
+  if (!byzanz_deserialize_header (input, &width, &height, cancellable, error))
+    return FALSE;
+
+  gif->histogram = gifenc_histogram_new ();
+  for (;;) {
+    if (!byzanz_deserialize (input, &msecs, &surface, &region, cancellable, error))
+      return FALSE;
+    if (surface == NULL)
+      return TRUE;
+
+    byzanz_encoder_gif_collect_frame (gif->histogram, surface, region,
+        first ? MAX_QUANTIZE_SAMPLES : MAX_COLLECT_SAMPLES);
+    first = FALSE;
+    cairo_surface_destroy (surface);
+    cairo_region_destroy (region);
+  }
+}
+
+static gboolean
+byzanz_encoder_gif_run (ByzanzEncoder * encoder,
+                        GInputStream *  input,
+                        GOutputStream * output,
+                        gboolean        record_audio,
+                        GCancellable *  cancellable,
+                        GError **	error)
+{
+  ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (encoder);
+  ByzanzEncoderClass *parent_class = BYZANZ_ENCODER_CLASS (byzanz_encoder_gif_parent_class);
+  gboolean two_pass = FALSE;
+  goffset start;
+
+  if (encoder->options)
+    g_variant_lookup (encoder->options, "two-pass", "b", &two_pass);
+  /* GIFs can't contain audio, the parent class reports that */
+  if (!two_pass || record_audio)
+    return parent_class->run (encoder, input, output, record_audio, cancellable, error);
+
+  if (!G_IS_SEEKABLE (input) || !g_seekable_can_seek (G_SEEKABLE (input))) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        _("Two-pass encoding needs to read the recording twice, but it can't be read again."));
+    return FALSE;
+  }
+
+  start = g_seekable_tell (G_SEEKABLE (input));
+  return byzanz_encoder_gif_collect_colors (gif, input, cancellable, error) &&
+    g_seekable_seek (G_SEEKABLE (input), start, G_SEEK_SET, cancellable, error) &&
+    parent_class->run (encoder, input, output, record_audio, cancellable, error);
+}
+
 static void
 byzanz_encoder_gif_finalize (GObject *object)
 {
   ByzanzEncoderGif *gif = BYZANZ_ENCODER_GIF (object);
 
   g_free (gif->image_data);
-  g_free (gif->cached_data);
-  g_free (gif->cached_tmp);
+  g_free (gif->source_data);
+  if (gif->source_region)
+    cairo_region_destroy (gif->source_region);
+  /* images must be freed before the encoder they belong to */
+  byzanz_encoder_gif_stop_writer (gif, NULL);
+  if (gif->write_queue)
+    g_async_queue_unref (gif->write_queue);
+  if (gif->write_slots)
+    g_async_queue_unref (gif->write_slots);
+  if (gif->batch)
+    g_ptr_array_unref (gif->batch);
+  if (gif->cached_images)
+    g_ptr_array_unref (gif->cached_images);
+  if (gif->cached_images_tmp)
+    g_ptr_array_unref (gif->cached_images_tmp);
   if (gif->gifenc)
     gifenc_free (gif->gifenc);
+  if (gif->histogram)
+    gifenc_histogram_free (gif->histogram);
+  if (gif->local_palette)
+    gifenc_palette_free (gif->local_palette);
+  if (gif->local_histogram)
+    gifenc_histogram_free (gif->local_histogram);
+  g_free (gif->image_palettes);
 
   G_OBJECT_CLASS (byzanz_encoder_gif_parent_class)->finalize (object);
 }
@@ -237,6 +1479,7 @@ byzanz_encoder_gif_class_init (ByzanzEncoderGifClass *klass)
 
   object_class->finalize = byzanz_encoder_gif_finalize;
 
+  encoder_class->run = byzanz_encoder_gif_run;
   encoder_class->setup = byzanz_encoder_gif_setup;
   encoder_class->process = byzanz_encoder_gif_process;
   encoder_class->close = byzanz_encoder_gif_close;
@@ -35,15 +35,42 @@ struct _ByzanzEncoderGif {
   ByzanzEncoder         encoder;
 
   Gifenc *		gifenc;		/* encoder used to encode the image */
+  gboolean		print_statistics; /* print statistics when done */
+  gboolean		measure_lossy;	/* also compress losslessly to print the savings of lossy compression */
+  gboolean		optimize;	/* let unchanged pixels continue LZW strings */
+  gboolean		fast_colors;	/* look up colors in a table */
+  gboolean		ordered_dither;	/* use ordered instead of Floyd-Steinberg dithering */
+  GifencQuantizer	quantizer;	/* algorithm computing the palette */
+  GifencHistogram *	histogram;	/* colors of all frames in two-pass mode or NULL */
+  GifencPalette *	local_palette;	/* palette for frames that don't fit the global one or NULL */
+  guint			local_palette_serial; /* number of local palettes computed so far */
+  guint			local_palette_error; /* error of local_palette for the frame it was computed for */
+  GifencHistogram *	local_histogram; /* colors local_palette was computed from or NULL */
 
   gboolean              has_quantized;  /* qantization has happened already */
   guint8 *              image_data;     /* width * height of encoded image */
+  guint8 *		image_palettes;	/* width * height ids of the palettes of image_data or NULL */
+  guint			image_palette_serial; /* serial of the local palette with image_palette_id */
+  guint8		image_palette_id; /* id of the last local palette in image_palettes */
 
-  cairo_rectangle_int_t cached_area;    /* area that is saved in cached_data */
-  guint8 *              cached_data;    /* cached_area.{width x height} sized area of image */
-  guint64               cached_time;    /* timestamp the cached image corresponds to */
+  GPtrArray *           cached_images;  /* GifencImages of the frame to write next */
+  guint64               cached_time;    /* timestamp the cached images correspond to */
 
-  guint8 *		cached_tmp;	/* temporary data to swap cached_data with */
+  GPtrArray *		cached_images_tmp; /* temporary images to swap cached_images with */
+
+  GThread *		writer;		/* thread writing the encoded images */
+  GAsyncQueue *		write_queue;	/* ByzanzEncoderGifWrite items for writer */
+  GAsyncQueue *		write_slots;	/* tokens bounding the length of write_queue */
+  gint			write_failed;	/* set by writer when writing failed, atomic */
+
+  guint			batch_size;	/* maximum number of frames to encode at once */
+  GPtrArray *		batch;		/* frames waiting to be encoded */
+  gsize			batch_pixels;	/* number of pixels in batch */
+
+  guint8 *		source_data;	/* width * height captured pixels of the frames so far */
+  cairo_region_t *	source_region;	/* region of source_data that holds captured pixels */
+  guint64		damaged_pixels;	/* number of pixels reported as damaged */
+  guint64		skipped_pixels;	/* number of damaged pixels that didn't change */
 };
 
 struct _ByzanzEncoderGifClass {
@@ -0,0 +1,153 @@
+/* desktop session recorder
+ * Copyright (C) 2009 Benjamin Otte <otte@gnome.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Writes more than fits into the files of a ByzanzQueue and reads it back,
+ * seeking around in it. Run it with "make check". */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "byzanzqueue.h"
+#include "byzanzqueueinputstream.h"
+
+/* spans 3 files, the last one partially */
+#define TOTAL_SIZE (2 * BYZANZ_QUEUE_FILE_SIZE + 1234567)
+#define BLOCK_SIZE (1024 * 1024)
+
+/* the byte at every offset of the queue */
+static void
+fill (guint8 *data, goffset offset, gsize len)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++) {
+    data[i] = ((offset + i) * 2654435761u) >> 24;
+  }
+}
+
+static void
+write_queue (ByzanzQueue *queue)
+{
+  GOutputStream *output = byzanz_queue_get_output_stream (queue);
+  GError *error = NULL;
+  guint8 *data;
+  goffset offset;
+  gsize len;
+
+  data = g_malloc (BLOCK_SIZE);
+  for (offset = 0; offset < TOTAL_SIZE; offset += len) {
+    len = MIN (BLOCK_SIZE, TOTAL_SIZE - offset);
+    fill (data, offset, len);
+    g_output_stream_write_all (output, data, len, NULL, NULL, &error);
+    g_assert_no_error (error);
+  }
+  g_output_stream_close (output, NULL, &error);
+  g_assert_no_error (error);
+  g_free (data);
+}
+
+/* reads len bytes from input and checks they are the ones at its offset */
+static void
+check_read (GInputStream *input, gsize len)
+{
+  GError *error = NULL;
+  guint8 *data, *expected;
+  goffset offset;
+  gsize n, read;
+
+  offset = g_seekable_tell (G_SEEKABLE (input));
+  data = g_malloc (BLOCK_SIZE);
+  expected = g_malloc (BLOCK_SIZE);
+  while (len > 0) {
+    n = MIN (BLOCK_SIZE, len);
+    g_input_stream_read_all (input, data, n, &read, NULL, &error);
+    g_assert_no_error (error);
+    g_assert_cmpuint (read, ==, n);
+    fill (expected, offset, n);
+    g_assert (memcmp (data, expected, n) == 0);
+    offset += n;
+    len -= n;
+  }
+  g_assert_cmpint (g_seekable_tell (G_SEEKABLE (input)), ==, offset);
+  g_free (data);
+  g_free (expected);
+}
+
+static void
+check_seek (GInputStream *input, goffset offset, GSeekType type)
+{
+  GError *error = NULL;
+
+  g_seekable_seek (G_SEEKABLE (input), offset, type, NULL, &error);
+  g_assert_no_error (error);
+}
+
+static void
+test_seek (void)
+{
+  ByzanzQueue *queue;
+  GInputStream *input;
+  GError *error = NULL;
+
+  queue = byzanz_queue_new ();
+  input = byzanz_queue_get_input_stream (queue);
+  g_assert (!g_seekable_can_seek (G_SEEKABLE (input)));
+  byzanz_queue_input_stream_set_seekable (BYZANZ_QUEUE_INPUT_STREAM (input));
+  g_assert (g_seekable_can_seek (G_SEEKABLE (input)));
+  write_queue (queue);
+
+  /* read into the second file */
+  check_read (input, BYZANZ_QUEUE_FILE_SIZE + 1000);
+  /* seek back into the first file and read across the boundary */
+  check_seek (input, 1000, G_SEEK_SET);
+  g_assert_cmpint (g_seekable_tell (G_SEEKABLE (input)), ==, 1000);
+  check_read (input, BYZANZ_QUEUE_FILE_SIZE);
+  /* seek back to exactly the start of the second file */
+  check_seek (input, BYZANZ_QUEUE_FILE_SIZE, G_SEEK_SET);
+  check_read (input, 4096);
+  check_seek (input, -4096 - 3, G_SEEK_CUR);
+  check_read (input, 3 * BLOCK_SIZE);
+
+  /* seeking to data that wasn't read yet fails */
+  g_seekable_seek (G_SEEKABLE (input), TOTAL_SIZE, G_SEEK_SET, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+  g_clear_error (&error);
+  g_seekable_seek (G_SEEKABLE (input), 0, G_SEEK_END, NULL, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+  g_clear_error (&error);
+
+  /* read the rest, including the file that wasn't read before. Reading
+   * more would wait for the recording to continue. */
+  check_read (input, TOTAL_SIZE - g_seekable_tell (G_SEEKABLE (input)));
+
+  g_input_stream_close (input, NULL, &error);
+  g_assert_no_error (error);
+  g_object_unref (queue);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/queue/seek", test_seek);
+
+  return g_test_run ();
+}
@@ -21,7 +21,12 @@
 
 #include "byzanzqueueinputstream.h"
 
-G_DEFINE_TYPE (ByzanzQueueInputStream, byzanz_queue_input_stream, G_TYPE_INPUT_STREAM)
+#include <glib/gi18n-lib.h>
+
+static void byzanz_queue_input_stream_seekable_init (GSeekableIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (ByzanzQueueInputStream, byzanz_queue_input_stream, G_TYPE_INPUT_STREAM,
+    G_IMPLEMENT_INTERFACE (G_TYPE_SEEKABLE, byzanz_queue_input_stream_seekable_init))
 
 static gboolean
 byzanz_queue_input_stream_close_input (ByzanzQueueInputStream *stream,
@@ -40,6 +45,20 @@ byzanz_queue_input_stream_close_input (ByzanzQueueInputStream *stream,
   return TRUE;
 }
 
+static void
+byzanz_queue_input_stream_delete_files (ByzanzQueueInputStream *stream)
+{
+  guint i;
+
+  if (stream->files == NULL)
+    return;
+
+  for (i = 0; i < stream->files->len; i++)
+    g_file_delete (g_ptr_array_index (stream->files, i), NULL, NULL);
+  g_ptr_array_set_size (stream->files, 0);
+  stream->next_file = 0;
+}
+
 static void
 byzanz_queue_input_stream_dispose (GObject *object)
 {
@@ -63,6 +82,10 @@ byzanz_queue_input_stream_finalize (GObject *object)
 
   if (!byzanz_queue_input_stream_close_input (stream, NULL, NULL))
     g_object_unref (stream->input);
+  if (stream->files) {
+    byzanz_queue_input_stream_delete_files (stream);
+    g_ptr_array_unref (stream->files);
+  }
 
   G_OBJECT_CLASS (byzanz_queue_input_stream_parent_class)->finalize (object);
 }
@@ -107,6 +130,16 @@ byzanz_queue_input_stream_ensure_input (ByzanzQueueInputStream *stream,
   if (stream->input != NULL)
     return TRUE;
 
+  /* read the files we kept after seeking back */
+  if (stream->files && stream->next_file < stream->files->len) {
+    file = g_ptr_array_index (stream->files, stream->next_file);
+    stream->input = G_INPUT_STREAM (g_file_read (file, cancellable, error));
+    if (stream->input == NULL)
+      return FALSE;
+    stream->next_file++;
+    return TRUE;
+  }
+
   g_async_queue_lock (stream->queue->files);
   do {
     file = g_async_queue_try_pop_unlocked (stream->queue->files);
@@ -125,8 +158,13 @@ byzanz_queue_input_stream_ensure_input (ByzanzQueueInputStream *stream,
     return TRUE;
 
   stream->input = G_INPUT_STREAM (g_file_read (file, cancellable, error));
-  g_file_delete (file, NULL, NULL);
-  g_object_unref (file);
+  if (stream->files) {
+    g_ptr_array_add (stream->files, file);
+    stream->next_file++;
+  } else {
+    g_file_delete (file, NULL, NULL);
+    g_object_unref (file);
+  }
 
   return stream->input != NULL;
 }
@@ -161,6 +199,7 @@ retry:
   }
 
   stream->input_bytes += result;
+  stream->offset += result;
   return result;
 }
 
@@ -193,6 +232,7 @@ retry:
   }
 
   stream->input_bytes += result;
+  stream->offset += result;
   return result;
 }
 
@@ -206,6 +246,7 @@ byzanz_queue_input_stream_close (GInputStream * input_stream,
 
   if (!byzanz_queue_input_stream_close_input (stream, cancellable, error))
     return FALSE;
+  byzanz_queue_input_stream_delete_files (stream);
 
   g_async_queue_lock (stream->queue->files);
   stream->queue->input_closed = TRUE;
@@ -220,6 +261,93 @@ byzanz_queue_input_stream_close (GInputStream * input_stream,
   return TRUE;
 }
 
+static goffset
+byzanz_queue_input_stream_tell (GSeekable *seekable)
+{
+  return BYZANZ_QUEUE_INPUT_STREAM (seekable)->offset;
+}
+
+static gboolean
+byzanz_queue_input_stream_can_seek (GSeekable *seekable)
+{
+  return BYZANZ_QUEUE_INPUT_STREAM (seekable)->files != NULL;
+}
+
+/* Only seeking back is supported, to data that was read before. */
+static gboolean
+byzanz_queue_input_stream_seek (GSeekable *   seekable,
+				goffset       offset,
+				GSeekType     type,
+				GCancellable *cancellable,
+				GError **     error)
+{
+  ByzanzQueueInputStream *stream = BYZANZ_QUEUE_INPUT_STREAM (seekable);
+  gssize result;
+  goffset skip;
+
+  if (type == G_SEEK_CUR)
+    offset += stream->offset;
+
+  if (stream->files == NULL || type == G_SEEK_END ||
+      offset < 0 || offset > stream->offset) {
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        _("Can only seek back to data that was already read."));
+    return FALSE;
+  }
+
+  if (!byzanz_queue_input_stream_close_input (stream, cancellable, error))
+    return FALSE;
+
+  /* all files but the last one are filled up completely */
+  stream->next_file = offset / (BYZANZ_QUEUE_FILE_SIZE);
+  skip = offset % (BYZANZ_QUEUE_FILE_SIZE);
+  stream->offset = offset - skip;
+
+  while (skip > 0) {
+    if (!byzanz_queue_input_stream_ensure_input (stream, cancellable, error))
+      return FALSE;
+    result = g_input_stream_skip (stream->input, skip, cancellable, error);
+    if (result <= 0) {
+      if (result == 0)
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+            _("Recording was truncated."));
+      return FALSE;
+    }
+    stream->input_bytes += result;
+    stream->offset += result;
+    skip -= result;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+byzanz_queue_input_stream_can_truncate (GSeekable *seekable)
+{
+  return FALSE;
+}
+
+static gboolean
+byzanz_queue_input_stream_truncate (GSeekable *   seekable,
+				    goffset       offset,
+				    GCancellable *cancellable,
+				    GError **     error)
+{
+  g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+      _("Cannot truncate the recording."));
+  return FALSE;
+}
+
+static void
+byzanz_queue_input_stream_seekable_init (GSeekableIface *iface)
+{
+  iface->tell = byzanz_queue_input_stream_tell;
+  iface->can_seek = byzanz_queue_input_stream_can_seek;
+  iface->seek = byzanz_queue_input_stream_seek;
+  iface->can_truncate = byzanz_queue_input_stream_can_truncate;
+  iface->truncate_fn = byzanz_queue_input_stream_truncate;
+}
+
 static void
 byzanz_queue_input_stream_class_init (ByzanzQueueInputStreamClass *klass)
 {
@@ -253,3 +381,20 @@ byzanz_queue_input_stream_new (ByzanzQueue *queue)
   return G_INPUT_STREAM (stream);
 }
 
+/**
+ * byzanz_queue_input_stream_set_seekable:
+ * @stream: a #ByzanzQueueInputStream that nothing was read from yet
+ *
+ * Keeps the files of the queue around after they were read instead of
+ * deleting them, so @stream can seek back. They are deleted when @stream
+ * is closed.
+ **/
+void
+byzanz_queue_input_stream_set_seekable (ByzanzQueueInputStream *stream)
+{
+  g_return_if_fail (BYZANZ_IS_QUEUE_INPUT_STREAM (stream));
+  g_return_if_fail (stream->offset == 0);
+
+  if (stream->files == NULL)
+    stream->files = g_ptr_array_new_with_free_func (g_object_unref);
+}
@@ -36,6 +36,10 @@ struct _ByzanzQueueInputStream {
   ByzanzQueue *		queue;		/* queue we belong to */
   GInputStream *	input;		/* stream we're reading from or NULL if we need to open one */
   goffset		input_bytes;	/* bytes we've already read from input */
+  goffset		offset;		/* bytes we've already read from the queue */
+
+  GPtrArray *		files;		/* files we've read, kept for seeking back, or NULL */
+  guint			next_file;	/* index of the next file in files to read */
 };
 
 struct _ByzanzQueueInputStreamClass {
@@ -46,5 +50,7 @@ GType		byzanz_queue_input_stream_get_type		(void) G_GNUC_CONST;
 
 GInputStream *	byzanz_queue_input_stream_new			(ByzanzQueue *	queue);
 
+void		byzanz_queue_input_stream_set_seekable		(ByzanzQueueInputStream *stream);
+
 
 #endif /* __HAVE_BYZANZ_QUEUE_INPUT_STREAM_H__ */
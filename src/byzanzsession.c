@@ -36,6 +36,7 @@
 #include <X11/extensions/Xfixes.h>
 
 #include "byzanzencoder.h"
+#include "byzanzqueueinputstream.h"
 #include "byzanzrecorder.h"
 #include "byzanzserialize.h"
 
@@ -50,7 +51,8 @@ enum {
   PROP_AREA,
   PROP_WINDOW,
   PROP_AUDIO,
-  PROP_ENCODER_TYPE
+  PROP_ENCODER_TYPE,
+  PROP_OPTIONS
 };
 
 G_DEFINE_TYPE (ByzanzSession, byzanz_session, G_TYPE_OBJECT)
@@ -86,6 +88,9 @@ byzanz_session_get_property (GObject *object, guint param_id, GValue *value,
     case PROP_ENCODER_TYPE:
       g_value_set_gtype (value, session->encoder_type);
       break;
+    case PROP_OPTIONS:
+      g_value_set_variant (value, session->options);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -114,6 +119,9 @@ byzanz_session_set_property (GObject *object, guint param_id, const GValue *valu
     case PROP_ENCODER_TYPE:
       session->encoder_type = g_value_get_gtype (value);
       break;
+    case PROP_OPTIONS:
+      session->options = g_value_dup_variant (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
       break;
@@ -225,6 +233,8 @@ byzanz_session_finalize (GObject *object)
   g_object_unref (session->window);
   g_object_unref (session->file);
   g_object_unref (session->queue);
+  if (session->options)
+    g_variant_unref (session->options);
 
   if (session->error)
     g_error_free (session->error);
@@ -237,6 +247,14 @@ byzanz_session_constructed (GObject *object)
 {
   ByzanzSession *session = BYZANZ_SESSION (object);
   GOutputStream *stream;
+  gboolean two_pass = FALSE;
+
+  /* two-pass GIF encoding reads the recording twice */
+  if (session->options)
+    g_variant_lookup (session->options, "two-pass", "b", &two_pass);
+  if (two_pass)
+    byzanz_queue_input_stream_set_seekable (BYZANZ_QUEUE_INPUT_STREAM (
+          byzanz_queue_get_input_stream (session->queue)));
 
   session->recorder = byzanz_recorder_new (session->window, &session->area);
   g_signal_connect (session->recorder, "notify::recording", 
@@ -250,7 +268,7 @@ byzanz_session_constructed (GObject *object)
   if (stream != NULL) {
     session->encoder = byzanz_encoder_new (session->encoder_type, 
         byzanz_queue_get_input_stream (session->queue),
-        stream, session->record_audio, session->cancellable);
+        stream, session->record_audio, session->options, session->cancellable);
     g_signal_connect (session->encoder, "notify", 
         G_CALLBACK (byzanz_session_encoder_notify_cb), session);
     g_object_unref (stream);
@@ -299,6 +317,9 @@ byzanz_session_class_init (ByzanzSessionClass *klass)
   g_object_class_install_property (object_class, PROP_ENCODER_TYPE,
       g_param_spec_gtype ("encoder-type", "encoder type", "type for the encoder to use",
 	  BYZANZ_TYPE_ENCODER, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+  g_object_class_install_property (object_class, PROP_OPTIONS,
+      g_param_spec_variant ("options", "options", "options passed to the encoder",
+	  G_VARIANT_TYPE_VARDICT, NULL, G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
 }
 
 static void
@@ -316,6 +337,7 @@ byzanz_session_init (ByzanzSession *session)
  * @area: area of window that should be recorded
  * @record_cursor: if the cursor image should be recorded
  * @record_audio: if audio should be recorded
+ * @options: NULL or a{sv} dictionary of encoder-specific options
  *
  * Creates a new #ByzanzSession and initializes all basic variables. 
  * gtk_init() and g_thread_init() must have been called before.
@@ -327,7 +349,7 @@ byzanz_session_init (ByzanzSession *session)
 ByzanzSession *
 byzanz_session_new (GFile *file, GType encoder_type, 
     GdkWindow *window, const cairo_rectangle_int_t *area, gboolean record_cursor,
-    gboolean record_audio)
+    gboolean record_audio, GVariant *options)
 {
   g_return_val_if_fail (G_IS_FILE (file), NULL);
   g_return_val_if_fail (g_type_is_a (encoder_type, BYZANZ_TYPE_ENCODER), NULL);
@@ -337,11 +359,14 @@ byzanz_session_new (GFile *file, GType encoder_type,
   g_return_val_if_fail (area->y >= 0, NULL);
   g_return_val_if_fail (area->width > 0, NULL);
   g_return_val_if_fail (area->height > 0, NULL);
+  g_return_val_if_fail (options == NULL || 
+      g_variant_is_of_type (options, G_VARIANT_TYPE_VARDICT), NULL);
   
   /* FIXME: handle mouse cursor */
 
   return g_object_new (BYZANZ_TYPE_SESSION, "file", file, "encoder-type", encoder_type,
-      "window", window, "area", area, "record-audio", record_audio, NULL);
+      "window", window, "area", area, "record-audio", record_audio, 
+      "options", options, NULL);
 }
 
 void
@@ -45,6 +45,7 @@ struct _ByzanzSession {
   GdkWindow *           window;         /* window to record */
   gboolean              record_audio;   /* TRUE to record audio */
   GType                 encoder_type;   /* type of encoder to use */
+  GVariant *            options;        /* NULL or options to pass to encoder */
   ByzanzQueue *         queue;          /* queue we use as data cache */
   GTimeVal              start_time;     /* when we started writing to queue */
 
@@ -67,7 +68,8 @@ ByzanzSession * 	byzanz_session_new		(GFile *                        file,
 							 GdkWindow *		        window,
 							 const cairo_rectangle_int_t *	area,
 							 gboolean		        record_cursor,
-                                                         gboolean                       record_audio);
+                                                         gboolean                       record_audio,
+                                                         GVariant *                     options);
 void			byzanz_session_start		(ByzanzSession *	session);
 void			byzanz_session_stop		(ByzanzSession *	session);
 void			byzanz_session_abort            (ByzanzSession *	session);
@@ -24,8 +24,20 @@
 #include "byzanzencoder.h"
 #include "byzanzserialize.h"
 
+static gboolean verbose = FALSE;
+static ByzanzEncoderOptions options = { 0, };
+
 static GOptionEntry entries[] = 
 {
+  { "batch", 0, 0, G_OPTION_ARG_INT, &options.batch, N_("Encode this many GIF frames at once to use all processors (default: 4 per processor)"), N_("FRAMES") },
+  { "lossy", 0, 0, G_OPTION_ARG_INT, &options.lossy, N_("Allow GIF colors to differ by this much to compress better (default: 0)"), N_("TOLERANCE") },
+  { "optimize", 0, 0, G_OPTION_ARG_NONE, &options.optimize, N_("Spend more time to compress GIF recordings better"), NULL },
+  { "fast-colors", 0, 0, G_OPTION_ARG_NONE, &options.fast_colors, N_("Find GIF colors faster but less exactly"), NULL },
+  { "ordered-dither", 0, 0, G_OPTION_ARG_NONE, &options.ordered_dither, N_("Dither GIF colors with a fixed pattern that doesn't change between frames"), NULL },
+  { "quantizer", 0, 0, G_OPTION_ARG_STRING, &options.quantizer, N_("Algorithm choosing GIF colors: octree, median-cut or wu (default: octree)"), N_("NAME") },
+  { "two-pass", 0, 0, G_OPTION_ARG_NONE, &options.two_pass, N_("Compute GIF colors from the whole recording before encoding"), NULL },
+  { "measure-lossy", 0, 0, G_OPTION_ARG_NONE, &options.measure_lossy, N_("Also compress GIFs losslessly to print the savings of --lossy with --verbose"), NULL },
+  { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, N_("Be verbose"), NULL },
   { NULL }
 };
 
@@ -86,6 +98,11 @@ main (int argc, char **argv)
     return 0;
   }
 
+  /* the whole recording is available, so encode many frames in parallel */
+  if (options.batch <= 0)
+    options.batch = 4 * g_get_num_processors ();
+  options.statistics = verbose;
+
   infile = g_file_new_for_commandline_arg (argv[1]);
   outfile = g_file_new_for_commandline_arg (argv[2]);
   loop = g_main_loop_new (NULL, FALSE);
@@ -104,7 +121,7 @@ main (int argc, char **argv)
     return 1;
   }
   encoder = byzanz_encoder_new (byzanz_encoder_get_type_from_file (outfile),
-      instream, outstream, FALSE, NULL);
+      instream, outstream, FALSE, byzanz_encoder_options_to_variant (&options), NULL);
   
   g_signal_connect (encoder, "notify", G_CALLBACK (encoder_notify), loop);
   
@@ -28,6 +28,7 @@ static int delay = 1;
 static gboolean cursor = FALSE;
 static gboolean audio = FALSE;
 static gboolean verbose = FALSE;
+static ByzanzEncoderOptions options = { 0, };
 static char *exec = NULL;
 static cairo_rectangle_int_t area = { 0, 0, G_MAXINT / 2, G_MAXINT / 2 };
 
@@ -42,6 +43,13 @@ static GOptionEntry entries[] =
   { "y", 'y', 0, G_OPTION_ARG_INT, &area.y, N_("Y coordinate of rectangle to record"), N_("PIXEL") },
   { "width", 'w', 0, G_OPTION_ARG_INT, &area.width, N_("Width of recording rectangle"), N_("PIXEL") },
   { "height", 'h', 0, G_OPTION_ARG_INT, &area.height, N_("Height of recording rectangle"), N_("PIXEL") },
+  { "lossy", 0, 0, G_OPTION_ARG_INT, &options.lossy, N_("Allow GIF colors to differ by this much to compress better (default: 0)"), N_("TOLERANCE") },
+  { "optimize", 0, 0, G_OPTION_ARG_NONE, &options.optimize, N_("Spend more time to compress GIF recordings better"), NULL },
+  { "fast-colors", 0, 0, G_OPTION_ARG_NONE, &options.fast_colors, N_("Find GIF colors faster but less exactly"), NULL },
+  { "ordered-dither", 0, 0, G_OPTION_ARG_NONE, &options.ordered_dither, N_("Dither GIF colors with a fixed pattern that doesn't change between frames"), NULL },
+  { "quantizer", 0, 0, G_OPTION_ARG_STRING, &options.quantizer, N_("Algorithm choosing GIF colors: octree, median-cut or wu (default: octree)"), N_("NAME") },
+  { "two-pass", 0, 0, G_OPTION_ARG_NONE, &options.two_pass, N_("Compute GIF colors from the whole recording once it is done"), NULL },
+  { "measure-lossy", 0, 0, G_OPTION_ARG_NONE, &options.measure_lossy, N_("Also compress GIFs losslessly to print the savings of --lossy with --verbose"), NULL },
   { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, N_("Be verbose"), NULL },
   { NULL }
 };
@@ -187,13 +195,19 @@ main (int argc, char **argv)
     usage ();
     return 0;
   }
+  if (options.two_pass && audio) {
+    g_print (_("--two-pass only works for GIF recordings, which can't contain audio.\n"));
+    return 1;
+  }
   if (!clamp_to_window (&area, gdk_get_default_root_window (), &area)) {
     g_print (_("Given area is not inside desktop.\n"));
     return 1;
   }
+  options.statistics = verbose;
   file = g_file_new_for_commandline_arg (argv[1]);
   rec = byzanz_session_new (file, byzanz_encoder_get_type_from_file (file),
-      gdk_get_default_root_window (), &area, cursor, audio);
+      gdk_get_default_root_window (), &area, cursor, audio,
+      byzanz_encoder_options_to_variant (&options));
   g_object_unref (file);
   g_signal_connect (rec, "notify", G_CALLBACK (session_notify_cb), NULL);
   